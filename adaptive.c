@@ -0,0 +1,139 @@
+#include "adaptive.h"
+
+
+Sizer new_sizer(size_t capacity, size_t max_key) {
+    Sizer s          = malloc(sizeof(struct sizer));
+    s->capacity      = capacity;
+    s->min_capacity  = capacity;
+    s->max_capacity  = capacity;
+    s->byte_budget   = 0;
+
+    s->ghost_hits     = 0;
+    s->tail_hits      = 0;
+    s->epoch_requests = 0;
+
+    s->max_key     = max_key;
+    s->ghost_slot  = malloc((max_key + 1) * sizeof(int));
+    s->ghosts      = malloc(GHOST_CAPACITY * sizeof(size_t));
+    s->ghost_head  = 0;
+    s->ghost_count = 0;
+
+    for (size_t ix = 0; ix <= max_key; ix++)
+        s->ghost_slot[ix] = -1;
+
+    return s;
+}
+
+void sizer_free(Sizer s) {
+    free(s->ghost_slot);
+    free(s->ghosts);
+    free(s);
+}
+
+void sizer_configure(Sizer s, size_t min, size_t max, size_t byte_budget,
+                     size_t limit) {
+    if (max > limit)
+        max = limit;
+    if (min > max)
+        min = max;
+    if (min == 0)
+        min = 1;
+
+    s->min_capacity = min;
+    s->max_capacity = max < min ? min : max;
+    s->byte_budget  = byte_budget;
+
+    if (s->capacity < s->min_capacity)
+        s->capacity = s->min_capacity;
+    if (s->capacity > s->max_capacity)
+        s->capacity = s->max_capacity;
+}
+
+bool sizer_is_adaptive(Sizer s) {
+    return s->min_capacity < s->max_capacity || s->byte_budget > 0;
+}
+
+size_t sizer_step(Sizer s) {
+    size_t step = s->capacity / 8;
+    return step < ADAPT_MIN_STEP ? ADAPT_MIN_STEP : step;
+}
+
+void sizer_record_hit(Sizer s, size_t position) {
+    s->epoch_requests++;
+
+    size_t step = sizer_step(s);
+    if (position + step >= s->capacity)
+        s->tail_hits++;
+}
+
+bool sizer_record_miss(Sizer s, size_t key) {
+    s->epoch_requests++;
+
+    if (key > s->max_key || s->ghost_slot[key] < 0)
+        return false;
+
+    // age 0 is the newest ghost
+    size_t slot = s->ghost_slot[key];
+    size_t age  = (s->ghost_head + GHOST_CAPACITY - slot - 1) % GHOST_CAPACITY;
+
+    s->ghost_slot[key] = -1;
+
+    if (age >= sizer_step(s))
+        return false;
+
+    s->ghost_hits++;
+    return true;
+}
+
+void sizer_record_eviction(Sizer s, size_t key) {
+    if (key > s->max_key)
+        return;
+
+    // the key being overwritten may have been hit or re-evicted since
+    if (s->ghost_count == GHOST_CAPACITY) {
+        size_t old_key = s->ghosts[s->ghost_head];
+        if (s->ghost_slot[old_key] == (int)s->ghost_head)
+            s->ghost_slot[old_key] = -1;
+    } else {
+        s->ghost_count++;
+    }
+
+    s->ghosts[s->ghost_head] = key;
+    s->ghost_slot[key]       = s->ghost_head;
+    s->ghost_head            = (s->ghost_head + 1) % GHOST_CAPACITY;
+}
+
+bool sizer_over_budget(Sizer s, size_t bytes_used) {
+    return s->byte_budget > 0 && bytes_used > s->byte_budget;
+}
+
+size_t sizer_update(Sizer s, size_t bytes_used, size_t entries) {
+    if (!sizer_is_adaptive(s) || s->epoch_requests < ADAPT_EPOCH)
+        return s->capacity;
+
+    size_t step     = sizer_step(s);
+    size_t min_gain = s->epoch_requests / 100;  // 1% of requests
+
+    // average entry size, to check that a step up still fits the budget
+    size_t entry_bytes = entries > 0 ? bytes_used / entries : 0;
+    bool room_to_grow  = s->byte_budget == 0 ||
+                        bytes_used + step * entry_bytes <= s->byte_budget;
+
+    // grow while a step buys more than min_gain hits, shrink once the
+    // last step earns less than that
+    if (s->ghost_hits > min_gain && room_to_grow) {
+        s->capacity += step;
+        if (s->capacity > s->max_capacity)
+            s->capacity = s->max_capacity;
+
+    } else if (s->tail_hits < min_gain) {
+        s->capacity = s->capacity > s->min_capacity + step
+                          ? s->capacity - step
+                          : s->min_capacity;
+    }
+
+    s->ghost_hits     = 0;
+    s->tail_hits      = 0;
+    s->epoch_requests = 0;
+    return s->capacity;
+}
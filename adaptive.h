@@ -0,0 +1,73 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/*
+** Capacity controller shared by the cache modules.
+**
+** A module reports its hits (with how close the entry was to eviction), its
+** misses and its evictions. Evicted keys are remembered in a small ghost
+** list, so a miss on a recently evicted key shows what growing by one step
+** would have gained. Hits on the last step of entries before eviction show
+** what shrinking by one step would have cost. Once per epoch the capacity
+** grows a step if that would have gained more than 1% of requests as hits,
+** or shrinks a step if the last step earned less than that, within
+** [min, max].
+*/
+
+#define GHOST_CAPACITY 1024  // most recently evicted keys remembered
+#define ADAPT_EPOCH 512      // requests between capacity decisions
+#define ADAPT_MIN_STEP 4
+
+typedef struct sizer {
+    size_t capacity;
+    size_t min_capacity;
+    size_t max_capacity;
+    size_t byte_budget;  // 0 for no budget
+
+    size_t ghost_hits;      // misses a cache one step larger would have hit
+    size_t tail_hits;       // hits a cache one step smaller would have missed
+    size_t epoch_requests;  // requests since the last decision
+
+    size_t max_key;
+    int* ghost_slot;  // ring index of each ghost key, -1 if not a ghost
+    size_t* ghosts;   // ring of evicted keys, newest at ghost_head - 1
+    size_t ghost_head;
+    size_t ghost_count;
+} *Sizer;
+
+
+// Returns a fixed-size sizer for keys up to max_key
+Sizer new_sizer(size_t capacity, size_t max_key);
+
+void sizer_free(Sizer s);
+
+// Fixed capacity if min == max, adaptive between them otherwise
+// (both are clamped to limit). byte_budget of 0 means no budget
+void sizer_configure(Sizer s, size_t min, size_t max, size_t byte_budget,
+                     size_t limit);
+
+bool sizer_is_adaptive(Sizer s);
+
+// Entries per resize, also how far back a ghost hit counts
+size_t sizer_step(Sizer s);
+
+// position is how many entries are safer from eviction than the one hit
+// (0 for the entry that would be evicted last)
+void sizer_record_hit(Sizer s, size_t position);
+
+// Returns true if key was a recent ghost
+bool sizer_record_miss(Sizer s, size_t key);
+
+void sizer_record_eviction(Sizer s, size_t key);
+
+// Ends the epoch if it is time and returns the capacity to use now.
+// bytes_used and entries let a byte budget cap growth.
+size_t sizer_update(Sizer s, size_t bytes_used, size_t entries);
+
+// Returns true if the cache must evict to stay within its byte budget
+bool sizer_over_budget(Sizer s, size_t bytes_used);
+
+#endif
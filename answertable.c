@@ -0,0 +1,170 @@
+#include "answertable.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "inputreader.h"
+#include "keypair.h"
+
+AnswerTable active_table = NULL;
+
+
+// Helper function for writeAnswerTable()
+// Builds the cut lines of every answer. The lines of length L are the lines
+// of L - cuts[L] with one more piece of cuts[L] moved to the front, which is
+// the order createCutList() finds them in.
+// Returns the total number of lines written to cuts_out
+size_t buildCutLines(const Vec length_prices, RodCutTable table,
+                     Answer answers[], SolutionCut** cuts_out) {
+    size_t capacity   = table->max_length + 1;
+    size_t cut_count  = 0;
+    SolutionCut* cuts = malloc(capacity * sizeof(SolutionCut));
+
+    answers[0]        = (Answer){0, 0, 0, 0};
+
+    for (size_t length = 1; length <= table->max_length; length++) {
+        const size_t cut = table->cuts[length];
+        Answer* answer   = &answers[length];
+
+        answer->profit   = table->max_profit[length];
+
+        if (cut == 0) {
+            *answer = (Answer){answer->profit, length, cut_count, 0};
+            continue;
+        }
+
+        const Answer* rest = &answers[length - cut];
+        KeyPair* price     = vec_find_pair(length_prices, cut);
+
+        if (cut_count + rest->cut_count + 1 > capacity) {
+            capacity = 2 * (cut_count + rest->cut_count + 1);
+            cuts     = realloc(cuts, capacity * sizeof(SolutionCut));
+        }
+
+        answer->remainder   = rest->remainder;
+        answer->cut_offset  = cut_count;
+        SolutionCut* first  = &cuts[cut_count++];
+        *first              = (SolutionCut){cut, 1, price->value};
+
+        for (size_t ix = 0; ix < rest->cut_count; ix++) {
+            const SolutionCut* line = &cuts[rest->cut_offset + ix];
+
+            if (line->length == cut) {
+                first->count += line->count;
+                first->value += line->value;
+            } else {
+                cuts[cut_count++] = *line;
+            }
+        }
+        answer->cut_count = cut_count - answer->cut_offset;
+    }
+
+    *cuts_out = cuts;
+    return cut_count;
+}
+
+bool writeAnswerTable(const char* filename, const Vec length_prices,
+                      size_t max_length) {
+    FILE* file = fopen(filename, "wb");
+    if (file == NULL)
+        return false;
+
+    RodCutTable table = solveAllLengths(length_prices, max_length);
+    Answer* answers   = malloc((max_length + 1) * sizeof(Answer));
+    SolutionCut* cuts = NULL;
+    size_t cut_count  = buildCutLines(length_prices, table, answers, &cuts);
+
+    AnswerTableHeader header = {ANSWER_TABLE_MAGIC,
+                                fingerprintPrices(length_prices), max_length,
+                                cut_count};
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(answers, sizeof(Answer), max_length + 1, file) ==
+                  max_length + 1 &&
+              fwrite(cuts, sizeof(SolutionCut), cut_count, file) == cut_count;
+
+    ok      = fclose(file) == 0 && ok;
+
+    free(cuts);
+    free(answers);
+    freeRodCutTable(table);
+    return ok;
+}
+
+AnswerTable openAnswerTable(const char* filename, uint64_t fingerprint) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat info;
+    void* map = MAP_FAILED;
+
+    if (fstat(fd, &info) == 0 &&
+        (size_t)info.st_size >= sizeof(AnswerTableHeader))
+        map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const AnswerTableHeader* header = map;
+    size_t size                     = info.st_size;
+
+    bool valid = header->magic == ANSWER_TABLE_MAGIC &&
+                 header->fingerprint == fingerprint &&
+                 header->max_length < size / sizeof(Answer) &&
+                 header->cut_count < size / sizeof(SolutionCut) &&
+                 sizeof(AnswerTableHeader) +
+                         (header->max_length + 1) * sizeof(Answer) +
+                         header->cut_count * sizeof(SolutionCut) ==
+                     size;
+
+    if (!valid) {
+        munmap(map, size);
+        return NULL;
+    }
+
+    AnswerTable table = malloc(sizeof(struct answertable));
+    table->map        = map;
+    table->map_size   = size;
+    table->max_length = header->max_length;
+    table->cut_count  = header->cut_count;
+    table->answers    = (const Answer*)(header + 1);
+    table->cuts = (const SolutionCut*)(table->answers + table->max_length + 1);
+
+    return table;
+}
+
+void closeAnswerTable(AnswerTable table) {
+    if (active_table == table)
+        active_table = NULL;
+
+    munmap(table->map, table->map_size);
+    free(table);
+}
+
+void setAnswerTable(AnswerTable table) {
+    active_table = table;
+}
+
+char* solveFromTable(const Vec length_prices, size_t rod_length) {
+    if (active_table == NULL || rod_length > active_table->max_length)
+        return solveRodCutting(length_prices, rod_length);
+
+    const Answer* answer = &active_table->answers[rod_length];
+
+    if ((size_t)answer->cut_offset + answer->cut_count >
+        active_table->cut_count)
+        return solveRodCutting(length_prices, rod_length);
+
+    char* output = allocateOutput();
+
+    formatSolution(output, MAX_OUTPUT_LENGTH,
+                   active_table->cuts + answer->cut_offset, answer->cut_count,
+                   answer->profit, answer->remainder);
+    return output;
+}
@@ -0,0 +1,64 @@
+#ifndef ANSWERTABLE_H
+#define ANSWERTABLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "rodcutsolver.h"
+#include "vec.h"
+
+/*
+** Precomputed answers for every rod length of one price table.
+**
+** File layout: an AnswerTableHeader, then one Answer for every length from 0
+** to max_length, then the SolutionCut lines the answers point into.
+** The file is mapped as it is, so a lookup is one index and one format.
+*/
+
+#define ANSWER_TABLE_MAGIC 0x31534E5744524F52ULL  // "RODWNS1"
+
+typedef struct answertableheader {
+    uint64_t magic;
+    uint64_t fingerprint;  // of the price table the answers were solved for
+    uint64_t max_length;
+    uint64_t cut_count;  // SolutionCut lines after the answers
+} AnswerTableHeader;
+
+typedef struct answer {
+    int32_t profit;
+    uint32_t remainder;
+    uint32_t cut_offset;  // first line in the cut blob
+    uint32_t cut_count;
+} Answer;
+
+typedef struct answertable {
+    void* map;
+    size_t map_size;
+    size_t max_length;
+    size_t cut_count;
+    const Answer* answers;
+    const SolutionCut* cuts;
+} *AnswerTable;
+
+
+// Solves every length up to max_length and writes the table to filename
+// Returns false if the file could not be written
+bool writeAnswerTable(const char* filename, const Vec length_prices,
+                      size_t max_length);
+
+// Maps a table file. Returns NULL if it is missing, malformed, or was built
+// from a price table with a different fingerprint
+AnswerTable openAnswerTable(const char* filename, uint64_t fingerprint);
+
+void closeAnswerTable(AnswerTable table);
+
+// Sets the table solveFromTable() answers from, or NULL for none
+void setAnswerTable(AnswerTable table);
+
+// Drop-in replacement for solveRodCutting()
+// Answers from the table set by setAnswerTable() when it covers rod_length,
+// and falls back to the solver otherwise
+char* solveFromTable(const Vec length_prices, size_t rod_length);
+
+#endif
@@ -0,0 +1,75 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "answertable.h"
+#include "inputreader.h"
+#include "pricetable.h"
+
+/*
+** Offline answer table builder.
+** Solves every rod length up to --max-length (MAX_ROD_LENGTH by default) for
+** one price file, and writes the answers for main --table=FILE to map.
+*/
+
+#define USAGE_FMT \
+    "Usage: %s lengths_file.txt answers.bin [--max-length=N]\n"
+
+
+int main(int argc, char* argv[]) {
+    const char* positional[2];
+    int positional_count = 0;
+    size_t max_length    = MAX_ROD_LENGTH;
+
+    for (int ix = 1; ix < argc; ix++) {
+        const char* value = NULL;
+
+        if (matchFlag(argv[ix], "max-length", &value)) {
+            if (!parseSize(value, &max_length) ||
+                !isLengthInRange(max_length)) {
+                printErr(FLAG_INVALID, argv[ix], COMMAND_LINE_ARG_SIZE);
+                return 1;
+            }
+        } else if (strncmp(argv[ix], "--", 2) != 0 && positional_count < 2) {
+            positional[positional_count++] = argv[ix];
+        } else {
+            fprintf(stderr, USAGE_FMT, argv[0]);
+            return 1;
+        }
+    }
+
+    if (positional_count != 2) {
+        fprintf(stderr, USAGE_FMT, argv[0]);
+        return 1;
+    }
+
+    const char* filename   = positional[0];
+    const char* table_file = positional[1];
+
+    printf("Reading lengths from '%s'...\n", filename);
+    PriceTable price_table = NULL;
+    Vec length_prices      = loadPrices(filename, true, &price_table);
+
+    if (length_prices == NULL) {
+        printErr(FILE_INVALID, filename, COMMAND_LINE_ARG_SIZE);
+        return 1;
+    }
+    if (vec_length(length_prices) == 0) {
+        printErr(FILE_NO_VALID_LINES, filename, COMMAND_LINE_ARG_SIZE);
+        freePrices(length_prices, price_table);
+        return 1;
+    }
+
+    printf("\nSolving lengths 1 to %zu...\n", max_length);
+
+    if (!writeAnswerTable(table_file, length_prices, max_length)) {
+        printErr(FILE_INVALID, table_file, COMMAND_LINE_ARG_SIZE);
+        freePrices(length_prices, price_table);
+        return 1;
+    }
+
+    printf("Wrote '%s'\n", table_file);
+    freePrices(length_prices, price_table);
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include "cache.h"
+
+/*
+** Registry entry of a built-in cache module (make builtin).
+** Compiled once for each module, with BUILTIN_NAME its name as a string,
+** and linked with it into one object in which every other symbol is then
+** made local. The module's functions are referenced weakly, so those it
+** does not implement are NULL.
+*/
+
+#define WEAK __attribute__((weak))
+
+WEAK void initialize(void);
+WEAK ProviderFunction set_provider(ProviderFunction downstream);
+WEAK CacheStat *statistics(void);
+WEAK void reset_statistics(void);
+WEAK void set_capacity(size_t min, size_t max, size_t byte_budget);
+WEAK bool save_snapshot(const char *path, uint64_t fingerprint);
+WEAK int load_snapshot(const char *path, uint64_t fingerprint);
+WEAK void set_eviction_handler(Eviction_fptr handler);
+WEAK void insert(KeyType key, ValueType value);
+WEAK void insert_many(const KeyType keys[], ValueType values[], size_t count);
+WEAK size_t admit_many(KeyType keys[], size_t count);
+WEAK size_t export_entries(KeyType keys[], ValueType values[], size_t max);
+WEAK void set_fingerprint(uint64_t fingerprint);
+WEAK void *alloc_value(size_t size);
+WEAK size_t invalidate(Stale_fptr stale);
+WEAK void set_keys_only(void);
+WEAK CacheValue get_value(Vec lengths, KeyType key);
+WEAK void cleanup(void);
+WEAK extern const CacheModuleV2 cache_module_v2;
+
+bool loaded = false;
+
+// The module's globals are free for the next load once cleaned up
+void _cleanup_builtin(void) {
+    if (cleanup != NULL)
+        cleanup();
+    loaded = false;
+}
+
+const BuiltinModule builtin_module = {
+    .name       = BUILTIN_NAME,
+    .initialize = initialize,
+    .hooks =
+        {
+            .set_provider_func    = set_provider,
+            .get_statistics       = statistics,
+            .reset_statistics     = reset_statistics,
+            .set_capacity         = set_capacity,
+            .save_snapshot        = save_snapshot,
+            .load_snapshot        = load_snapshot,
+            .set_eviction_handler = set_eviction_handler,
+            .insert               = insert,
+            .insert_many          = insert_many,
+            .admit_many           = admit_many,
+            .export_entries       = export_entries,
+            .set_fingerprint      = set_fingerprint,
+            .alloc_value          = alloc_value,
+            .invalidate           = invalidate,
+            .set_keys_only        = set_keys_only,
+            .get_value            = get_value,
+            .cache_cleanup        = _cleanup_builtin,
+        },
+    .module_v2 = &cache_module_v2,
+    .loaded    = &loaded,
+};
+
+// the linker gathers every module's pointer into one array
+__attribute__((used, section("cache_builtins")))
+const BuiltinModule *const builtin_module_entry = &builtin_module;
@@ -1,8 +1,32 @@
+#define _GNU_SOURCE  // dlinfo(), mkstemps()
+
 #include "cache.h"
 
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <link.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_LOADED_MODULES 32
+#define COPY_BUFFER_SIZE 65536
+
+void *_loaded_handles[MAX_LOADED_MODULES];
+size_t _loaded_count = 0;
+
+CacheInstance *_shadows[MAX_SHADOWS];
+char *_shadow_names[MAX_SHADOWS];
+size_t _shadow_count       = 0;
+
+ProviderFunction _shadowed = NULL;  // the real provider behind the shadows
+
+Cache *_tiers[MAX_TIERS];
+char *_tier_names[MAX_TIERS];
+ProviderFunction _tier_providers[MAX_TIERS];  // caching provider of each tier
+size_t _tier_count         = 0;
+
 
 void _do_nothing(void) {
 }
@@ -11,27 +35,233 @@ CacheStat *_do_nothing_stats(void) {
     return NULL;
 }
 
-Cache *load_cache_module(const char *libname) {
+bool _do_nothing_save(const char *path, uint64_t fingerprint) {
+    (void)path;
+    (void)fingerprint;
+    return false;
+}
+
+int _do_nothing_load(const char *path, uint64_t fingerprint) {
+    (void)path;
+    (void)fingerprint;
+    return -1;
+}
+
+void _do_nothing_fingerprint(uint64_t fingerprint) {
+    (void)fingerprint;
+}
+
+void _do_nothing_capacity(size_t min, size_t max, size_t byte_budget) {
+    (void)min;
+    (void)max;
+    (void)byte_budget;
+}
+
+void _do_nothing_eviction(Eviction_fptr handler) {
+    (void)handler;
+}
+
+// A module that cannot take values from outside just drops them
+void _do_nothing_insert(KeyType key, ValueType value) {
+    (void)key;
+    free(value);
+}
+
+void _do_nothing_insert_many(const KeyType keys[], ValueType values[],
+                             size_t count) {
+    (void)keys;
+    for (size_t ix = 0; ix < count; ix++)
+        free(values[ix]);
+}
+
+size_t _admit_every_key(KeyType keys[], size_t count) {
+    (void)keys;
+    return count;
+}
+
+size_t _do_nothing_export(KeyType keys[], ValueType values[], size_t max) {
+    (void)keys;
+    (void)values;
+    (void)max;
+    return 0;
+}
+
+size_t _cannot_invalidate(Stale_fptr stale) {
+    (void)stale;
+    return INVALIDATE_UNSUPPORTED;
+}
+
+// Every built-in module's entry, gathered by the linker. Weak, so the
+// section need not exist
+extern const BuiltinModule *const __start_cache_builtins[] __attribute__((weak));
+extern const BuiltinModule *const __stop_cache_builtins[] __attribute__((weak));
+
+// Returns the index of the built-in module called name, or -1
+int _find_builtin(const char *name) {
+    if (__start_cache_builtins == NULL)
+        return -1;
+
+    size_t count = __stop_cache_builtins - __start_cache_builtins;
+
+    for (size_t ix = 0; ix < count; ix++)
+        if (strcmp(__start_cache_builtins[ix]->name, name) == 0)
+            return ix;
+    return -1;
+}
+
+bool _is_loaded(void *handle) {
+    for (size_t ix = 0; ix < _loaded_count; ix++)
+        if (_loaded_handles[ix] == handle)
+            return true;
+    return false;
+}
+
+// Copies the file at from into the open file descriptor to_fd
+bool _copy_file(const char *from, int to_fd) {
+    int from_fd = open(from, O_RDONLY);
+    if (from_fd < 0)
+        return false;
+
+    char buffer[COPY_BUFFER_SIZE];
+    ssize_t bytes;
+    bool ok = true;
+
+    while ((bytes = read(from_fd, buffer, sizeof(buffer))) > 0)
+        if (write(to_fd, buffer, bytes) != bytes) {
+            ok = false;
+            break;
+        }
+
+    close(from_fd);
+    return ok && bytes == 0;
+}
+
+// dlopen() returns the already loaded instance (with the same globals) when a
+// library is opened twice, so a second instance is loaded from a private copy
+// of the file. The copy is unlinked as soon as it is mapped.
+void *_open_module(const char *libname) {
     void *handle = dlopen(libname, RTLD_NOW | RTLD_NODELETE);
-    if (!handle) {
-        fprintf(stderr, "Error: %s\n", dlerror());
+    if (!handle || _loaded_count == MAX_LOADED_MODULES)
         return NULL;
+
+    if (_is_loaded(handle)) {
+        struct link_map *map = NULL;
+        dlinfo(handle, RTLD_DI_LINKMAP, &map);
+
+        char copy_path[] = "/tmp/cachemoduleXXXXXX.so";
+        int copy_fd      = mkstemps(copy_path, strlen(".so"));
+        if (copy_fd < 0)
+            return NULL;
+
+        bool copied = _copy_file(map->l_name, copy_fd);
+        close(copy_fd);
+
+        handle = copied ? dlopen(copy_path, RTLD_NOW | RTLD_NODELETE) : NULL;
+        unlink(copy_path);
+
+        if (!handle)
+            return NULL;
+    }
+
+    _loaded_handles[_loaded_count++] = handle;
+    return handle;
+}
+
+// Helper function for load_cache_module()
+// Fills in hooks from a built-in module, or returns false if it is in use
+bool _builtin_hooks(int index, Cache *hooks, Void_fptr *cache_initialize) {
+    const BuiltinModule *builtin = __start_cache_builtins[index];
+
+    if (*builtin->loaded) {
+        fprintf(stderr, "Error: built-in module '%s' is already loaded\n",
+                builtin->name);
+        return false;
     }
 
-    Cache *hooks               = malloc(sizeof(Cache));
+    *builtin->loaded  = true;
+    *hooks            = builtin->hooks;
+    *cache_initialize = builtin->initialize;
+    return true;
+}
+
+// Helper function for load_cache_module()
+bool _library_hooks(const char *libname, Cache *hooks,
+                    Void_fptr *cache_initialize) {
+    void *handle = _open_module(libname);
+    if (!handle) {
+        const char *error = dlerror();
+        fprintf(stderr, "Error: %s\n", error ? error : "module not loaded");
+        return false;
+    }
 
-    Void_fptr cache_initialize = (Void_fptr)dlsym(handle, "initialize");
+    *cache_initialize = (Void_fptr)dlsym(handle, "initialize");
     hooks->set_provider_func = (SetProvider_fptr)dlsym(handle, "set_provider");
     hooks->get_statistics    = (Stats_fptr)dlsym(handle, "statistics");
     hooks->reset_statistics  = (Void_fptr)dlsym(handle, "reset_statistics");
+    hooks->set_capacity      = (SetCapacity_fptr)dlsym(handle, "set_capacity");
+    hooks->save_snapshot =
+        (SaveSnapshot_fptr)dlsym(handle, "save_snapshot");
+    hooks->load_snapshot =
+        (LoadSnapshot_fptr)dlsym(handle, "load_snapshot");
+    hooks->set_eviction_handler =
+        (SetEviction_fptr)dlsym(handle, "set_eviction_handler");
+    hooks->insert            = (Insert_fptr)dlsym(handle, "insert");
+    hooks->insert_many = (InsertMany_fptr)dlsym(handle, "insert_many");
+    hooks->admit_many  = (AdmitMany_fptr)dlsym(handle, "admit_many");
+    hooks->export_entries = (Export_fptr)dlsym(handle, "export_entries");
+    hooks->set_fingerprint =
+        (SetFingerprint_fptr)dlsym(handle, "set_fingerprint");
+    hooks->alloc_value = (AllocValue_fptr)dlsym(handle, "alloc_value");
+    hooks->invalidate  = (Invalidate_fptr)dlsym(handle, "invalidate");
+    hooks->set_keys_only = (Void_fptr)dlsym(handle, "set_keys_only");
+    hooks->get_value   = (GetValue_fptr)dlsym(handle, "get_value");
     hooks->cache_cleanup     = (Void_fptr)dlsym(handle, "cleanup");
 
     dlclose(handle);
+    return true;
+}
+
+Cache *load_cache_module(const char *libname) {
+    Cache *hooks = malloc(sizeof(Cache));
+    Void_fptr cache_initialize;
+    int builtin = _find_builtin(libname);
+
+    bool loaded = builtin >= 0
+                      ? _builtin_hooks(builtin, hooks, &cache_initialize)
+                      : _library_hooks(libname, hooks, &cache_initialize);
+    if (!loaded) {
+        free(hooks);
+        return NULL;
+    }
 
     if (!hooks->get_statistics)
         hooks->get_statistics = _do_nothing_stats;
     if (!hooks->reset_statistics)
         hooks->reset_statistics = _do_nothing;
+    if (!hooks->set_capacity)
+        hooks->set_capacity = _do_nothing_capacity;
+    if (!hooks->save_snapshot)
+        hooks->save_snapshot = _do_nothing_save;
+    if (!hooks->load_snapshot)
+        hooks->load_snapshot = _do_nothing_load;
+    if (!hooks->set_eviction_handler)
+        hooks->set_eviction_handler = _do_nothing_eviction;
+    if (!hooks->insert)
+        hooks->insert = _do_nothing_insert;
+    if (!hooks->insert_many)
+        hooks->insert_many = _do_nothing_insert_many;
+    if (!hooks->admit_many)
+        hooks->admit_many = _admit_every_key;
+    if (!hooks->export_entries)
+        hooks->export_entries = _do_nothing_export;
+    if (!hooks->set_fingerprint)
+        hooks->set_fingerprint = _do_nothing_fingerprint;
+    if (!hooks->alloc_value)
+        hooks->alloc_value = malloc;
+    if (!hooks->invalidate)
+        hooks->invalidate = _cannot_invalidate;
+    if (!hooks->set_keys_only)
+        hooks->set_keys_only = _do_nothing;
     if (!hooks->cache_cleanup)
         hooks->cache_cleanup = _do_nothing;
 
@@ -40,7 +270,7 @@ Cache *load_cache_module(const char *libname) {
         fprintf(stderr, "Error: could not resolve required symbol: (%p)\n",
                 (void *)hooks->set_provider_func);
         free(hooks);
-        hooks = NULL;
+        return NULL;
     }
 
     if (cache_initialize)
@@ -49,18 +279,390 @@ Cache *load_cache_module(const char *libname) {
     return hooks;
 }
 
+// A version 1 module behind the version 2 functions
+typedef struct v1adapter {
+    Cache *hooks;
+    ProviderFunction provider;  // what set_provider() returned
+} V1Adapter;
+
+void _v1_destroy(void *context) {
+    V1Adapter *adapter = context;
+    adapter->hooks->cache_cleanup();
+    free(adapter->hooks);
+    free(adapter);
+}
+
+void _v1_set_provider(void *context, ProviderFunction downstream) {
+    V1Adapter *adapter = context;
+    adapter->provider  = adapter->hooks->set_provider_func(downstream);
+}
+
+// The module keeps what it returns, so the handle gets a copy
+CacheValue _v1_get(void *context, Vec lengths, KeyType key) {
+    V1Adapter *adapter = context;
+    return cache_value_new(adapter->provider(lengths, key));
+}
+
+CacheStat *_v1_statistics(void *context) {
+    return ((V1Adapter *)context)->hooks->get_statistics();
+}
+
+void _v1_reset_statistics(void *context) {
+    ((V1Adapter *)context)->hooks->reset_statistics();
+}
+
+void _v1_set_capacity(void *context, size_t min, size_t max,
+                      size_t byte_budget) {
+    ((V1Adapter *)context)->hooks->set_capacity(min, max, byte_budget);
+}
+
+const CacheModuleV2 _v1_adapter = {
+    .version          = CACHE_INTERFACE_VERSION,
+    .create           = NULL,  // made by open_cache_instance() instead
+    .destroy          = _v1_destroy,
+    .set_provider     = _v1_set_provider,
+    .get              = _v1_get,
+    .statistics       = _v1_statistics,
+    .reset_statistics = _v1_reset_statistics,
+    .set_capacity     = _v1_set_capacity,
+};
+
+CacheInstance *open_cache_instance(const char *libname) {
+    const CacheModuleV2 *module = NULL;
+    int builtin                 = _find_builtin(libname);
+
+    if (builtin >= 0) {
+        module = __start_cache_builtins[builtin]->module_v2;
+    } else {
+        void *handle = dlopen(libname, RTLD_NOW | RTLD_NODELETE);
+        if (!handle) {
+            fprintf(stderr, "Error: %s\n", dlerror());
+            return NULL;
+        }
+
+        // instances of a version 2 module share nothing, so no copy is needed
+        module = dlsym(handle, "cache_module_v2");
+        dlclose(handle);
+    }
+
+    CacheInstance *instance = malloc(sizeof(CacheInstance));
+    if (instance == NULL)
+        return NULL;
+
+    if (module != NULL && module->version == CACHE_INTERFACE_VERSION) {
+        instance->ops     = module;
+        instance->context = module->create();
+
+        if (instance->context == NULL) {
+            fprintf(stderr, "Error: could not create a cache from '%s'\n",
+                    libname);
+            free(instance);
+            return NULL;
+        }
+        return instance;
+    }
+
+    Cache *hooks       = load_cache_module(libname);
+    V1Adapter *adapter = hooks ? malloc(sizeof(V1Adapter)) : NULL;
+
+    if (adapter == NULL) {
+        if (hooks != NULL) {
+            hooks->cache_cleanup();
+            free(hooks);
+        }
+        free(instance);
+        return NULL;
+    }
+
+    adapter->hooks     = hooks;
+    adapter->provider  = NULL;
+
+    instance->ops      = &_v1_adapter;
+    instance->context  = adapter;
+    return instance;
+}
+
+void close_cache_instance(CacheInstance *instance) {
+    instance->ops->destroy(instance->context);
+    free(instance);
+}
+
+
+// main()'s own cache, which main() cleans up itself
+void _installed_destroy(void *context) {
+    free(context);
+}
+
+// The module's own reference, or a copy if it only has the provider
+CacheValue _installed_get(void *context, Vec lengths, KeyType key) {
+    V1Adapter *adapter = context;
+
+    if (adapter->hooks->get_value != NULL)
+        return adapter->hooks->get_value(lengths, key);
+    return cache_value_new(adapter->provider(lengths, key));
+}
+
+const CacheModuleV2 _installed_cache = {
+    .version          = CACHE_INTERFACE_VERSION,
+    .create           = NULL,  // made by open_installed_cache() instead
+    .destroy          = _installed_destroy,
+    .set_provider     = _v1_set_provider,
+    .get              = _installed_get,
+    .statistics       = _v1_statistics,
+    .reset_statistics = _v1_reset_statistics,
+    .set_capacity     = _v1_set_capacity,
+};
+
+CacheInstance *open_installed_cache(Cache *cache, ProviderFunction provider) {
+    CacheInstance *instance = malloc(sizeof(CacheInstance));
+    V1Adapter *adapter      = malloc(sizeof(V1Adapter));
+
+    if (instance == NULL || adapter == NULL) {
+        free(instance);
+        free(adapter);
+        return NULL;
+    }
+
+    adapter->hooks     = cache;
+    adapter->provider  = provider;
+
+    instance->ops      = &_installed_cache;
+    instance->context  = adapter;
+    return instance;
+}
+
+
 void print_cache_stats(int fd, CacheStat *stats) {
     if (!stats) {
         dprintf(fd, "No cache stats available\n");
         return;
     }
 
-    printf("Cache Stats:\n");
+    dprintf(fd, "Cache Stats:\n");
 
     CacheStat *sptr = stats;
     while (sptr->type != END_OF_STATS) {
-        dprintf(fd, "%-10s (%d) %4d\n", CacheStatNames[sptr->type], sptr->type,
-                sptr->value);
+        dprintf(fd, "%-13s (%2d) %4d\n", CacheStatNames[sptr->type],
+                sptr->type, sptr->value);
         sptr++;
     }
+
+    int requests = get_cache_stat(stats, Cache_requests);
+    int hits     = get_cache_stat(stats, Cache_hits);
+    if (requests > 0 && hits >= 0)
+        dprintf(fd, "%-13s      %4.1f%%\n", "hit ratio",
+                100.0 * hits / requests);
+}
+
+int get_cache_stat(CacheStat *stats, enum Stat_type type) {
+    if (!stats)
+        return -1;
+
+    for (CacheStat *sptr = stats; sptr->type != END_OF_STATS; sptr++)
+        if (sptr->type == type)
+            return sptr->value;
+    return -1;
+}
+
+
+// The downstream of every shadow: computes nothing, so shadows hold keys only
+ValueType _shadow_downstream(Vec lengths, KeyType key) {
+    (void)lengths;
+    (void)key;
+    return NULL;
+}
+
+void show_shadows(Vec lengths, KeyType key) {
+    for (size_t ix = 0; ix < _shadow_count; ix++) {
+        CacheInstance *shadow = _shadows[ix];
+        cache_value_release(shadow->ops->get(shadow->context, lengths, key));
+    }
+}
+
+ValueType _shadowing_provider(Vec lengths, KeyType key) {
+    show_shadows(lengths, key);
+    return _shadowed(lengths, key);
+}
+
+bool load_shadow_module(const char *libname) {
+    if (_shadow_count == MAX_SHADOWS)
+        return false;
+
+    CacheInstance *shadow = open_cache_instance(libname);
+    if (shadow == NULL)
+        return false;
+
+    // a version 2 instance shares nothing already
+    if (shadow->ops == &_v1_adapter)
+        ((V1Adapter *)shadow->context)->hooks->set_keys_only();
+
+    shadow->ops->set_provider(shadow->context, _shadow_downstream);
+
+    _shadows[_shadow_count]      = shadow;
+    _shadow_names[_shadow_count] = strdup(libname);
+    _shadow_count++;
+
+    return true;
+}
+
+ProviderFunction add_shadows(ProviderFunction provider) {
+    if (_shadow_count == 0)
+        return provider;
+
+    _shadowed = provider;
+    return _shadowing_provider;
+}
+
+void print_shadow_stats(int fd) {
+    for (size_t ix = 0; ix < _shadow_count; ix++) {
+        dprintf(fd, "\nShadow cache '%s' (keys only):\n", _shadow_names[ix]);
+
+        CacheStat *stats = get_shadow_stats(ix);
+        print_cache_stats(fd, stats);
+
+        if (stats)
+            free(stats);
+    }
+}
+
+CacheStat *get_shadow_stats(size_t index) {
+    if (index >= _shadow_count)
+        return NULL;
+
+    return _shadows[index]->ops->statistics(_shadows[index]->context);
+}
+
+void cleanup_shadows(void) {
+    for (size_t ix = 0; ix < _shadow_count; ix++) {
+        close_cache_instance(_shadows[ix]);
+        free(_shadow_names[ix]);
+    }
+    _shadow_count = 0;
+}
+
+
+// The tier above keeps its own copy of whatever the tier below returns,
+// since the tier below still owns and may free the original
+#define TIER_DOWNSTREAM(level)                                            \
+    ValueType _tier_downstream_##level(Vec lengths, KeyType key) {        \
+        ValueType value = _tier_providers[level](lengths, key);           \
+        return value ? strdup(value) : NULL;                              \
+    }
+
+// Values evicted from the tier above go into this one
+#define TIER_DEMOTE(level)                                                \
+    void _tier_demote_##level(KeyType key, ValueType value) {             \
+        _tiers[level]->insert(key, value);                                \
+    }
+
+TIER_DOWNSTREAM(0)
+TIER_DOWNSTREAM(1)
+TIER_DOWNSTREAM(2)
+TIER_DOWNSTREAM(3)
+
+TIER_DEMOTE(0)
+TIER_DEMOTE(1)
+TIER_DEMOTE(2)
+TIER_DEMOTE(3)
+
+ProviderFunction _tier_downstreams[MAX_TIERS] = {
+    _tier_downstream_0, _tier_downstream_1, _tier_downstream_2,
+    _tier_downstream_3};
+
+Eviction_fptr _tier_demotes[MAX_TIERS] = {_tier_demote_0, _tier_demote_1,
+                                          _tier_demote_2, _tier_demote_3};
+
+bool load_tier_module(const char *libname, size_t capacity) {
+    if (_tier_count == MAX_TIERS)
+        return false;
+
+    Cache *tier = load_cache_module(libname);
+    if (tier == NULL)
+        return false;
+
+    if (capacity > 0)
+        tier->set_capacity(capacity, capacity, 0);
+
+    _tiers[_tier_count]      = tier;
+    _tier_names[_tier_count] = strdup(libname);
+    _tier_count++;
+
+    return true;
+}
+
+ProviderFunction add_tiers(Cache *top, ProviderFunction provider) {
+    if (_tier_count == 0)
+        return provider;
+
+    // wire from the bottom up, so each tier's downstream is already set
+    for (size_t ix = _tier_count; ix-- > 0;) {
+        _tier_providers[ix] = _tiers[ix]->set_provider_func(provider);
+        provider            = _tier_downstreams[ix];
+
+        if (ix + 1 < _tier_count)
+            _tiers[ix]->set_eviction_handler(_tier_demotes[ix + 1]);
+    }
+
+    top->set_eviction_handler(_tier_demotes[0]);
+    return provider;
+}
+
+Cache *bottom_tier(Cache *top) {
+    return _tier_count > 0 ? _tiers[_tier_count - 1] : top;
+}
+
+void print_tier_stats(int fd) {
+    for (size_t ix = 0; ix < _tier_count; ix++) {
+        dprintf(fd, "\nTier L%zu cache '%s':\n", ix + 2, _tier_names[ix]);
+
+        CacheStat *stats = _tiers[ix]->get_statistics();
+        print_cache_stats(fd, stats);
+
+        if (stats)
+            free(stats);
+    }
+}
+
+void cleanup_tiers(void) {
+    for (size_t ix = 0; ix < _tier_count; ix++) {
+        _tiers[ix]->cache_cleanup();
+        free(_tiers[ix]);
+        free(_tier_names[ix]);
+    }
+    _tier_count = 0;
+}
+
+
+size_t migrate_cache(Cache *from, Cache *to, uint64_t fingerprint) {
+    KeyType *keys     = malloc(MAX_MIGRATED_ENTRIES * sizeof(KeyType));
+    ValueType *values = malloc(MAX_MIGRATED_ENTRIES * sizeof(ValueType));
+
+    to->set_fingerprint(fingerprint);
+    size_t count = from->export_entries(keys, values, MAX_MIGRATED_ENTRIES);
+
+    // coldest first, so the hottest are inserted last
+    for (size_t ix = count; ix-- > 0;)
+        to->insert(keys[ix], values[ix]);
+
+    from->cache_cleanup();
+    free(from);
+
+    free(keys);
+    free(values);
+    return count;
+}
+
+
+size_t invalidate_caches(Cache *top, Stale_fptr stale) {
+    // all or nothing, so no cache is left holding what another dropped
+    if (top->invalidate == _cannot_invalidate)
+        return INVALIDATE_UNSUPPORTED;
+    for (size_t ix = 0; ix < _tier_count; ix++)
+        if (_tiers[ix]->invalidate == _cannot_invalidate)
+            return INVALIDATE_UNSUPPORTED;
+
+    size_t removed = top->invalidate(stale);
+    for (size_t ix = 0; ix < _tier_count; ix++)
+        removed += _tiers[ix]->invalidate(stale);
+    return removed;
 }
@@ -1,8 +1,11 @@
 #ifndef CACHE_H
 #define CACHE_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "vec.h"
 
@@ -30,6 +33,9 @@ typedef char* ValueType;
 // need more significant changes.)
 typedef ValueType (*ProviderFunction)(Vec list, KeyType key);
 
+// A counted reference to a value, see CACHE_INTERFACE_VERSION below
+typedef struct cachevalue *CacheValue;
+
 
 
 /* Types of cache statistics. Values are %d. */
@@ -41,7 +47,14 @@ typedef struct cachestat {
         Cache_hits=2,
         Cache_misses=3,
         Cache_evictions=4,
-        Cache_size=5
+        Cache_size=5,
+        Cache_capacity=6,
+        Cache_ghost_hits=7,
+        Cache_recoveries=8,
+        Cache_prefetched=9,
+        Cache_prefetch_hits=10,
+        Cache_coalesced=11,
+        Cache_allocations=12
     } type;
     int value;
 } CacheStat;
@@ -52,7 +65,14 @@ static char *CacheStatNames[] = {
     "hits",
     "misses",
     "evictions",
-    "size"
+    "size",
+    "capacity",
+    "ghost hits",
+    "recoveries",
+    "prefetched",
+    "prefetch hits",
+    "coalesced",
+    "allocations"
 };
 
 
@@ -67,6 +87,59 @@ typedef ProviderFunction (*SetProvider_fptr)(ProviderFunction);
 // terminated by a type=END_OF_STATS stat. Caller must free the returned pointer
 typedef CacheStat* (*Stats_fptr)(void);
 
+// (type of a function that) sets the capacity bounds of a cache
+typedef void (*SetCapacity_fptr)(size_t min, size_t max, size_t byte_budget);
+
+// (type of a function that) takes over a value evicted from a cache,
+// along with the ownership of it
+typedef void (*Eviction_fptr)(KeyType key, ValueType value);
+
+// (type of a function that) sets the function a cache hands its evictions to
+typedef void (*SetEviction_fptr)(Eviction_fptr handler);
+
+// (type of a function that) stores a value without counting a request,
+// taking ownership of it
+typedef void (*Insert_fptr)(KeyType key, ValueType value);
+
+// (type of a function that) offers a batch of values nobody asked for yet,
+// taking ownership of all of them
+typedef void (*InsertMany_fptr)(const KeyType keys[], ValueType values[],
+                                size_t count);
+
+// (type of a function that) keeps in keys, in order, only those it would
+// take from insert_many() now, and returns how many
+typedef size_t (*AdmitMany_fptr)(KeyType keys[], size_t count);
+
+// (type of a function that) hands over up to max live entries, hottest
+// first, and returns how many. The caller owns the values written
+typedef size_t (*Export_fptr)(KeyType keys[], ValueType values[], size_t max);
+
+// (type of a function that) returns memory for a value that will be handed
+// back to the cache, or NULL. malloc() is one
+typedef void *(*AllocValue_fptr)(size_t size);
+
+// (type of a function that) returns a reference to the value of key, for the
+// caller to release
+typedef CacheValue (*GetValue_fptr)(Vec lengths, KeyType key);
+
+// (type of a function that) says whether a cached value no longer holds
+typedef bool (*Stale_fptr)(KeyType key, const char *value);
+
+// (type of a function that) removes every entry stale() picks, and returns
+// how many went
+typedef size_t (*Invalidate_fptr)(Stale_fptr stale);
+
+// (type of a function that) writes the cache to a snapshot file,
+// returns false on failure
+typedef bool (*SaveSnapshot_fptr)(const char *path, uint64_t fingerprint);
+
+// (type of a function that) restores a snapshot file into the cache,
+// returns the number of entries restored or -1 if there was none to use
+typedef int (*LoadSnapshot_fptr)(const char *path, uint64_t fingerprint);
+
+// (type of a function that) names the price table the values are solved for
+typedef void (*SetFingerprint_fptr)(uint64_t fingerprint);
+
 /*
 ** This is the interface that a program uses to access/use a cache.
 ** It is returned by load_cache_module() and then main() calls these functions.
@@ -91,6 +164,70 @@ typedef struct chooks {
     // (can be called by main() any time before cleanup())
     Void_fptr reset_statistics;
 
+    // function in library to bound the number of entries:
+    // (min == max fixes the capacity, min < max lets the cache adapt it
+    // between them. byte_budget > 0 also caps the bytes held. Can be called
+    // by main() any time before cleanup())
+    SetCapacity_fptr set_capacity;
+
+    // functions in library to persist the cache across restarts:
+    // (fingerprint identifies the price table the values were solved for;
+    // a snapshot is never restored for a different one. main() calls
+    // load_snapshot() once before the first request, and save_snapshot()
+    // just before cache_cleanup())
+    SaveSnapshot_fptr save_snapshot;
+    LoadSnapshot_fptr load_snapshot;
+
+    // functions in library used to stack caches in tiers:
+    // (set_eviction_handler() makes the cache pass each evicted value to
+    // the handler instead of freeing it. insert() adds a value from outside,
+    // such as one demoted from the tier above. Either can be called any
+    // time before cleanup())
+    SetEviction_fptr set_eviction_handler;
+    Insert_fptr insert;
+
+    // functions in library to take values solved ahead of any request:
+    // (the cache decides which to keep, and goes in at the end it evicts
+    // from. admit_many() first says which keys it would keep, so values are
+    // only made for those. Either can be called any time before cleanup(),
+    // including from inside the provider the cache was given)
+    InsertMany_fptr insert_many;
+    AdmitMany_fptr admit_many;
+
+    // function in library to move its entries into a replacement cache:
+    // (the entries handed over leave the cache, or are copies if other
+    // processes still share them. The replacement takes them through
+    // insert(), coldest first. After this, main() only calls cleanup())
+    Export_fptr export_entries;
+
+    // function in library to learn the prices before any request:
+    // (fingerprint is the one snapshots carry. migrate_cache() calls it on
+    // the replacement before inserting, so a module that finds its entries
+    // by the prices has them somewhere to go)
+    SetFingerprint_fptr set_fingerprint;
+
+    // function in library to allocate the values its downstream returns:
+    // (main() hands it to the solver, so values can come from the cache's
+    // own pool. Memory from it must only ever be given to this cache)
+    AllocValue_fptr alloc_value;
+
+    // function in library to drop entries the prices no longer give:
+    // (main() calls it when the prices are reloaded, between requests.
+    // Without it the prices cannot be reloaded while the cache is in use,
+    // and the default returns INVALIDATE_UNSUPPORTED)
+    Invalidate_fptr invalidate;
+
+    // function in library to hand out its own values:
+    // (after set_provider_func, does what the provider it returned does but
+    // returns a reference to the value the cache holds rather than a copy.
+    // The only hook left NULL if the library lacks it)
+    GetValue_fptr get_value;
+
+    // function in library to hold keys alone:
+    // (called once, before set_provider_func, on a cache that will only
+    // ever be given NULL values, such as a shadow)
+    Void_fptr set_keys_only;
+
     // function in library to close/delete cache: main() should call once
     // before exiting.
     Void_fptr cache_cleanup;
@@ -114,6 +251,244 @@ Cache *load_cache_module(const char *libname);
 // Utility: takes what statistics() returns, prints it.
 void print_cache_stats(int fd, CacheStat *stats);
 
+// Utility: returns the value of one statistic, or -1 if stats is NULL or
+// does not contain it.
+int get_cache_stat(CacheStat *stats, enum Stat_type type);
+
+
+
+/* SHADOW CACHES */
+// A shadow cache is a module loaded only to see how it *would* do on the
+// same key stream as the real cache. It is handed a downstream that never
+// computes anything, so it stores keys with NULL values and never calls the
+// solver. Its statistics are its hypothetical hit ratio.
+// Shadows are opened with open_cache_instance(), so the same library may be
+// loaded as the real cache and as a shadow, and each gets its own instance.
+// A version 1 shadow is told set_keys_only() first.
+
+#define MAX_SHADOWS 8
+
+// Loads and initializes a shadow module. Returns false on failure or if
+// MAX_SHADOWS are already loaded.
+bool load_shadow_module(const char *libname);
+
+// Returns a provider that shows each key to every shadow, then calls
+// provider. Returns provider unchanged if no shadows are loaded.
+ProviderFunction add_shadows(ProviderFunction provider);
+
+// Shows key to every shadow, as the provider add_shadows() returns does.
+void show_shadows(Vec lengths, KeyType key);
+
+// Prints the statistics of every shadow, labeled by library name.
+void print_shadow_stats(int fd);
+
+// Returns the statistics of the shadow loaded index-th, to be freed, or NULL
+// if there is no such shadow.
+CacheStat *get_shadow_stats(size_t index);
+
+// Cleans up and unloads every shadow.
+void cleanup_shadows(void);
+
+
+
+/* TIERED CACHES */
+// Tiers are caches stacked below the one main() loaded: a miss in one tier
+// goes to the caching provider of the next, and only a miss in the last
+// reaches the real provider. A value found below is copied into the tier
+// above, so each tier owns what it holds. Values evicted from a tier are
+// demoted into the next one, through its insert().
+
+#define MAX_TIERS 4
+
+// Loads a module as the tier below the last one loaded. capacity > 0 fixes
+// its capacity. Returns false on failure or if MAX_TIERS are already loaded.
+bool load_tier_module(const char *libname, size_t capacity);
+
+// Stacks the loaded tiers over provider and makes top demote into them.
+// Returns the provider top should be given, or provider unchanged if no
+// tiers are loaded.
+ProviderFunction add_tiers(Cache *top, ProviderFunction provider);
+
+// Returns the cache whose downstream is the real provider: the last tier,
+// or top if no tiers are loaded.
+Cache *bottom_tier(Cache *top);
+
+// Prints the statistics of every tier below the top, labeled by level.
+void print_tier_stats(int fd);
+
+// Cleans up and unloads every tier. Call after the top cache's cleanup.
+void cleanup_tiers(void);
+
+
+
+/* HOT SWAPPING */
+// A running cache can be replaced without starting cold: its live entries
+// are exported and inserted into the replacement, so the hottest end up the
+// safest from eviction. Entries beyond the replacement's capacity are
+// evicted as usual, which demotes them if tiers are loaded.
+
+#define MAX_MIGRATED_ENTRIES 65536
+
+// Moves the entries of from into to, then cleans up and frees from. to must
+// already have its provider set, and is told the fingerprint of the prices
+// first. Returns the number of entries moved.
+size_t migrate_cache(Cache *from, Cache *to, uint64_t fingerprint);
+
+
+
+/* RELOADING PRICES */
+// When the prices change under a running cache, main() asks every cache
+// holding values to drop the ones the new prices could change, and keeps
+// the rest. Shadows hold keys only, so they are left as they are.
+
+#define INVALIDATE_UNSUPPORTED SIZE_MAX
+
+// Drops the entries stale() picks from top and from every tier. Returns how
+// many went in all, or INVALIDATE_UNSUPPORTED, touching none, if any of
+// them lacks invalidate().
+size_t invalidate_caches(Cache *top, Stale_fptr stale);
+
+
+
+
+/* VERSION 2 INTERFACE */
+// Version 1 modules keep their state in globals, so a second instance needs
+// a private copy of the library, and hand every thread a copy of each value.
+// A version 2 module exports a table of functions that take the instance
+// they work on, and returns refcounted handles to values that never change,
+// so a hit costs no copy and stays readable after the entry is evicted.
+
+#define CACHE_INTERFACE_VERSION 2
+
+// An immutable value. Whoever is handed one holds a reference, and must
+// release it once done
+struct cachevalue {
+    atomic_size_t refs;
+    size_t length;
+    const char *text;
+    void (*dispose)(struct cachevalue *value);  // frees it, once unreferenced
+};
+
+static inline void cache_value_dispose(CacheValue value) {
+    free((char *)value->text);
+    free(value);
+}
+
+// Sets up value with one reference, holding text. A module that pools its
+// handles or values passes a dispose that gives them back
+static inline CacheValue cache_value_init(CacheValue value, ValueType text,
+                                          void (*dispose)(CacheValue)) {
+    atomic_init(&value->refs, 1);
+    value->length  = strlen(text);
+    value->text    = text;
+    value->dispose = dispose;
+    return value;
+}
+
+// Wraps an allocated string, taking ownership of it. NULL stays NULL
+static inline CacheValue cache_value_adopt(ValueType text) {
+    if (text == NULL)
+        return NULL;
+
+    return cache_value_init(malloc(sizeof(struct cachevalue)), text,
+                            cache_value_dispose);
+}
+
+static inline void cache_value_free(CacheValue value) {
+    free(value);
+}
+
+// Wraps a copy of text, kept in the same allocation as the handle. NULL
+// stays NULL
+static inline CacheValue cache_value_new(const char *text) {
+    if (text == NULL)
+        return NULL;
+
+    size_t size      = strlen(text) + 1;
+    CacheValue value = malloc(sizeof(struct cachevalue) + size);
+    return cache_value_init(value, memcpy(value + 1, text, size),
+                            cache_value_free);
+}
+
+// Takes another reference to value, and returns it
+static inline CacheValue cache_value_retain(CacheValue value) {
+    if (value != NULL)
+        atomic_fetch_add_explicit(&value->refs, 1, memory_order_relaxed);
+    return value;
+}
+
+// Drops a reference, freeing value with the last one
+static inline void cache_value_release(CacheValue value) {
+    if (value != NULL &&
+        atomic_fetch_sub_explicit(&value->refs, 1, memory_order_acq_rel) == 1)
+        value->dispose(value);
+}
+
+// What a version 2 module exports as cache_module_v2. Every function but
+// create() takes the context create() returned, and may be called from
+// several threads at once except destroy()
+typedef struct cachemodulev2 {
+    int version;  // CACHE_INTERFACE_VERSION the module was built against
+
+    void *(*create)(void);
+    void (*destroy)(void *context);
+
+    // downstream returns allocated values, which the cache takes over
+    void (*set_provider)(void *context, ProviderFunction downstream);
+
+    // Returns a reference to the value of key, or NULL if downstream
+    // gave none. The caller releases it
+    CacheValue (*get)(void *context, Vec lengths, KeyType key);
+
+    CacheStat *(*statistics)(void *context);
+    void (*reset_statistics)(void *context);
+    void (*set_capacity)(void *context, size_t min, size_t max,
+                         size_t byte_budget);
+} CacheModuleV2;
+
+// One cache, whichever version its module implements
+typedef struct cacheinstance {
+    const CacheModuleV2 *ops;
+    void *context;
+} CacheInstance;
+
+// Creates a new instance of a version 2 module, or loads a version 1 module
+// (from a private copy if it is already loaded) behind an adapter that
+// copies each value it returns into a handle. Returns NULL on failure.
+// Call ops->set_provider() before any other function
+CacheInstance *open_cache_instance(const char *libname);
+
+// Destroys the instance, cleaning up a version 1 module
+void close_cache_instance(CacheInstance *instance);
+
+// The version 2 functions over cache, loaded by load_cache_module() and
+// handed its downstream, whose set_provider_func() returned provider. get()
+// returns the module's own reference if it has get_value(), and otherwise a
+// copy of what provider returns. Returns NULL on failure. Closing the
+// instance leaves the cache loaded
+CacheInstance *open_installed_cache(Cache *cache, ProviderFunction provider);
+
+
+
+/* BUILT-IN MODULES */
+// make builtin links every module in the tree into the programs, each
+// optimized together with its support code and with all of its symbols made
+// local but one registry entry. load_cache_module() and
+// open_cache_instance() take the name of a built-in (its source file
+// without .c) in place of a library path, and only go to dlopen() for
+// anything else, so third-party modules still load as ever.
+// A version 1 built-in has a single set of globals, so it can be loaded only
+// once at a time, and again after its cleanup(); its version 2 instances are
+// unlimited.
+
+// A module's entry, found by the loader in the cache_builtins section
+typedef struct builtinmodule {
+    const char *name;
+    Void_fptr initialize;
+    Cache hooks;  // missing ones NULL, filled in as for a library
+    const CacheModuleV2 *module_v2;
+    bool *loaded;  // while the hooks are in use, until their cleanup()
+} BuiltinModule;
 
 
 
@@ -139,9 +514,21 @@ void initialize(void);
 // It passes in the function that will be cached.
 // You must return a function that calls the original function
 // and caches the result.
+// The returned function may be called from several threads at once, as
+// may every other function here except initialize() and cleanup(). What it
+// returns must stay valid until the same thread calls it again, so hand
+// each thread its own copy rather than the cached value itself. Threads
+// that miss on a key another thread is computing should wait for that
+// result (see singleflight.h) and count it as the Cache_coalesced stat.
 ProviderFunction set_provider(ProviderFunction downstream);
 
 
+// may be called after set_provider(), like the provider it returned. Gives
+// the value that provider would copy out as a reference the caller
+// releases, so main() need not copy it.
+CacheValue get_value(Vec lengths, KeyType key);
+
+
 // may be called by main() any number of times before cleanup().
 // Returns NULL or an allocated pointer that main() must free.
 CacheStat* statistics(void);
@@ -151,9 +538,92 @@ CacheStat* statistics(void);
 void reset_statistics(void);
 
 
+// main() can call this any time before cleanup().
+// Bounds are clamped to whatever the module supports. A module that
+// adapts its capacity should report it as the Cache_capacity statistic.
+void set_capacity(size_t min, size_t max, size_t byte_budget);
+
+
+// main() calls this once before cleanup(), if it wants the cache kept.
+// Write every entry and enough order to rebuild the eviction state.
+bool save_snapshot(const char *path, uint64_t fingerprint);
+
+
+// main() calls this once after set_provider(), before any requests.
+// Restore nothing unless the fingerprint matches the one saved.
+int load_snapshot(const char *path, uint64_t fingerprint);
+
+
+// main() can call this any time before cleanup(). From then on evicted
+// values go to handler, which owns them, instead of being freed.
+void set_eviction_handler(Eviction_fptr handler);
+
+
+// may be called any time before cleanup(). Stores value as if it had just
+// been provided, without counting a request. The cache owns value either
+// way, and frees it if it does not keep it.
+void insert(KeyType key, ValueType value);
+
+
+// may be called any time before cleanup(), even while the provider is
+// running. Prefetched values go in where the next eviction would take them
+// from: free room, another prefetched value never asked for, or the place of
+// the entry the policy would evict next. They stay the next to go until
+// they are asked for. The cache owns every value, and frees those it does
+// not keep.
+void insert_many(const KeyType keys[], ValueType values[], size_t count);
+
+
+// may be called any time insert_many() may. Keep in keys, in order, those
+// insert_many() would store if called now, typically the ones not held
+// yet, and return how many. Without it every key is offered.
+size_t admit_many(KeyType keys[], size_t count);
+
+
+// may be called from any thread, by whatever the provider given to
+// set_provider() is, to allocate the values it returns. Pool them if you
+// like: they are handed back to this cache and to nothing else. Anything
+// handed out, to an eviction handler or by export_entries(), must be
+// allocated with malloc(). Every other value may come from malloc() too.
+void *alloc_value(size_t size);
+
+
+// main() calls this when it reloads the prices, with no request running.
+// Remove every entry stale() picks, without counting it as an eviction or
+// handing it to the eviction handler, and return how many went. A module
+// whose entries are shared may leave them to the processes sharing them.
+size_t invalidate(Stale_fptr stale);
+
+
+// load_shadow_module() calls this once, before set_provider(), on a cache
+// whose downstream only ever returns NULL. A module whose entries are shared
+// with other processes must keep this one's keys to itself.
+void set_keys_only(void);
+
+
+// main() calls this once, just before cleanup(), when it replaces this
+// cache with another. Write up to max entries, hottest first, and give up
+// the values written: cleanup() must not free them.
+size_t export_entries(KeyType keys[], ValueType values[], size_t max);
+
+
+// migrate_cache() calls this before inserting the entries of the cache this
+// one replaces. fingerprint names the prices, as for snapshots, so a module
+// whose entries are found by the prices can get ready to take them.
+void set_fingerprint(uint64_t fingerprint);
+
+
 // main() should call this once once, at end of program
 void cleanup(void);
 
+
+// A module may also, or instead, export the version 2 interface. Its
+// instances share nothing, so every cache_module_v2.create() gives a fresh,
+// independent cache. main()'s own cache is still driven through the
+// functions above, so a module meant for it should keep them, for example
+// as wrappers around one default instance.
+const CacheModuleV2 cache_module_v2;
+
 #endif
 
 
@@ -0,0 +1,180 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache.h"
+#include "inputreader.h"
+#include "pricetable.h"
+#include "rodcutsolver.h"
+#include "workload.h"
+
+/*
+** Cache module microbenchmark.
+** Times the caching provider of a module with a downstream that only copies
+** precomputed answers, so what is measured is the cache itself:
+**   hits:  every key already cached, keys drawn uniformly
+**   mixed: a workload over --max-key keys at the module's --capacity
+** Results are nanoseconds per request, averaged over --count requests.
+*/
+
+#define DEFAULT_COUNT 1000000
+#define DEFAULT_CAPACITY 1000
+#define DEFAULT_MAX_KEY 4000
+#define DEFAULT_SKEW 1.0
+
+#define USAGE_FMT                                                         \
+    "Usage: %s lengths_file.txt ./cache.so [--count=N] [--capacity=N] "   \
+    "[--max-key=N] [--generate=uniform|zipf] [--skew=X] [--seed=N]\n"
+
+char** answers             = NULL;  // solution of every key, solved up front
+AllocValue_fptr allocate   = NULL;  // the module's, as main would use it
+
+
+// Stands in for the solver: hands out a copy of the precomputed answer
+ValueType copyAnswer(Vec lengths, KeyType key) {
+    (void)lengths;
+
+    size_t size  = strlen(answers[key]) + 1;
+    char* answer = allocate(size);
+    return memcpy(answer, answers[key], size);
+}
+
+double secondsSince(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Returns nanoseconds per request for count requests drawn from load
+double timeRequests(ProviderFunction provider, Vec lengths, Workload load,
+                    size_t count) {
+    struct timespec start;
+    size_t checksum = 0;  // keeps the calls from being optimized away
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (size_t ix = 0; ix < count; ix++)
+        checksum += provider(lengths, workload_next(load))[0];
+
+    double seconds = secondsSince(&start);
+    if (checksum == 0)
+        printf("\n");
+    return seconds * 1e9 / count;
+}
+
+int main(int argc, char* argv[]) {
+    const char* lengths_file = NULL;
+    const char* module       = NULL;
+    const char* generate     = "zipf";
+    size_t count             = DEFAULT_COUNT;
+    size_t capacity          = DEFAULT_CAPACITY;
+    size_t max_key           = DEFAULT_MAX_KEY;
+    size_t seed              = 1;
+    double skew              = DEFAULT_SKEW;
+
+    for (int ix = 1; ix < argc; ix++) {
+        const char* value = NULL;
+        bool valid        = true;
+
+        if (matchFlag(argv[ix], "count", &value))
+            valid = parseSize(value, &count) && count > 0;
+        else if (matchFlag(argv[ix], "capacity", &value))
+            valid = parseSize(value, &capacity) && capacity > 0;
+        else if (matchFlag(argv[ix], "max-key", &value))
+            valid = parseSize(value, &max_key) && max_key > 0 &&
+                    max_key <= MAX_ROD_LENGTH;
+        else if (matchFlag(argv[ix], "generate", &value))
+            valid = (generate = value) != NULL;
+        else if (matchFlag(argv[ix], "skew", &value))
+            valid = value != NULL && (skew = atof(value)) > 0;
+        else if (matchFlag(argv[ix], "seed", &value))
+            valid = parseSize(value, &seed);
+        else if (strncmp(argv[ix], "--", 2) != 0 && lengths_file == NULL)
+            lengths_file = argv[ix];
+        else if (strncmp(argv[ix], "--", 2) != 0 && module == NULL)
+            module = argv[ix];
+        else
+            valid = false;
+
+        if (!valid) {
+            printErr(FLAG_INVALID, argv[ix], COMMAND_LINE_ARG_SIZE);
+            fprintf(stderr, USAGE_FMT, argv[0]);
+            return 1;
+        }
+    }
+
+    WorkloadType type;
+    if (module == NULL || !parseWorkloadType(generate, &type)) {
+        fprintf(stderr, USAGE_FMT, argv[0]);
+        return 1;
+    }
+
+    PriceTable price_table = NULL;
+    Vec lengths            = loadPrices(lengths_file, false, &price_table);
+    if (lengths == NULL || vec_length(lengths) == 0) {
+        printErr(FILE_INVALID, lengths_file, COMMAND_LINE_ARG_SIZE);
+        freePrices(lengths, price_table);
+        return 1;
+    }
+
+    Cache* cache = load_cache_module(module);
+    if (cache == NULL) {
+        printErr(CACHE_INVALID, module, COMMAND_LINE_ARG_SIZE);
+        freePrices(lengths, price_table);
+        return 1;
+    }
+
+    answers = malloc((max_key + 1) * sizeof(char*));
+    for (size_t key = 1; key <= max_key; key++)
+        answers[key] = solveRodCutting(lengths, key);
+
+    allocate                  = cache->alloc_value;
+    ProviderFunction provider = cache->set_provider_func(copyAnswer);
+    cache->set_capacity(capacity, capacity, 0);
+
+    // hits: fill the cache with keys it can hold, then ask only for those
+    size_t hot_keys = capacity < max_key ? capacity : max_key;
+    for (size_t key = 1; key <= hot_keys; key++)
+        provider(lengths, key);
+
+    Workload hot = new_workload(WORKLOAD_UNIFORM, hot_keys, skew, seed);
+    cache->reset_statistics();
+    double hit_ns = timeRequests(provider, lengths, hot, count);
+
+    CacheStat* stats = cache->get_statistics();
+    int hot_misses   = get_cache_stat(stats, Cache_misses);
+    free(stats);
+    workload_free(hot);
+
+    // mixed: the whole key range at this capacity, after one warm up pass
+    Workload load = new_workload(type, max_key, skew, seed);
+    timeRequests(provider, lengths, load, count);
+    cache->reset_statistics();
+    double mixed_ns = timeRequests(provider, lengths, load, count);
+
+    stats        = cache->get_statistics();
+    int requests = get_cache_stat(stats, Cache_requests);
+    int hits     = get_cache_stat(stats, Cache_hits);
+    free(stats);
+    workload_free(load);
+
+    printf("%s: capacity %zu, %zu keys (%s)\n", module, capacity, max_key,
+           generate);
+    printf("  hits   %8.1f ns/request", hit_ns);
+    if (hot_misses > 0)
+        printf("  (%d missed)", hot_misses);
+    printf("\n  mixed  %8.1f ns/request  %5.1f%% hits\n", mixed_ns,
+           requests > 0 ? 100.0 * hits / requests : 0);
+
+    cache->cache_cleanup();
+    free(cache);
+
+    for (size_t key = 1; key <= max_key; key++)
+        free(answers[key]);
+    free(answers);
+    freePrices(lengths, price_table);
+    return 0;
+}
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inputreader.h"
+#include "pricetable.h"
+
+/*
+** Price file converter.
+** Reads a text price file of "length, price" lines and writes the binary
+** price table that main, the tester and the other tools map in its place.
+*/
+
+#define USAGE_FMT "Usage: %s lengths_file.txt prices.bin [--quiet]\n"
+
+
+int main(int argc, char* argv[]) {
+    const char* positional[2];
+    int positional_count = 0;
+    bool quiet           = false;
+
+    for (int ix = 1; ix < argc; ix++) {
+        const char* value = NULL;
+
+        if (matchFlag(argv[ix], "quiet", &value) && value == NULL) {
+            quiet = true;
+        } else if (strncmp(argv[ix], "--", 2) != 0 && positional_count < 2) {
+            positional[positional_count++] = argv[ix];
+        } else {
+            fprintf(stderr, USAGE_FMT, argv[0]);
+            return 1;
+        }
+    }
+
+    if (positional_count != 2) {
+        fprintf(stderr, USAGE_FMT, argv[0]);
+        return 1;
+    }
+
+    const char* filename    = positional[0];
+    const char* prices_file = positional[1];
+
+    printf("Reading lengths from '%s'...\n", filename);
+    Vec length_prices = loadPriceFile(filename, !quiet);
+
+    if (length_prices == NULL) {
+        printErr(FILE_INVALID, filename, COMMAND_LINE_ARG_SIZE);
+        return 1;
+    }
+    if (vec_length(length_prices) == 0) {
+        printErr(FILE_NO_VALID_LINES, filename, COMMAND_LINE_ARG_SIZE);
+        vec_free(length_prices);
+        return 1;
+    }
+
+    if (!writePriceTable(prices_file, length_prices)) {
+        printErr(FILE_INVALID, prices_file, COMMAND_LINE_ARG_SIZE);
+        vec_free(length_prices);
+        return 1;
+    }
+
+    printf("Wrote %zu lengths to '%s'\n", vec_length(length_prices),
+           prices_file);
+    vec_free(length_prices);
+    return 0;
+}
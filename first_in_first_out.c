@@ -1,190 +1,745 @@
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "adaptive.h"
 #include "cache.h"
+#include "instrument.h"
+#include "singleflight.h"
+#include "slab.h"
+#include "snapshot.h"
+#include "trace.h"
 
 /* First in, first out */
 
+// Every instance keeps its own queue, so one copy of the library can host
+// any number of caches through cache_module_v2. The version 1 functions
+// work on a default instance made by initialize().
+// Value handles, and the values from alloc_value(), are pooled for the
+// whole library, since a handle may outlive the instance that made it.
+
 typedef struct node {
     KeyType key;
-    ValueType value;
+    CacheValue value;
+    bool prefetched;  // inserted ahead of any request, and not used since
 } * FIFOnode;
 
 #define MAX_KEY 100000
-#define CACHE_SIZE 50
+#define CACHE_SIZE 50      // default capacity
+#define MAX_CAPACITY 4096  // most entries set_capacity() can allow
 #define MAP_SIZE MAX_KEY + 1
+#define MAX_VALUE_SIZE 256  // larger values are malloc()ed
 
 #define VALUE_NOT_PRESENT NULL
 #define KEY_NOT_PRESENT -1
 
-FIFOnode cache[CACHE_SIZE];  // circular array acting as a queue
+typedef struct fifo {
+    FIFOnode cache[MAX_CAPACITY];  // circular array acting as a queue
+
+    int key_map[MAP_SIZE];  // list of cache indexes
+                            // maps the real key to an index in the cache
+
+    size_t q_head;       // queue head, oldest entry and next to evict
+    size_t q_count;      // entries in the queue, the tail is head + count
+    size_t saved_bytes;  // nodes plus their values
+
+    Sizer sizer;  // current capacity, and ghosts when adaptive
+    Slab node_slab;
+    size_t allocations_at_reset;
+
+    int requests;
+    int hits;
+    int misses;
+    int evictions;
+    int ghost_hits;
+    int prefetched;
+    int prefetch_hits;
+    int coalesced;
+
+    // every function called from outside holds this while it works
+    pthread_mutex_t lock;
+    Flights flights;  // misses being computed right now
+
+    ProviderFunction downstream;
+    Eviction_fptr eviction_handler;  // takes evicted values, if set
+} * Fifo;
+
+Fifo fifo = NULL;  // the instance behind the version 1 functions
+
+Slab handle_slab = NULL;  // every CacheValue made here
+Slab value_slab  = NULL;  // values from alloc_value()
+pthread_once_t slabs_made = PTHREAD_ONCE_INIT;
+
+// each thread's copy of the value the version 1 provider last gave it
+__thread char* returned_value = NULL;
+__thread size_t returned_size = 0;
+pthread_key_t returned_key;  // frees the copy when its thread exits
+
+
+size_t node_bytes(FIFOnode c_node) {
+    return sizeof(struct node) +
+           (c_node->value ? sizeof(struct cachevalue) +
+                                c_node->value->length + 1
+                          : 0);
+}
+
 
-int key_map[MAP_SIZE];  // list of cache indexes
-                        // maps the real key to an index in the cache
+void _make_slabs(void) {
+    handle_slab = new_slab(sizeof(struct cachevalue), CACHE_SIZE);
+    value_slab  = new_slab(MAX_VALUE_SIZE, CACHE_SIZE);
+}
 
-size_t q_tail = 0;  // queue tail, index to insert at
 
-int cache_requests;
-int cache_hits;
-int cache_misses;
+void _dispose_pooled(CacheValue value) {
+    slab_release(value_slab, (char*)value->text);
+    slab_release(handle_slab, value);
+}
 
-ProviderFunction _downstream = NULL;
 
+// A handle to text from the pools, taking ownership of text. NULL stays NULL
+CacheValue _pooled_value(ValueType text) {
+    if (text == NULL)
+        return NULL;
 
-FIFOnode node_new(KeyType key, ValueType val) {
-    FIFOnode n_node = malloc(sizeof(struct node));
-    n_node->key     = key;
-    n_node->value   = val;
+    return cache_value_init(slab_alloc(handle_slab, sizeof(struct cachevalue)),
+                            text, _dispose_pooled);
+}
+
+
+FIFOnode node_new(Fifo f, KeyType key, CacheValue val) {
+    FIFOnode n_node = slab_alloc(f->node_slab, sizeof(struct node));
+    n_node->key        = key;
+    n_node->value      = val;
+    n_node->prefetched = false;
     return n_node;
 }
 
 
-void node_free(FIFOnode c_node) {
-    if (c_node->value)
-        free(c_node->value);
-    free(c_node);
+void node_free(Fifo f, FIFOnode c_node) {
+    cache_value_release(c_node->value);
+    slab_release(f->node_slab, c_node);
 }
 
 
-void initialize(void) {
-    DEBUG_PRINT(__FILE__ " initialize()\n");
+// An allocated copy of value's text, for the version 1 functions that hand
+// values over. Releases value
+ValueType _give_up(CacheValue value) {
+    ValueType text = value ? strdup(value->text) : NULL;
+    cache_value_release(value);
+    return text;
+}
+
+
+void _reset_counts(Fifo f) {
+    f->requests      = 0;
+    f->hits          = 0;
+    f->misses        = 0;
+    f->evictions     = 0;
+    f->ghost_hits    = 0;
+    f->prefetched    = 0;
+    f->prefetch_hits = 0;
+    f->coalesced     = 0;
+}
 
-    cache_requests = 0;
-    cache_hits     = 0;
-    cache_misses   = 0;
 
-    for (int ix = 0; ix < CACHE_SIZE; ix++)
-        cache[ix] = NULL;
+// Heap allocations made for entries since the statistics were reset. The
+// pools for values are shared with every other instance
+size_t _allocations(Fifo f) {
+    return slab_allocations(f->node_slab) + slab_allocations(handle_slab) +
+           slab_allocations(value_slab) - f->allocations_at_reset;
+}
+
+
+Fifo _fifo_new(void) {
+    pthread_once(&slabs_made, _make_slabs);
+
+    Fifo f = malloc(sizeof(struct fifo));
+
+    _reset_counts(f);
+    f->node_slab            = new_slab(sizeof(struct node), CACHE_SIZE);
+    f->allocations_at_reset = 0;
+
+    f->q_head           = 0;
+    f->q_count          = 0;
+    f->saved_bytes      = 0;
+    f->sizer            = new_sizer(CACHE_SIZE, MAX_KEY);
+    f->downstream       = NULL;
+    f->eviction_handler = NULL;
+
+    pthread_mutex_init(&f->lock, NULL);
+    f->flights = new_flights(&f->lock);
+
+    for (int ix = 0; ix < MAX_CAPACITY; ix++)
+        f->cache[ix] = NULL;
 
     for (int iy = 0; iy < MAP_SIZE; iy++)
-        key_map[iy] = KEY_NOT_PRESENT;
+        f->key_map[iy] = KEY_NOT_PRESENT;
+
+    return f;
+}
+
+
+void _fifo_free(Fifo f) {
+    for (size_t ix = 0; ix < MAX_CAPACITY; ix++)
+        if (f->cache[ix] != NULL) {
+            DEBUG_PRINT(KEY_FMT " ", f->cache[ix]->key);
+            node_free(f, f->cache[ix]);
+        }
+
+    sizer_free(f->sizer);
+    slab_free(f->node_slab);
+    flights_free(f->flights);
+    pthread_mutex_destroy(&f->lock);
+    free(f);
+}
+
+
+void initialize(void) {
+    DEBUG_PRINT(__FILE__ " initialize()\n");
+    pthread_key_create(&returned_key, free);
+    fifo = _fifo_new();
 }
 
 
 void cleanup(void) {
     DEBUG_PRINT(__FILE__ " cleanup(): ");
 
-    for (size_t ix = 0; ix < CACHE_SIZE; ix++)
-        if (cache[ix] != NULL) {
-            DEBUG_PRINT(KEY_FMT " ", cache[ix]->key);
-            node_free(cache[ix]);
-        }
+    if (fifo != NULL) {
+        _fifo_free(fifo);
+        fifo = NULL;
+    }
+
+    free(returned_value);
+    returned_value = NULL;
+    returned_size  = 0;
+    pthread_key_delete(returned_key);
 
     DEBUG_PRINT("freed\n");
 }
 
 
+void _reset_statistics(Fifo f) {
+    pthread_mutex_lock(&f->lock);
+    _reset_counts(f);
+    f->allocations_at_reset += _allocations(f);
+    pthread_mutex_unlock(&f->lock);
+}
+
 void reset_statistics(void) {
     DEBUG_PRINT(__FILE__ " reset_statistics()\n");
-    cache_requests = 0;
-    cache_hits     = 0;
-    cache_misses   = 0;
+    _reset_statistics(fifo);
 }
 
 
+CacheStat* _statistics(Fifo f) {
+    CacheStat* stats_cache = malloc(12 * sizeof(CacheStat));
+
+    pthread_mutex_lock(&f->lock);
+    stats_cache[0]  = (CacheStat){Cache_requests, f->requests};
+    stats_cache[1]  = (CacheStat){Cache_hits, f->hits};
+    stats_cache[2]  = (CacheStat){Cache_misses, f->misses};
+    stats_cache[3]  = (CacheStat){Cache_evictions, f->evictions};
+    stats_cache[4]  = (CacheStat){Cache_size, f->q_count};
+    stats_cache[5]  = (CacheStat){Cache_capacity, f->sizer->capacity};
+    stats_cache[6]  = (CacheStat){Cache_ghost_hits, f->ghost_hits};
+    stats_cache[7]  = (CacheStat){Cache_prefetched, f->prefetched};
+    stats_cache[8]  = (CacheStat){Cache_prefetch_hits, f->prefetch_hits};
+    stats_cache[9]  = (CacheStat){Cache_coalesced, f->coalesced};
+    stats_cache[10] = (CacheStat){Cache_allocations, _allocations(f)};
+    stats_cache[11] = (CacheStat){END_OF_STATS, 0};
+    pthread_mutex_unlock(&f->lock);
+
+    return stats_cache;
+}
+
 CacheStat* statistics(void) {
     DEBUG_PRINT(__FILE__ " statistics()\n");
+    return _statistics(fifo);
+}
 
-    CacheStat* stats_cache = malloc(4 * sizeof(CacheStat));
-    stats_cache[0]         = (CacheStat){Cache_requests, cache_requests};
-    stats_cache[1]         = (CacheStat){Cache_hits, cache_hits};
-    stats_cache[2]         = (CacheStat){Cache_misses, cache_misses};
-    stats_cache[3]         = (CacheStat){Cache_size, CACHE_SIZE};
-    stats_cache[4]         = (CacheStat){END_OF_STATS, 0};
 
-    return stats_cache;
+// Remove the entry at the head of the queue
+void _evict_head(Fifo f) {
+    INSTRUMENT_START(evict_timer);
+    FIFOnode old_node = f->cache[f->q_head];
+    KeyType old_key   = old_node->key;
+
+    TRACE(TRACE_EVICT, old_key, f->q_head);
+
+    f->key_map[old_key] = KEY_NOT_PRESENT;
+    sizer_record_eviction(f->sizer, old_key);
+    f->saved_bytes -= node_bytes(old_node);
+
+    if (f->eviction_handler != NULL) {
+        f->eviction_handler(old_key, _give_up(old_node->value));
+        old_node->value = NULL;
+    }
+    node_free(f, old_node);
+    f->evictions++;
+
+    f->cache[f->q_head] = NULL;
+    f->q_head           = (f->q_head + 1) % MAX_CAPACITY;
+    f->q_count--;
+    INSTRUMENT_STOP(STAGE_EVICT, evict_timer);
 }
 
 
-// print every cached key, and show where the tail currently is
-void print_cache() {
-    #ifdef DEBUG
-    DEBUG_PRINT(__FILE__ " print_cache()\n");
+// Evict the oldest entries until the cache fits its capacity and byte budget
+void _shrink_to_fit(Fifo f) {
+    size_t capacity = sizer_update(f->sizer, f->saved_bytes, f->q_count);
+
+    while (f->q_count > 0 &&
+           (f->q_count > capacity ||
+            (sizer_over_budget(f->sizer, f->saved_bytes) &&
+             f->q_count > f->sizer->min_capacity)))
+        _evict_head(f);
+}
 
-    for (size_t ix = 0; ix < CACHE_SIZE; ix++) {
-        if (cache[ix])
-            DEBUG_PRINT(KEY_FMT, cache[ix]->key);
-        else if (ix == q_tail)
-            DEBUG_PRINT("null");
 
-        if (ix == q_tail)
-            DEBUG_PRINT(" < tail");
+void _set_capacity(Fifo f, size_t min, size_t max, size_t byte_budget) {
+    pthread_mutex_lock(&f->lock);
+    sizer_configure(f->sizer, min, max, byte_budget, MAX_CAPACITY);
+    _shrink_to_fit(f);
 
-        if (cache[ix] != NULL || ix == q_tail)
-            DEBUG_PRINT("\n");
-    }
-    DEBUG_PRINT("\n");
-    #endif
+    // room for every entry up front, so a full cache allocates nothing
+    slab_reserve(f->node_slab, f->sizer->max_capacity);
+    slab_reserve(handle_slab, f->sizer->max_capacity);
+    slab_reserve(value_slab, f->sizer->max_capacity);
+    pthread_mutex_unlock(&f->lock);
 }
 
+void set_capacity(size_t min, size_t max, size_t byte_budget) {
+    DEBUG_PRINT(__FILE__ " set_capacity(%zu, %zu, %zu)\n", min, max,
+                byte_budget);
+    _set_capacity(fifo, min, max, byte_budget);
+}
 
-bool _is_present(KeyType key) {
-    bool present = key <= MAX_KEY && key_map[key] != KEY_NOT_PRESENT;
 
-    DEBUG_PRINT(__FILE__ " is_present(" KEY_FMT ") = %s\n", key,
-                present ? "true" : "false");
+bool _is_present(Fifo f, KeyType key) {
+    bool present = key <= MAX_KEY && f->key_map[key] != KEY_NOT_PRESENT;
+
+    TRACE(present ? TRACE_PRESENT : TRACE_ABSENT, key,
+          present ? (size_t)f->key_map[key] : TRACE_NO_SLOT);
 
     return present;
 }
 
 
-void _insert(KeyType key, ValueType value) {
-    if (key > MAX_KEY)
+void _insert(Fifo f, KeyType key, CacheValue value) {
+    if (key > MAX_KEY) {
+        cache_value_release(value);
         return;
+    }
+
+    if (f->q_count >= f->sizer->capacity)
+        _evict_head(f);
+
+    size_t q_tail = (f->q_head + f->q_count) % MAX_CAPACITY;
+
+    f->cache[q_tail] = node_new(f, key, value);
+    f->key_map[key]  = q_tail;
+    f->saved_bytes += node_bytes(f->cache[q_tail]);
+    f->q_count++;
+
+    TRACE(TRACE_INSERT, key, q_tail);
+}
+
 
-    DEBUG_PRINT(__FILE__ " insert(" KEY_FMT ")", key);
+bool save_snapshot(const char* path, uint64_t fingerprint) {
+    DEBUG_PRINT(__FILE__ " save_snapshot(%s)\n", path);
 
-    if (cache[q_tail] != NULL) {
-        FIFOnode old_node = cache[q_tail];
-        KeyType old_key   = old_node->key;
+    KeyType keys[MAX_CAPACITY];
+    ValueType values[MAX_CAPACITY];
 
-        key_map[old_key]  = KEY_NOT_PRESENT;
-        node_free(old_node);
+    Fifo f = fifo;
+    pthread_mutex_lock(&f->lock);
 
-        DEBUG_PRINT(": evict key " KEY_FMT, old_key);
+    // newest insert first
+    for (size_t ix = 0; ix < f->q_count; ix++) {
+        FIFOnode c_node =
+            f->cache[(f->q_head + f->q_count - 1 - ix) % MAX_CAPACITY];
+        keys[ix]   = c_node->key;
+        values[ix] = c_node->value ? (ValueType)c_node->value->text : NULL;
     }
-    DEBUG_PRINT("\n");
 
-    cache[q_tail] = node_new(key, value);
-    key_map[key]  = q_tail;
-    q_tail        = (q_tail + 1) % CACHE_SIZE;
+    bool saved = snapshot_write(path, fingerprint, keys, values, f->q_count);
 
-    print_cache();  // for debugging
+    pthread_mutex_unlock(&f->lock);
+    return saved;
 }
 
 
-ValueType _get(KeyType key) {
-    if (key > MAX_KEY || key_map[key] == KEY_NOT_PRESENT)
-        return VALUE_NOT_PRESENT;
+size_t export_entries(KeyType keys[], ValueType values[], size_t max) {
+    DEBUG_PRINT(__FILE__ " export_entries(%zu)\n", max);
+
+    Fifo f = fifo;
+    pthread_mutex_lock(&f->lock);
+
+    size_t count = f->q_count < max ? f->q_count : max;
+
+    // newest insert first, taken off the tail
+    for (size_t ix = 0; ix < count; ix++) {
+        size_t q_tail   = (f->q_head + f->q_count - 1) % MAX_CAPACITY;
+        FIFOnode c_node = f->cache[q_tail];
 
-    size_t map_idx   = key_map[key];
-    ValueType result = cache[map_idx]->value;
+        f->key_map[c_node->key] = KEY_NOT_PRESENT;
+        f->saved_bytes -= node_bytes(c_node);
 
-    DEBUG_PRINT(__FILE__ " get(" KEY_FMT ")\n", key);
+        keys[ix]      = c_node->key;
+        values[ix]    = _give_up(c_node->value);
+        c_node->value = NULL;
+        node_free(f, c_node);
+
+        f->cache[q_tail] = NULL;
+        f->q_count--;
+    }
+
+    pthread_mutex_unlock(&f->lock);
+    return count;
+}
+
+
+// The entries kept close up towards the head, in the same order
+size_t _invalidate(Fifo f, Stale_fptr stale) {
+    pthread_mutex_lock(&f->lock);
+
+    size_t kept = 0;
+
+    for (size_t ix = 0; ix < f->q_count; ix++) {
+        size_t from     = (f->q_head + ix) % MAX_CAPACITY;
+        FIFOnode c_node = f->cache[from];
+        f->cache[from]  = NULL;
+
+        if (stale(c_node->key, c_node->value ? c_node->value->text : NULL)) {
+            f->key_map[c_node->key] = KEY_NOT_PRESENT;
+            f->saved_bytes -= node_bytes(c_node);
+            node_free(f, c_node);
+            continue;
+        }
+
+        size_t to               = (f->q_head + kept++) % MAX_CAPACITY;
+        f->cache[to]            = c_node;
+        f->key_map[c_node->key] = to;
+    }
+
+    size_t removed = f->q_count - kept;
+    f->q_count     = kept;
+
+    pthread_mutex_unlock(&f->lock);
+    return removed;
+}
+
+size_t invalidate(Stale_fptr stale) {
+    DEBUG_PRINT(__FILE__ " invalidate()\n");
+    return _invalidate(fifo, stale);
+}
+
+
+int load_snapshot(const char* path, uint64_t fingerprint) {
+    DEBUG_PRINT(__FILE__ " load_snapshot(%s)\n", path);
+
+    Snapshot snap = snapshot_open(path, fingerprint);
+    if (snap == NULL)
+        return -1;
+
+    Fifo f = fifo;
+    pthread_mutex_lock(&f->lock);
+
+    size_t count = snap->count < f->sizer->capacity ? snap->count
+                                                    : f->sizer->capacity;
+    int restored = 0;
+
+    // oldest first, so the queue comes back in the same order
+    for (size_t ix = count; ix-- > 0;) {
+        KeyType key = snap->entries[ix].key;
+
+        if (key <= MAX_KEY && f->key_map[key] == KEY_NOT_PRESENT) {
+            _insert(f, key, _pooled_value(snapshot_value(snap, ix)));
+            restored++;
+        }
+    }
+
+    pthread_mutex_unlock(&f->lock);
+
+    snapshot_close(snap);
+    return restored;
+}
+
+
+void set_eviction_handler(Eviction_fptr handler) {
+    DEBUG_PRINT(__FILE__ " set_eviction_handler()\n");
+    pthread_mutex_lock(&fifo->lock);
+    fifo->eviction_handler = handler;
+    pthread_mutex_unlock(&fifo->lock);
+}
+
+
+void insert(KeyType key, ValueType value) {
+    pthread_mutex_lock(&fifo->lock);
+
+    if (key > MAX_KEY || fifo->key_map[key] != KEY_NOT_PRESENT)
+        slab_release(value_slab, value);  // already held, or never could be
+    else
+        _insert(fifo, key, _pooled_value(value));
+
+    pthread_mutex_unlock(&fifo->lock);
+}
+
+
+// Prefetched entries go in at the head, so they are the first to go
+void _admit_prefetched(Fifo f, KeyType key, CacheValue value) {
+    f->q_head = (f->q_head + MAX_CAPACITY - 1) % MAX_CAPACITY;
+    f->q_count++;
+
+    f->cache[f->q_head]             = node_new(f, key, value);
+    f->cache[f->q_head]->prefetched = true;
+    f->key_map[key]                 = f->q_head;
+    f->saved_bytes += node_bytes(f->cache[f->q_head]);
+}
+
+
+// Index of an entry that was prefetched and never used, or KEY_NOT_PRESENT
+int _unused_prefetched(Fifo f) {
+    for (size_t ix = 0; ix < f->q_count; ix++) {
+        size_t idx = (f->q_head + ix) % MAX_CAPACITY;
+        if (f->cache[idx]->prefetched)
+            return idx;
+    }
+    return KEY_NOT_PRESENT;
+}
+
+
+// Puts a new prefetched value in place of an unused one
+void _replace_prefetched(Fifo f, size_t idx, KeyType key, CacheValue value) {
+    FIFOnode c_node = f->cache[idx];
+
+    f->saved_bytes -= node_bytes(c_node);
+    f->key_map[c_node->key] = KEY_NOT_PRESENT;
+    cache_value_release(c_node->value);
+
+    c_node->key     = key;
+    c_node->value   = value;
+    f->key_map[key] = idx;
+    f->saved_bytes += node_bytes(c_node);
+}
+
+
+void insert_many(const KeyType keys[], ValueType values[], size_t count) {
+    DEBUG_PRINT(__FILE__ " insert_many(%zu)\n", count);
+
+    Fifo f = fifo;
+    pthread_mutex_lock(&f->lock);
+
+    for (size_t ix = 0; ix < count; ix++) {
+        KeyType key = keys[ix];
+        int idx;
+
+        if (key > MAX_KEY || f->key_map[key] != KEY_NOT_PRESENT) {
+            slab_release(value_slab, values[ix]);
+            continue;
+        }
+
+        if (f->q_count < f->sizer->capacity &&
+            !sizer_over_budget(f->sizer, f->saved_bytes))
+            _admit_prefetched(f, key, _pooled_value(values[ix]));
+        else if ((idx = _unused_prefetched(f)) != KEY_NOT_PRESENT)
+            _replace_prefetched(f, idx, key, _pooled_value(values[ix]));
+        else if (f->q_count > 0) {
+            _evict_head(f);  // the entry that would have gone next anyway
+            _admit_prefetched(f, key, _pooled_value(values[ix]));
+        } else {
+            slab_release(value_slab, values[ix]);
+            continue;
+        }
+        f->prefetched++;
+    }
+
+    pthread_mutex_unlock(&f->lock);
+}
+
+
+// Every key not held can be taken, at the head
+size_t admit_many(KeyType keys[], size_t count) {
+    Fifo f      = fifo;
+    size_t kept = 0;
+
+    pthread_mutex_lock(&f->lock);
+
+    for (size_t ix = 0; ix < count; ix++)
+        if (keys[ix] <= MAX_KEY && f->key_map[keys[ix]] == KEY_NOT_PRESENT)
+            keys[kept++] = keys[ix];
+
+    pthread_mutex_unlock(&f->lock);
+    return kept;
+}
+
+
+// Computes a missed key with the lock released, unless another thread is
+// already computing it, in which case its result is waited for
+// Takes the lock held and returns with it held
+CacheValue _provide_missed(Fifo f, Vec lengths, KeyType key) {
+    if (sizer_record_miss(f->sizer, key))
+        f->ghost_hits++;
+
+    Flight flight = flights_wait(f->flights, key);
+
+    if (flight != NULL) {
+        f->coalesced++;
+        CacheValue result = cache_value_new(flight->value);
+        flight_leave(flight);
+        return result;
+    }
+
+    flight = flights_start(f->flights, key);
+    pthread_mutex_unlock(&f->lock);
+
+    INSTRUMENT_START(downstream_timer);
+    CacheValue result = _pooled_value((*f->downstream)(lengths, key));
+    INSTRUMENT_STOP(STAGE_DOWNSTREAM, downstream_timer);
+
+    pthread_mutex_lock(&f->lock);
+    INSTRUMENT_START(insert_timer);
+
+    // it may have been published or inserted while unlocked
+    if (!_is_present(f, key))
+        _insert(f, key, cache_value_retain(result));
+
+    INSTRUMENT_STOP(STAGE_INSERT, insert_timer);
+
+    flights_land(f->flights, flight,
+                 result ? (ValueType)result->text : NULL);
     return result;
 }
 
 
-// used externally but not referenced externally --
-// only by the set_provider function
-ValueType _caching_provider(Vec lengths, KeyType key) {
-    cache_requests++;
+// Returns a reference to the value of key, from the queue or downstream
+CacheValue _get(Fifo f, Vec lengths, KeyType key) {
+    pthread_mutex_lock(&f->lock);
+    f->requests++;
+
+    // resize before the lookup, so the value returned is never evicted
+    if (sizer_is_adaptive(f->sizer))
+        _shrink_to_fit(f);
+
+    INSTRUMENT_START(lookup_timer);
+
+    if (_is_present(f, key)) {
+        f->hits++;
+
+        // entries nearer the tail were inserted later and are safer
+        if (sizer_is_adaptive(f->sizer)) {
+            size_t from_head = (f->key_map[key] + MAX_CAPACITY - f->q_head) %
+                               MAX_CAPACITY;
+            sizer_record_hit(f->sizer, f->q_count - 1 - from_head);
+        }
+
+        FIFOnode c_node = f->cache[f->key_map[key]];
+        if (c_node->prefetched) {
+            c_node->prefetched = false;
+            f->prefetch_hits++;
+        }
 
-    if (_is_present(key)) {
-        cache_hits++;
-        return _get(key);
+        TRACE(TRACE_GET, key, f->key_map[key]);
+        CacheValue result = cache_value_retain(c_node->value);
+        INSTRUMENT_STOP(STAGE_LOOKUP, lookup_timer);
+        pthread_mutex_unlock(&f->lock);
+        return result;
     } else
-        cache_misses++;
+        f->misses++;
 
-    ValueType result = (*_downstream)(lengths, key);
-    _insert(key, result);
+    INSTRUMENT_STOP(STAGE_LOOKUP, lookup_timer);
+    CacheValue result = _provide_missed(f, lengths, key);
 
+    pthread_mutex_unlock(&f->lock);
     return result;
 }
 
+
+// Copies value into the calling thread's own buffer, and releases it
+ValueType _return_copy(CacheValue value) {
+    if (value == NULL)
+        return VALUE_NOT_PRESENT;
+
+    size_t size = value->length + 1;
+    if (size > returned_size) {
+        returned_value = realloc(returned_value, size);
+        returned_size  = size;
+        pthread_setspecific(returned_key, returned_value);
+    }
+    memcpy(returned_value, value->text, size);
+
+    cache_value_release(value);
+    return returned_value;
+}
+
+
+// used externally but not referenced externally --
+// only by the set_provider function
+ValueType _caching_provider(Vec lengths, KeyType key) {
+    return _return_copy(_get(fifo, lengths, key));
+}
+
 ProviderFunction set_provider(ProviderFunction downstream) {
     DEBUG_PRINT(__FILE__ " set_provider()\n");
-    _downstream = downstream;
+    fifo->downstream = downstream;
     return _caching_provider;
 }
+
+
+// The queue's own handle, with no copy
+CacheValue get_value(Vec lengths, KeyType key) {
+    return _get(fifo, lengths, key);
+}
+
+
+void* alloc_value(size_t size) {
+    return slab_alloc(value_slab, size);
+}
+
+
+/* Version 2 interface */
+
+void* _v2_create(void) {
+    DEBUG_PRINT(__FILE__ " create()\n");
+    return _fifo_new();
+}
+
+void _v2_destroy(void* context) {
+    DEBUG_PRINT(__FILE__ " destroy(): ");
+    _fifo_free(context);
+    DEBUG_PRINT("freed\n");
+}
+
+void _v2_set_provider(void* context, ProviderFunction downstream) {
+    ((Fifo)context)->downstream = downstream;
+}
+
+CacheValue _v2_get(void* context, Vec lengths, KeyType key) {
+    return _get(context, lengths, key);
+}
+
+CacheStat* _v2_statistics(void* context) {
+    return _statistics(context);
+}
+
+void _v2_reset_statistics(void* context) {
+    _reset_statistics(context);
+}
+
+void _v2_set_capacity(void* context, size_t min, size_t max,
+                      size_t byte_budget) {
+    _set_capacity(context, min, max, byte_budget);
+}
+
+const CacheModuleV2 cache_module_v2 = {
+    .version          = CACHE_INTERFACE_VERSION,
+    .create           = _v2_create,
+    .destroy          = _v2_destroy,
+    .set_provider     = _v2_set_provider,
+    .get              = _v2_get,
+    .statistics       = _v2_statistics,
+    .reset_statistics = _v2_reset_statistics,
+    .set_capacity     = _v2_set_capacity,
+};
@@ -0,0 +1,35 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+** Fibonacci hashing, shared by the hash tables of the cache modules and the
+** vec index.
+**
+** The key is multiplied by 2^64 divided by the golden ratio. Every bit of
+** the key reaches the top bits of the product, while the low and middle
+** bits only see some of them, so dense keys such as rod lengths collide
+** there. The slot is taken from the top: the whole product is scaled down
+** to the number of slots, which for a power of two is its top bits.
+*/
+
+#define FIBONACCI_MULTIPLIER 11400714819323198485ULL
+
+// Returns the slot of key among slots, any number of them
+static inline size_t fibonacci_hash(uint64_t key, size_t slots) {
+    uint64_t product = key * FIBONACCI_MULTIPLIER;
+    return (size_t)(((unsigned __int128)product * slots) >> 64);
+}
+
+// The splitmix64 finalizer, which spreads every bit of value over all of
+// the result. Fingerprints of the prices add it up over every pair, the
+// same in main and in the shared memory module
+static inline uint64_t splitmix_mix(uint64_t value) {
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+#endif
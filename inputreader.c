@@ -1,15 +1,21 @@
 #include "inputreader.h"
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "hash.h"
 #include "keypair.h"
 
 const size_t MAX_LINE_LENGTH       = 128;
 const size_t COMMAND_LINE_ARG_SIZE = 256;
-const size_t BUFFER_SIZE           = 64;
+const size_t READ_BLOCK_SIZE       = 1 << 16;  // unmappable files
 
 const int MIN_ARGS                 = 2;
 const int MAX_ARGS                 = 3;
@@ -38,6 +44,184 @@ bool isArgCountValid(int argc) {
     return argc >= MIN_ARGS && argc <= MAX_ARGS;
 }
 
+// Helper function for parseArgs()
+// Reads "N" as a fixed capacity or "MIN:MAX" as adaptive bounds
+bool parseCapacity(const char* value, Options* opts) {
+    if (value == NULL)
+        return false;
+
+    char min_str[COMMAND_LINE_ARG_SIZE];
+    const char* colon = strchr(value, ':');
+    size_t min_len    = colon ? (size_t)(colon - value) : strlen(value);
+
+    if (min_len >= COMMAND_LINE_ARG_SIZE)
+        return false;
+
+    memcpy(min_str, value, min_len);
+    min_str[min_len] = '\0';
+
+    if (!parseSize(min_str, &opts->min_capacity))
+        return false;
+
+    opts->max_capacity = opts->min_capacity;
+    if (colon && !parseSize(colon + 1, &opts->max_capacity))
+        return false;
+
+    return opts->min_capacity > 0 && opts->min_capacity <= opts->max_capacity;
+}
+
+// Helper function for parseArgs()
+// Reads "cache.so" or "cache.so:N" as the next tier below the cache
+bool parseTier(const char* value, Options* opts) {
+    if (value == NULL || *value == '\0' || opts->tier_count == MAX_TIER_ARGS)
+        return false;
+
+    size_t index      = opts->tier_count;
+    const char* colon = strrchr(value, ':');
+    size_t path_len   = strlen(value);
+
+    opts->tier_capacities[index] = 0;
+    if (colon && parseSize(colon + 1, &opts->tier_capacities[index])) {
+        if (opts->tier_capacities[index] == 0)
+            return false;
+        path_len = colon - value;
+    }
+
+    if (path_len == 0 || path_len >= MAX_MODULE_PATH)
+        return false;
+
+    memcpy(opts->tier_modules[index], value, path_len);
+    opts->tier_modules[index][path_len] = '\0';
+    opts->tier_count++;
+    return true;
+}
+
+int parseArgs(int argc, char* argv[], Options* opts, const char** bad_arg) {
+    const char* positional[MAX_ARGS];
+    int positional_count = 1;  // argv[0]
+
+    *opts                = (Options){0};
+
+    for (int ix = 1; ix < argc; ix++) {
+        const char* value = NULL;
+
+        if (matchFlag(argv[ix], "shadow", &value)) {
+            if (value == NULL || opts->shadow_count == MAX_SHADOW_ARGS) {
+                *bad_arg = argv[ix];
+                return FLAG_INVALID;
+            }
+            opts->shadow_modules[opts->shadow_count++] = value;
+            opts->print_stats                          = true;
+
+        } else if (matchFlag(argv[ix], "tier", &value)) {
+            if (!parseTier(value, opts)) {
+                *bad_arg = argv[ix];
+                return FLAG_INVALID;
+            }
+
+        } else if (matchFlag(argv[ix], "publish", &value)) {
+            opts->publish_count = DEFAULT_PUBLISH_COUNT;
+            if (value != NULL && (!parseSize(value, &opts->publish_count) ||
+                                  opts->publish_count == 0)) {
+                *bad_arg = argv[ix];
+                return FLAG_INVALID;
+            }
+
+        } else if (matchFlag(argv[ix], "stats", &value) && value == NULL) {
+            opts->print_stats = true;
+
+        } else if (matchFlag(argv[ix], "quiet", &value) && value == NULL) {
+            opts->quiet = true;
+
+        } else if (matchFlag(argv[ix], "stream", &value)) {
+            if (value != NULL && *value == '\0') {
+                *bad_arg = argv[ix];
+                return FLAG_INVALID;
+            }
+            opts->stream      = true;
+            opts->stream_file = value;
+            opts->quiet       = true;  // stdout carries only the results
+
+        } else if (matchFlag(argv[ix], "batch", &value)) {
+            if (value != NULL && (!parseSize(value, &opts->batch_workers) ||
+                                  opts->batch_workers == 0 ||
+                                  opts->batch_workers > MAX_BATCH_WORKERS)) {
+                *bad_arg = argv[ix];
+                return FLAG_INVALID;
+            }
+            opts->batch  = true;
+            opts->stream = true;  // and reads --stream's input, if it has one
+            opts->quiet  = true;
+
+        } else if (matchFlag(argv[ix], "server", &value)) {
+            if (value == NULL || *value == '\0') {
+                *bad_arg = argv[ix];
+                return FLAG_INVALID;
+            }
+            opts->server_address = value;
+
+        } else if (matchFlag(argv[ix], "capacity", &value)) {
+            if (!parseCapacity(value, opts)) {
+                *bad_arg = argv[ix];
+                return FLAG_INVALID;
+            }
+
+        } else if (matchFlag(argv[ix], "snapshot", &value)) {
+            if (value == NULL || *value == '\0') {
+                *bad_arg = argv[ix];
+                return FLAG_INVALID;
+            }
+            opts->snapshot_file = value;
+
+        } else if (matchFlag(argv[ix], "table", &value)) {
+            if (value == NULL || *value == '\0') {
+                *bad_arg = argv[ix];
+                return FLAG_INVALID;
+            }
+            opts->table_file = value;
+
+        } else if (matchFlag(argv[ix], "byte-budget", &value)) {
+            if (!parseSize(value, &opts->byte_budget) ||
+                opts->byte_budget == 0) {
+                *bad_arg = argv[ix];
+                return FLAG_INVALID;
+            }
+
+        } else if (strncmp(argv[ix], "--", 2) == 0) {
+            *bad_arg = argv[ix];
+            return FLAG_INVALID;
+
+        } else if (positional_count == MAX_ARGS) {
+            return ARG_COUNT_INVALID;
+
+        } else {
+            positional[positional_count++] = argv[ix];
+        }
+    }
+
+    if (!isArgCountValid(positional_count))
+        return ARG_COUNT_INVALID;
+
+    opts->filename = positional[FILE_ARG];
+    if (positional_count > CACHE_ARG)
+        opts->cache_module = positional[CACHE_ARG];
+
+    // tiers go below a cache, and answers are published into one
+    if (opts->cache_module == NULL &&
+        (opts->tier_count > 0 || opts->publish_count > 0)) {
+        *bad_arg = opts->tier_count > 0 ? "--tier" : "--publish";
+        return FLAG_INVALID;
+    }
+
+    // a server answers its connections, not --stream input
+    if (opts->server_address != NULL && opts->stream) {
+        *bad_arg = "--server";
+        return FLAG_INVALID;
+    }
+
+    return ARGS_OK;
+}
+
 bool isLengthInRange(long length) {
     return length > 0 && length <= (long)MAX_ROD_LENGTH;
 }
@@ -46,7 +230,7 @@ bool isFileValid(const char* filename) {
     return access(filename, F_OK) == 0;
 }
 
-// Helper function for writeLineToVec()
+// Helper function for addPriceLine()
 // Returns true if line is only whitespace or is a comment (begins with '#')
 bool isBlankLine(const char* line, size_t length) {
     for (size_t ix = 0; ix < length; ix++) {
@@ -58,55 +242,194 @@ bool isBlankLine(const char* line, size_t length) {
     return true;
 }
 
-// Helper function for extractFile()
-// Writes the length and price into the vector
+// Helper function for parsePriceLine()
+// Reads an optionally signed decimal after any whitespace, as sscanf()'s %ld
+// would, and moves *pos past it. Saturates instead of overflowing
+// Returns false if there are no digits
+bool readLong(const char** pos, const char* end, long* write_to) {
+    const char* at = *pos;
+    bool negative  = false;
+    long num       = 0;
+
+    while (at < end && isspace((unsigned char)*at))
+        at++;
+    if (at < end && (*at == '+' || *at == '-'))
+        negative = *at++ == '-';
+    if (at == end || !isdigit((unsigned char)*at))
+        return false;
+
+    for (; at < end && isdigit((unsigned char)*at); at++) {
+        int digit = *at - '0';
+        num = num > (LONG_MAX - digit) / 10 ? LONG_MAX : num * 10 + digit;
+    }
+
+    *write_to = negative ? -num : num;
+    *pos      = at;
+    return true;
+}
+
+// Helper function for addPriceLine()
+// Reads "<length>, <price>" from the line as sscanf("%ld , %d") would:
+// whitespace allowed around each part, anything after the price ignored
+// Returns FILE_LINE_OK or FILE_INVALID_LINE
+int parsePriceLine(const char* line, const char* end, long* length,
+                   int* price) {
+    long read_price = 0;
+
+    if (!readLong(&line, end, length))
+        return FILE_INVALID_LINE;
+
+    while (line < end && isspace((unsigned char)*line))
+        line++;
+    if (line == end || *line++ != ',')
+        return FILE_INVALID_LINE;
+
+    if (!readLong(&line, end, &read_price))
+        return FILE_INVALID_LINE;
+
+    *price = (int)read_price;
+    return FILE_LINE_OK;
+}
+
+// Helper function for loadPriceFile()
+// Writes the length and price of the line [line, end) into the vector
+// seen has a bit for every length already added
 // Returns error code if failed
-int writeLineToVec(const char* line, Vec add_to) {
-    if (isBlankLine(line, MAX_LINE_LENGTH))
+int addPriceLine(const char* line, const char* end, Vec add_to,
+                 uint64_t* seen, bool log_lines) {
+    if (isBlankLine(line, end - line))
         return FILE_LINE_OK;
 
     long read_length = 0;
     int read_value   = 0;
-    char line_copy[MAX_LINE_LENGTH];
-    copyWithoutNewline(line, line_copy, MAX_LINE_LENGTH);
-
-    // Write input to length and value and check if successful for both
-    if (sscanf(line_copy, "%ld , %d", &read_length, &read_value) == 2) {
-        if (!isLengthInRange(read_length))
-            return FILE_LENGTH_OUT_OF_RANGE;
-
-        // Check for duplicate lengths
-        for (size_t ix = 0; ix < vec_length(add_to); ix++) {
-            KeyPair* pair_p = vec_get(add_to, ix);
-            if (pair_p->key == (size_t)read_length)
-                return FILE_LENGTH_DUPE;
-        }
-        KeyPair new_pair = createKeyPair(read_length, read_value);
-        vec_add(add_to, &new_pair);
+
+    if (parsePriceLine(line, end, &read_length, &read_value) != FILE_LINE_OK)
+        return FILE_INVALID_LINE;
+
+    if (!isLengthInRange(read_length))
+        return FILE_LENGTH_OUT_OF_RANGE;
+
+    uint64_t bit = 1ULL << (read_length % 64);
+    if (seen[read_length / 64] & bit)
+        return FILE_LENGTH_DUPE;
+    seen[read_length / 64] |= bit;
+
+    KeyPair new_pair = createKeyPair(read_length, read_value);
+    vec_add(add_to, &new_pair);
+
+    if (log_lines)
         printf("Added length %2ld, value %2d\n", read_length, read_value);
-        return FILE_LINE_OK;
+    return FILE_LINE_OK;
+}
+
+// Helper function for loadPriceFile()
+// Maps the whole file, or reads it in blocks if it cannot be mapped (a pipe)
+// *mapped says whether to munmap() or free() the text afterwards
+// Returns NULL if the file cannot be read
+char* readWholeFile(int fd, size_t* size, bool* mapped) {
+    struct stat info;
+
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        char* text = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (text != MAP_FAILED) {
+            madvise(text, info.st_size, MADV_SEQUENTIAL);
+            *size   = info.st_size;
+            *mapped = true;
+            return text;
+        }
+    }
+
+    size_t capacity = READ_BLOCK_SIZE;
+    char* text      = malloc(capacity);
+    ssize_t got;
+
+    *size   = 0;
+    *mapped = false;
+
+    while ((got = read(fd, text + *size, capacity - *size)) > 0) {
+        *size += got;
+        if (*size == capacity)
+            text = realloc(text, capacity *= 2);
     }
-    return FILE_INVALID_LINE;
+
+    if (got < 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
 }
 
-Vec extractFile(const char* filename) {
+Vec loadPriceFile(const char* filename, bool log_lines) {
     if (!isFileValid(filename))
         return NULL;
 
-    FILE* file  = fopen(filename, "r");
-    Vec lengths = new_vec(sizeof(KeyPair));
-    char line[MAX_LINE_LENGTH];
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    size_t size = 0;
+    bool mapped = false;
+    char* text  = readWholeFile(fd, &size, &mapped);
+    close(fd);
+
+    if (text == NULL)
+        return NULL;
+
+    Vec lengths     = new_vec(sizeof(KeyPair));
+    uint64_t* seen  = calloc(MAX_ROD_LENGTH / 64 + 1, sizeof(uint64_t));
+    const char* end = text + size;
+
+    for (const char* line = text; line < end;) {
+        const char* eol = memchr(line, '\n', end - line);
+        if (eol == NULL)
+            eol = end;
+
+        int read_state = addPriceLine(line, eol, lengths, seen, log_lines);
+
+        // the text has no terminator of its own, so warn about a copy
+        if (read_state != FILE_LINE_OK) {
+            char line_copy[MAX_LINE_LENGTH];
+            size_t length = eol - line < (long)MAX_LINE_LENGTH - 1
+                                ? (size_t)(eol - line)
+                                : MAX_LINE_LENGTH - 1;
 
-    while (fgets(line, MAX_LINE_LENGTH, file)) {
-        int read_state = writeLineToVec(line, lengths);
-        if (read_state != FILE_LINE_OK)
-            printErr(read_state, line, MAX_LINE_LENGTH);
+            memcpy(line_copy, line, length);
+            line_copy[length] = '\0';
+            printErr(read_state, line_copy, MAX_LINE_LENGTH);
+        }
+
+        line = eol + 1;
     }
 
-    fclose(file);
+    free(seen);
+    vec_index_keys(lengths);  // prices are looked up by length from here on
+
+    if (mapped)
+        munmap(text, size);
+    else
+        free(text);
+
     return lengths;
 }
 
+Vec extractFile(const char* filename) {
+    return loadPriceFile(filename, true);
+}
+
+uint64_t fingerprintPrices(const Vec length_prices) {
+    uint64_t fingerprint = vec_length(length_prices);
+
+    for (size_t ix = 0; ix < vec_length(length_prices); ix++) {
+        KeyPair* pair = vec_get(length_prices, ix);
+
+        // mix each pair on its own and add, so line order doesn't matter
+        fingerprint +=
+            splitmix_mix((uint64_t)pair->key << 32 ^ (uint32_t)pair->value);
+    }
+    return fingerprint;
+}
+
 int writeInputToInt(const char* input, long* write_to) {
     if (sscanf(input, "%ld", write_to) != 1)
         return INPUT_NOT_INT;
@@ -117,6 +440,40 @@ int writeInputToInt(const char* input, long* write_to) {
     return INPUT_OK;
 }
 
+bool matchFlag(const char* arg, const char* name, const char** value) {
+    size_t name_len = strlen(name);
+
+    if (strncmp(arg, "--", 2) != 0 || strncmp(arg + 2, name, name_len) != 0)
+        return false;
+
+    const char* rest = arg + 2 + name_len;
+
+    if (*rest == '\0') {
+        *value = NULL;
+        return true;
+    }
+    if (*rest == '=') {
+        *value = rest + 1;
+        return true;
+    }
+    return false;
+}
+
+bool parseSize(const char* str, size_t* write_to) {
+    if (str == NULL || !isdigit((unsigned char)*str))
+        return false;
+
+    // a leading digit already ruled out a sign, which strtoull() would take
+    char* end;
+    errno                  = 0;
+    unsigned long long num = strtoull(str, &end, 10);
+    if (*end != '\0' || errno == ERANGE || num > SIZE_MAX)
+        return false;
+
+    *write_to = (size_t)num;
+    return true;
+}
+
 void copyWithoutNewline(const char* from, char* write_to, size_t length) {
     for (size_t ix = 0; ix < length; ix++) {
         if (from[ix] == '\n' || from[ix] == '\0' || ix == length - 1) {
@@ -128,7 +485,7 @@ void copyWithoutNewline(const char* from, char* write_to, size_t length) {
     }
 }
 
-void printErr(int err, const char* input, size_t max_length) {
+void fprintErr(FILE* to, int err, const char* input, size_t max_length) {
     char input_copy[max_length];
     copyWithoutNewline(input, input_copy, max_length);
 
@@ -137,69 +494,127 @@ void printErr(int err, const char* input, size_t max_length) {
             break;
 
         case ARG_COUNT_INVALID:
-            fprintf(stderr, "Usage: %s lengths_file.txt [cache.so]\n",
+            fprintf(to,
+                    "Usage: %s lengths_file.txt [cache.so] [--stats] [--quiet] "
+                    "[--stream[=lengths.txt]] [--batch[=N]] [--server=PORT|PATH] "
+                    "[--capacity=N|MIN:MAX] [--byte-budget=BYTES] "
+                    "[--tier=cache.so[:N] ...] [--publish[=N]] "
+                    "[--shadow=cache.so ...] "
+                    "[--snapshot=cache.snap] "
+                    "[--table=answers.bin]\n",
                     input_copy);
             break;
 
         case FILE_INVALID:
-            fprintf(stderr,
+            fprintf(to,
                     "Error: File path '%s' is invalid or does not exist\n",
                     input_copy);
             break;
 
         case CACHE_INVALID:
-            fprintf(stderr, "Error: Failed to load cache module '%s'\n",
+            fprintf(to, "Error: Failed to load cache module '%s'\n",
                     input_copy);
             break;
 
         case FLAG_INVALID:
-            fprintf(stderr, "Error: Unknown flag '%s'\n", input_copy);
+            fprintf(to, "Error: Unknown flag '%s'\n", input_copy);
             break;
 
         case FILE_NO_VALID_LINES:
-            fprintf(stderr, "Error: No valid lengths found in '%s'\n",
+            fprintf(to, "Error: No valid lengths found in '%s'\n",
                     input_copy);
             break;
 
         case FILE_LENGTH_OUT_OF_RANGE:
             fprintf(
-                stderr,
+                to,
                 "Warning: length in '%s' is out of range. Ignoring line...\n",
                 input_copy);
             break;
 
         case FILE_LENGTH_DUPE:
             fprintf(
-                stderr,
+                to,
                 "Warning: length in '%s' is a duplicate. Ignoring line...\n",
                 input_copy);
             break;
 
         case FILE_INVALID_LINE:
-            fprintf(stderr,
+            fprintf(to,
                     "Warning: line '%s' should be formatted as <int>, <int>. "
                     "Ignoring line...\n",
                     input_copy);
             break;
 
         case INPUT_NOT_INT:
-            fprintf(stderr,
+            fprintf(to,
                     "Error: '%s' could not be converted to an integer\n",
                     input_copy);
             break;
 
         case INPUT_OUT_OF_RANGE:
-            fprintf(stderr,
+            fprintf(to,
                     "Error: '%s' should be an integer between 1 and %d\n",
                     input_copy, MAX_ROD_LENGTH);
             break;
 
+        case SNAPSHOT_NOT_RESTORED:
+            fprintf(to,
+                    "Warning: cache snapshot '%s' is missing, invalid or for "
+                    "another price table. Starting with an empty cache...\n",
+                    input_copy);
+            break;
+
+        case SNAPSHOT_NOT_SAVED:
+            fprintf(to,
+                    "Warning: could not save cache snapshot '%s'\n",
+                    input_copy);
+            break;
+
+        case TABLE_INVALID:
+            fprintf(to,
+                    "Error: answer table '%s' is invalid or was built from "
+                    "another price table\n",
+                    input_copy);
+            break;
+
+        case COMMAND_NOT_SERVED:
+            fprintf(to,
+                    "Error: Command '%s' is not accepted over a connection\n",
+                    input_copy);
+            break;
+
+        case COMMAND_INVALID:
+            fprintf(to,
+                    "Error: Unknown command '%s'. Try '!swap ./cache.so' or "
+                    "'!reload'\n",
+                    input_copy);
+            break;
+
+        case SERVER_INVALID:
+            fprintf(to,
+                    "Error: Could not listen on '%s'. Give a port, or a path "
+                    "for a UNIX socket\n",
+                    input_copy);
+            break;
+
+        case PRICES_NOT_RELOADED:
+            fprintf(to,
+                    "Warning: could not reload prices from '%s'. Keeping the "
+                    "prices loaded before...\n",
+                    input_copy);
+            break;
+
         case READ_ERROR:
-            fprintf(stderr, "Error: Could not read rod length from user\n");
+            fprintf(to, "Error: Could not read rod length from user\n");
             break;
 
         default:
-            fprintf(stderr, "Error: Received error code %d with input %s\n",
+            fprintf(to, "Error: Received error code %d with input %s\n",
                     err, input_copy);
     }
 }
+
+void printErr(int err, const char* input, size_t max_length) {
+    fprintErr(stderr, err, input, max_length);
+}
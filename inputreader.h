@@ -2,12 +2,18 @@
 #define INPUTREADER_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include "vec.h"
 
 #define MAX_ROD_LENGTH 100000
 
+// bytes of an input line, terminator included. A define, so it can size
+// arrays in structs
+#define BUFFER_SIZE 64
+
 #define ARGS_OK 0
 #define ARG_COUNT_INVALID 1
 
@@ -29,9 +35,21 @@
 
 #define USER_EXIT 12
 
+#define SNAPSHOT_NOT_RESTORED 13
+#define SNAPSHOT_NOT_SAVED 14
+
+#define TABLE_INVALID 15
+
+#define COMMAND_INVALID 16
+#define COMMAND_NOT_SERVED 17
+
+#define SERVER_INVALID 18
+
+#define PRICES_NOT_RELOADED 19
+
 extern const size_t MAX_LINE_LENGTH;
 extern const size_t COMMAND_LINE_ARG_SIZE;
-extern const size_t BUFFER_SIZE;
+extern const size_t READ_BLOCK_SIZE;
 
 extern const int MIN_ARGS;
 extern const int MAX_ARGS;
@@ -39,6 +57,36 @@ extern const int MAX_ARGS;
 extern const int FILE_ARG;
 extern const int CACHE_ARG;
 
+#define MAX_SHADOW_ARGS 8
+#define MAX_TIER_ARGS 4      // MAX_TIERS in cache.h
+#define MAX_MODULE_PATH 256
+#define DEFAULT_PUBLISH_COUNT 16
+#define MAX_BATCH_WORKERS 256
+
+// Settings taken from the command line of main
+typedef struct options {
+    const char* filename;
+    const char* cache_module;  // NULL if no cache was given
+    const char* shadow_modules[MAX_SHADOW_ARGS];
+    size_t shadow_count;
+    char tier_modules[MAX_TIER_ARGS][MAX_MODULE_PATH];  // below cache_module
+    size_t tier_capacities[MAX_TIER_ARGS];  // 0 keeps the module's default
+    size_t tier_count;
+    bool print_stats;
+    bool quiet;           // no line printed for each price read
+    bool stream;          // lengths read without prompts, results only
+    const char* stream_file;  // what --stream reads, NULL for stdin
+    bool batch;            // stream lengths answered by a pool of threads
+    size_t batch_workers;  // 0 for one for every online core
+    const char* server_address;  // port or socket path, NULL if not serving
+    size_t min_capacity;  // 0 if the cache's own default should be kept
+    size_t max_capacity;
+    size_t byte_budget;   // 0 for no budget
+    size_t publish_count;  // sub-lengths offered per miss, 0 for none
+    const char* snapshot_file;  // NULL if the cache should start cold
+    const char* table_file;     // NULL if answers come from the solver
+} Options;
+
 
 // Returns a success code if successfully wrote input,
 // returns an error code if failed,
@@ -53,6 +101,12 @@ void clearBuffer();
 // Returns true if there are not too few or too many arguments
 bool isArgCountValid(int argc);
 
+// Fills opts from the command line: the lengths file, an optional cache
+// module, then any --flags in any position
+// Returns ARGS_OK, ARG_COUNT_INVALID, or FLAG_INVALID with the unknown flag
+// written to bad_arg
+int parseArgs(int argc, char* argv[], Options* opts, const char** bad_arg);
+
 // Returns true if 0 < length < INT_MAX
 bool isLengthInRange(long length);
 
@@ -60,13 +114,31 @@ bool isLengthInRange(long length);
 bool isFileValid(const char* filename);
 
 // Reads each line from a file and returns a vector of length value pairs
+// The file is mapped, or read in blocks, and parsed in place. Bad lines get
+// the same warnings as ever, and each added line is printed if log_lines
 // Returns NULL if file cannot be read
+Vec loadPriceFile(const char* filename, bool log_lines);
+
+// loadPriceFile() printing every added line
 Vec extractFile(const char* filename);
 
+// Returns a hash of the lengths and prices in a list, independent of the
+// order they were read in
+uint64_t fingerprintPrices(const Vec length_prices);
+
 // Write input string as a long int to write_to
 // Returns error code if failed or num is out of range
 int writeInputToInt(const char* input, long* write_to);
 
+// Returns true if arg is "--name" or "--name=value"
+// value is set to the text after '=', or NULL if there is none
+bool matchFlag(const char* arg, const char* name, const char** value);
+
+// Write a whole, non-negative decimal string as a size_t to write_to
+// Returns false if str is NULL, empty, signed, has trailing characters, or
+// is too large for a size_t
+bool parseSize(const char* str, size_t* write_to);
+
 // Writes a copy of a string without a newline into write_to
 void copyWithoutNewline(const char* from, char* write_to, size_t length);
 
@@ -74,4 +146,7 @@ void copyWithoutNewline(const char* from, char* write_to, size_t length);
 // and the max length of the input
 void printErr(int err, const char* input, size_t max_length);
 
+// printErr() to any stream
+void fprintErr(FILE* to, int err, const char* input, size_t max_length);
+
 #endif
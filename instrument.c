@@ -0,0 +1,107 @@
+#include "instrument.h"
+
+#ifdef INSTRUMENT
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// One thread's totals. Only that thread adds to them
+typedef struct instrumentcounters {
+    uint64_t ticks[STAGE_COUNT];
+    uint64_t calls[STAGE_COUNT];
+    struct instrumentcounters* next;
+} InstrumentCounters;
+
+// indented as the stages nest
+const char* STAGE_NAMES[STAGE_COUNT] = {
+    "request", "  lookup", "  insert", "    evict",
+    "  downstream", "    dp loop", "    cut list", "    format"};
+
+pthread_mutex_t counters_lock = PTHREAD_MUTEX_INITIALIZER;
+InstrumentCounters* all_counters = NULL;  // every thread's, kept past exit
+size_t thread_count              = 0;
+__thread InstrumentCounters* thread_counters = NULL;
+
+// when the first tick was counted, to convert ticks to nanoseconds
+uint64_t first_ticks = 0;
+struct timespec first_time;
+
+
+void _report(void);
+
+// Helper function for instrument_add()
+InstrumentCounters* _register_thread(void) {
+    InstrumentCounters* counters = calloc(1, sizeof(InstrumentCounters));
+
+    pthread_mutex_lock(&counters_lock);
+    if (all_counters == NULL) {
+        first_ticks = instrument_now();
+        clock_gettime(CLOCK_MONOTONIC, &first_time);
+        atexit(_report);
+    }
+    counters->next = all_counters;
+    all_counters   = counters;
+    thread_count++;
+    pthread_mutex_unlock(&counters_lock);
+
+    return counters;
+}
+
+void instrument_add(InstrumentStage stage, uint64_t ticks) {
+    if (thread_counters == NULL)
+        thread_counters = _register_thread();
+
+    thread_counters->ticks[stage] += ticks;
+    thread_counters->calls[stage]++;
+}
+
+// Prints every thread's totals at exit, and frees them
+void _report(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double elapsed_ns = (now.tv_sec - first_time.tv_sec) * 1e9 +
+                        (now.tv_nsec - first_time.tv_nsec);
+    double ns_per_tick =
+        elapsed_ns > 0 ? elapsed_ns / (instrument_now() - first_ticks) : 1;
+
+    uint64_t ticks[STAGE_COUNT] = {0};
+    uint64_t calls[STAGE_COUNT] = {0};
+
+    pthread_mutex_lock(&counters_lock);
+    while (all_counters != NULL) {
+        InstrumentCounters* counters = all_counters;
+        all_counters                 = counters->next;
+
+        for (size_t stage = 0; stage < STAGE_COUNT; stage++) {
+            ticks[stage] += counters->ticks[stage];
+            calls[stage] += counters->calls[stage];
+        }
+        free(counters);
+    }
+    pthread_mutex_unlock(&counters_lock);
+
+    thread_counters = NULL;
+    uint64_t requests = calls[STAGE_REQUEST];
+
+    fprintf(stderr, "\nTime by stage, %zu threads:\n", thread_count);
+    fprintf(stderr, "%-14s %12s %12s %10s %12s\n", "stage", "calls",
+            "total ms", "ns/call", "ns/request");
+
+    for (size_t stage = 0; stage < STAGE_COUNT; stage++) {
+        if (calls[stage] == 0)
+            continue;
+
+        double total_ns = ticks[stage] * ns_per_tick;
+        fprintf(stderr, "%-14s %12lu %12.1f %10.1f", STAGE_NAMES[stage],
+                (unsigned long)calls[stage], total_ns / 1e6,
+                total_ns / calls[stage]);
+
+        if (requests > 0)
+            fprintf(stderr, " %12.1f", total_ns / requests);
+        fprintf(stderr, "\n");
+    }
+}
+
+#endif
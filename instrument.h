@@ -0,0 +1,64 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+** Hot path timers, compiled in only with -DINSTRUMENT (make instrument).
+**
+** INSTRUMENT_START(timer) reads the clock into a new local, and
+** INSTRUMENT_STOP(stage, timer) adds the ticks since then to the stage in
+** the calling thread's own counters, so timing takes no lock. Stages nest:
+** a request includes the cache lookup, a miss's downstream includes the
+** solver's stages. The totals of every thread are printed to stderr at
+** exit. Without INSTRUMENT both macros compile to nothing.
+**
+** Cache modules are timed into the counters of the program that loads
+** them, which exports instrument_add() with -rdynamic, so modules and
+** programs are built together with make instrument.
+*/
+
+typedef enum instrumentstage {
+    STAGE_REQUEST,     // a provider call made by main
+    STAGE_LOOKUP,      // finding a key in a cache, and a hit's value
+    STAGE_INSERT,      // storing a miss's value, evictions included
+    STAGE_EVICT,
+    STAGE_DOWNSTREAM,  // what a cache calls on a miss
+    STAGE_DP,          // filling the solver's tables
+    STAGE_CUT_LIST,
+    STAGE_FORMAT,
+    STAGE_COUNT
+} InstrumentStage;
+
+#ifdef INSTRUMENT
+
+// Clock ticks: the TSC on x86, nanoseconds elsewhere
+static inline uint64_t instrument_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+void instrument_add(InstrumentStage stage, uint64_t ticks);
+
+#define INSTRUMENT_START(timer) uint64_t timer = instrument_now()
+#define INSTRUMENT_STOP(stage, timer) \
+    instrument_add(stage, instrument_now() - (timer))
+
+#else
+
+#define INSTRUMENT_START(timer)
+#define INSTRUMENT_STOP(stage, timer)
+
+#endif
+
+#endif
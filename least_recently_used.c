@@ -1,68 +1,142 @@
-#include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "adaptive.h"
 #include "cache.h"
+#include "instrument.h"
+#include "singleflight.h"
+#include "slab.h"
+#include "snapshot.h"
+#include "trace.h"
 
 /* Least recently used */
 
-typedef unsigned int TimeType;
-
 typedef struct node {
     KeyType key;
     ValueType value;
-    TimeType time_since_access;
+    struct node* newer;  // the neighbours in order of use, NULL at the ends
+    struct node* older;
+    bool prefetched;  // inserted ahead of any request, and not used since
 } * LRUnode;
 
 #define MAX_KEY 100000
-#define CACHE_SIZE 50
+#define CACHE_SIZE 50      // default capacity
+#define MAX_CAPACITY 4096  // most entries set_capacity() can allow
 #define MAP_SIZE MAX_KEY + 1
+#define MAX_VALUE_SIZE 256  // larger values are malloc()ed
 
 #define VALUE_NOT_PRESENT NULL
 #define KEY_NOT_PRESENT -1
-#define MAX_TIME UINT_MAX
 
-LRUnode cache[CACHE_SIZE];
+LRUnode cache[MAX_CAPACITY];
 int key_map[MAP_SIZE];  // list of cache indexes
                         // maps the real key to an index in the cache
 
-KeyType key_to_replace = 0;  // least recently used key
+LRUnode most_recent  = NULL;  // the ends of the list of nodes in order of use
+LRUnode least_recent = NULL;  // the next to be replaced
 
 size_t saved_values    = 0;
+size_t saved_bytes     = 0;  // nodes plus their value strings
+
+Sizer sizer            = NULL;  // current capacity, and ghosts when adaptive
+
+Slab node_slab         = NULL;  // every node
+Slab value_slab        = NULL;  // values from alloc_value()
+size_t allocations_at_reset = 0;
 
 int cache_requests;
 int cache_hits;
 int cache_misses;
+int cache_evictions;
+int cache_ghost_hits;
+int cache_prefetched;
+int cache_prefetch_hits;
+int cache_coalesced;
+
+// every function called from outside holds this while it works
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+Flights flights            = NULL;  // misses being computed right now
+
+// each thread's copy of the value it was last given, which no other
+// thread's eviction can free
+__thread char* returned_value = NULL;
+__thread size_t returned_size = 0;
+pthread_key_t returned_key;  // frees the copy when its thread exits
 
 ProviderFunction _downstream = NULL;
+Eviction_fptr eviction_handler = NULL;  // takes evicted values, if set
+
+
+size_t node_bytes(LRUnode node) {
+    return sizeof(struct node) + (node->value ? strlen(node->value) + 1 : 0);
+}
 
 
 LRUnode node_new(KeyType key, ValueType val) {
-    LRUnode node            = malloc(sizeof(struct node));
+    LRUnode node            = slab_alloc(node_slab, sizeof(struct node));
     node->key               = key;
     node->value             = val;
-    node->time_since_access = 0;
+    node->newer             = NULL;
+    node->older             = NULL;
+    node->prefetched        = false;
     return node;
 }
 
 
 void node_free(LRUnode node) {
     key_map[node->key] = KEY_NOT_PRESENT;
-    if (node->value)
-        free(node->value);
-    free(node);
+    slab_release(value_slab, node->value);
+    slab_release(node_slab, node);
 }
 
 
-void initialize(void) {
-    DEBUG_PRINT(__FILE__ " initialize()\n");
+// Heap allocations made for entries since the statistics were reset
+size_t _allocations(void) {
+    return slab_allocations(node_slab) + slab_allocations(value_slab) -
+           allocations_at_reset;
+}
 
-    cache_requests = 0;
-    cache_hits     = 0;
-    cache_misses   = 0;
 
-    for (size_t ix = 0; ix < CACHE_SIZE; ix++)
+// A value that can leave the cache: pooled ones are copied out, and the
+// copy returned instead
+ValueType _give_up(ValueType value) {
+    if (value == NULL || !slab_owns(value_slab, value))
+        return value;
+
+    ValueType copy = strdup(value);
+    slab_release(value_slab, value);
+    return copy;
+}
+
+
+void initialize(void) {
+    DEBUG_PRINT(__FILE__ " initialize()\n");
+    pthread_key_create(&returned_key, free);
+
+    cache_requests      = 0;
+    cache_hits          = 0;
+    cache_misses        = 0;
+    cache_evictions     = 0;
+    cache_ghost_hits    = 0;
+    cache_prefetched    = 0;
+    cache_prefetch_hits = 0;
+    cache_coalesced     = 0;
+
+    saved_values     = 0;
+    saved_bytes      = 0;
+    most_recent      = NULL;
+    least_recent     = NULL;
+    sizer            = new_sizer(CACHE_SIZE, MAX_KEY);
+    flights          = new_flights(&cache_lock);
+    node_slab        = new_slab(sizeof(struct node), CACHE_SIZE);
+    value_slab       = new_slab(MAX_VALUE_SIZE, CACHE_SIZE);
+
+    allocations_at_reset = 0;
+
+    for (size_t ix = 0; ix < MAX_CAPACITY; ix++)
         cache[ix] = NULL;
 
     for (KeyType iy = 0; iy < MAP_SIZE; iy++)
@@ -73,12 +147,41 @@ void initialize(void) {
 void cleanup(void) {
     DEBUG_PRINT(__FILE__ " cleanup(): ");
 
-    for (size_t ix = 0; ix < CACHE_SIZE; ix++) {
+    pthread_mutex_lock(&cache_lock);
+
+    for (size_t ix = 0; ix < MAX_CAPACITY; ix++) {
         if (cache[ix] != NULL) {
             DEBUG_PRINT(KEY_FMT " ", cache[ix]->key);
             node_free(cache[ix]);
+            cache[ix] = NULL;
         }
     }
+    saved_values = 0;
+    saved_bytes  = 0;
+    most_recent  = NULL;
+    least_recent = NULL;
+
+    if (sizer != NULL) {
+        sizer_free(sizer);
+        sizer = NULL;
+    }
+    if (flights != NULL) {
+        flights_free(flights);
+        flights = NULL;
+    }
+    if (node_slab != NULL) {
+        slab_free(node_slab);
+        slab_free(value_slab);
+        node_slab  = NULL;
+        value_slab = NULL;
+    }
+
+    free(returned_value);
+    returned_value = NULL;
+    returned_size  = 0;
+    pthread_key_delete(returned_key);
+
+    pthread_mutex_unlock(&cache_lock);
 
     DEBUG_PRINT("freed\n");
 }
@@ -86,109 +189,207 @@ void cleanup(void) {
 
 void reset_statistics(void) {
     DEBUG_PRINT(__FILE__ " reset_statistics()\n");
-    cache_requests = 0;
-    cache_hits     = 0;
-    cache_misses   = 0;
+    pthread_mutex_lock(&cache_lock);
+    cache_requests      = 0;
+    cache_hits          = 0;
+    cache_misses        = 0;
+    cache_evictions     = 0;
+    cache_ghost_hits    = 0;
+    cache_prefetched    = 0;
+    cache_prefetch_hits = 0;
+    cache_coalesced     = 0;
+
+    allocations_at_reset += _allocations();
+    pthread_mutex_unlock(&cache_lock);
 }
 
 
 CacheStat* statistics(void) {
     DEBUG_PRINT(__FILE__ " statistics()\n");
 
-    CacheStat* stats_cache = malloc(4 * sizeof(CacheStat));
+    CacheStat* stats_cache = malloc(12 * sizeof(CacheStat));
+
+    pthread_mutex_lock(&cache_lock);
     stats_cache[0]         = (CacheStat){Cache_requests, cache_requests};
     stats_cache[1]         = (CacheStat){Cache_hits, cache_hits};
     stats_cache[2]         = (CacheStat){Cache_misses, cache_misses};
-    stats_cache[3]         = (CacheStat){Cache_size, CACHE_SIZE};
-    stats_cache[4]         = (CacheStat){END_OF_STATS, 0};
+    stats_cache[3]         = (CacheStat){Cache_evictions, cache_evictions};
+    stats_cache[4]         = (CacheStat){Cache_size, saved_values};
+    stats_cache[5]         = (CacheStat){Cache_capacity, sizer->capacity};
+    stats_cache[6]         = (CacheStat){Cache_ghost_hits, cache_ghost_hits};
+    stats_cache[7]         = (CacheStat){Cache_prefetched, cache_prefetched};
+    stats_cache[8] = (CacheStat){Cache_prefetch_hits, cache_prefetch_hits};
+    stats_cache[9] = (CacheStat){Cache_coalesced, cache_coalesced};
+    stats_cache[10] = (CacheStat){Cache_allocations, _allocations()};
+    stats_cache[11] = (CacheStat){END_OF_STATS, 0};
+    pthread_mutex_unlock(&cache_lock);
 
     return stats_cache;
 }
 
 
-// Increment the times for each node in the cache
-// Takes the most recently accessed key and resets its time to 0
-// Also updates the least recently used key
-void _update_times(KeyType last_used) {
-    DEBUG_PRINT(__FILE__ " update_times():\n");
+// Takes node out of the order of use
+void _unlink(LRUnode node) {
+    if (node->newer != NULL)
+        node->newer->older = node->older;
+    else
+        most_recent = node->older;
+
+    if (node->older != NULL)
+        node->older->newer = node->newer;
+    else
+        least_recent = node->newer;
+
+    node->newer = NULL;
+    node->older = NULL;
+}
+
+
+// Puts node first in the order of use
+void _push_most_recent(LRUnode node) {
+    node->older = most_recent;
+    if (most_recent != NULL)
+        most_recent->newer = node;
+    else
+        least_recent = node;
+    most_recent = node;
+}
+
 
-    KeyType new_replace = 0;
-    TimeType oldest     = 0;
+// Puts node last in the order of use, so it is the next to go
+void _push_least_recent(LRUnode node) {
+    node->newer = least_recent;
+    if (least_recent != NULL)
+        least_recent->older = node;
+    else
+        most_recent = node;
+    least_recent = node;
+}
 
-    for (size_t ix = 0; ix < CACHE_SIZE; ix++) {
-        LRUnode node = cache[ix];
 
-        if (node == NULL)
-            continue;
+// Free the node at idx and move the last used entry into its place,
+// so the used entries stay at the front of the cache
+// If give_up_value, the value has been handed on and is not freed
+void _remove(size_t idx, bool give_up_value) {
+    LRUnode node = cache[idx];
 
-        TimeType* time    = &(node->time_since_access);
-        #ifdef DEBUG
-        TimeType old_time = *time;
-        #endif
+    saved_bytes -= node_bytes(node);
+    if (give_up_value)
+        node->value = NULL;
+    _unlink(node);
+    node_free(node);
 
-        if (node->key == last_used) {
-            *time = 0;  // reset time in node
-            DEBUG_PRINT(">");
+    saved_values--;
+    cache[idx] = NULL;
 
-        } else {
-            if (*time < MAX_TIME)  // increment time in node
-                (*time)++;
-
-            if (*time > oldest) {
-                new_replace = node->key;
-                oldest      = *time;
-            }
-            DEBUG_PRINT(" ");
-        }
-        DEBUG_PRINT(KEY_FMT ": %u -> %u\n", node->key, old_time, *time);
+    if (idx != saved_values) {
+        cache[idx]               = cache[saved_values];
+        cache[saved_values]      = NULL;
+        key_map[cache[idx]->key] = idx;
     }
-    DEBUG_PRINT("\n");
+}
+
 
-    key_to_replace = new_replace;
+void _evict(size_t idx) {
+    INSTRUMENT_START(evict_timer);
+    LRUnode node = cache[idx];
+
+    TRACE(TRACE_EVICT, node->key, idx);
+
+    sizer_record_eviction(sizer, node->key);
+    cache_evictions++;
+
+    KeyType key     = node->key;
+    ValueType value = node->value;
+
+    // the handler may free the value, so it goes after the node
+    _remove(idx, eviction_handler != NULL);
+
+    if (eviction_handler != NULL)
+        eviction_handler(key, _give_up(value));
+    INSTRUMENT_STOP(STAGE_EVICT, evict_timer);
 }
 
 
-bool _is_present(KeyType key) {
-    bool present = key <= MAX_KEY && key_map[key] != KEY_NOT_PRESENT;
+// Evict least recently used entries until the cache fits its capacity and
+// byte budget
+void _shrink_to_fit(void) {
+    size_t capacity = sizer_update(sizer, saved_bytes, saved_values);
 
-    DEBUG_PRINT(__FILE__ " is_present(" KEY_FMT ") = %s\n", key,
-                present ? "true" : "false");
+    while (saved_values > 0 &&
+           (saved_values > capacity || (sizer_over_budget(sizer, saved_bytes) &&
+                                        saved_values > sizer->min_capacity))) {
+        _evict(key_map[least_recent->key]);
+    }
+}
 
-    return present;
+
+void set_capacity(size_t min, size_t max, size_t byte_budget) {
+    DEBUG_PRINT(__FILE__ " set_capacity(%zu, %zu, %zu)\n", min, max,
+                byte_budget);
+
+    pthread_mutex_lock(&cache_lock);
+    sizer_configure(sizer, min, max, byte_budget, MAX_CAPACITY);
+    _shrink_to_fit();
+
+    // room for every entry up front, so a full cache allocates nothing
+    slab_reserve(node_slab, sizer->max_capacity);
+    slab_reserve(value_slab, sizer->max_capacity);
+    pthread_mutex_unlock(&cache_lock);
 }
 
 
-void _insert(KeyType key, ValueType value) {
-    if (key > MAX_KEY)
-        return;
+// Moves the most recently accessed key to the front of the order of use
+void _touch(KeyType last_used) {
+    TRACE(TRACE_TOUCH, last_used, key_map[last_used]);
+
+    LRUnode node = cache[key_map[last_used]];
+    if (node != most_recent) {
+        _unlink(node);
+        _push_most_recent(node);
+    }
+}
+
+
+// Number of entries used more recently than key
+size_t _recency_rank(KeyType key) {
+    size_t rank = 0;
 
-    DEBUG_PRINT(__FILE__ " insert(" KEY_FMT ")", key);
+    for (LRUnode node = most_recent; node->key != key; node = node->older)
+        rank++;
+    return rank;
+}
 
-    bool space_available = saved_values < CACHE_SIZE;
 
-    size_t insert_idx    = 0;
+bool _is_present(KeyType key) {
+    bool present = key <= MAX_KEY && key_map[key] != KEY_NOT_PRESENT;
 
-    // if not full, insert at end of used entries, else replace least recently
-    // used
-    if (space_available)
-        insert_idx = saved_values;
-    else if (key_map[key_to_replace] >= 0)
-        insert_idx = key_map[key_to_replace];
+    TRACE(present ? TRACE_PRESENT : TRACE_ABSENT, key,
+          present ? (size_t)key_map[key] : TRACE_NO_SLOT);
 
-    if (cache[insert_idx] != NULL) {
-        DEBUG_PRINT(": evict key " KEY_FMT, key_to_replace);
-        node_free(cache[insert_idx]);
+    return present;
+}
+
+
+void _insert(KeyType key, ValueType value) {
+    if (key > MAX_KEY) {
+        slab_release(value_slab, value);
+        return;
     }
-    DEBUG_PRINT("\n");
 
-    // insert element
+    // if full, replace least recently used first
+    if (saved_values >= sizer->capacity)
+        _evict(key_map[least_recent->key]);
+
+    // insert element at end of used entries
+    size_t insert_idx = saved_values++;
     cache[insert_idx] = node_new(key, value);
     key_map[key]      = insert_idx;
+    saved_bytes += node_bytes(cache[insert_idx]);
 
-    if (space_available)
-        saved_values++;
+    TRACE(TRACE_INSERT, key, insert_idx);
 
-    _update_times(key);
+    _push_most_recent(cache[insert_idx]);
 }
 
 
@@ -199,28 +400,317 @@ ValueType _get(KeyType key) {
     // map key to a cache index, get value from node in that index
     ValueType result = cache[key_map[key]]->value;
 
-    _update_times(key);
+    _touch(key);
 
-    DEBUG_PRINT(__FILE__ " get(" KEY_FMT ")\n", key);
+    TRACE(TRACE_GET, key, key_map[key]);
 
     return result;
 }
 
 
+// Fills by_recency with every node, most recently used first
+void _sort_by_recency(LRUnode by_recency[]) {
+    size_t ix = 0;
+    for (LRUnode node = most_recent; node != NULL; node = node->older)
+        by_recency[ix++] = node;
+}
+
+
+bool save_snapshot(const char* path, uint64_t fingerprint) {
+    DEBUG_PRINT(__FILE__ " save_snapshot(%s)\n", path);
+
+    LRUnode by_recency[MAX_CAPACITY];
+    KeyType keys[MAX_CAPACITY];
+    ValueType values[MAX_CAPACITY];
+
+    pthread_mutex_lock(&cache_lock);
+
+    _sort_by_recency(by_recency);
+
+    for (size_t ix = 0; ix < saved_values; ix++) {
+        keys[ix]   = by_recency[ix]->key;
+        values[ix] = by_recency[ix]->value;
+    }
+
+    bool saved = snapshot_write(path, fingerprint, keys, values, saved_values);
+
+    pthread_mutex_unlock(&cache_lock);
+    return saved;
+}
+
+
+size_t export_entries(KeyType keys[], ValueType values[], size_t max) {
+    DEBUG_PRINT(__FILE__ " export_entries(%zu)\n", max);
+
+    pthread_mutex_lock(&cache_lock);
+
+    LRUnode by_recency[MAX_CAPACITY];
+    size_t count = saved_values < max ? saved_values : max;
+
+    _sort_by_recency(by_recency);
+
+    for (size_t ix = 0; ix < count; ix++) {
+        keys[ix]   = by_recency[ix]->key;
+        values[ix] = by_recency[ix]->value;
+    }
+
+    for (size_t ix = 0; ix < count; ix++) {
+        _remove(key_map[keys[ix]], true);
+        values[ix] = _give_up(values[ix]);
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+    return count;
+}
+
+
+size_t invalidate(Stale_fptr stale) {
+    DEBUG_PRINT(__FILE__ " invalidate()\n");
+
+    pthread_mutex_lock(&cache_lock);
+
+    size_t removed = 0;
+
+    // _remove() fills the gap from the end, which has been looked at already
+    for (size_t ix = saved_values; ix-- > 0;) {
+        if (stale(cache[ix]->key, cache[ix]->value)) {
+            _remove(ix, false);
+            removed++;
+        }
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+    return removed;
+}
+
+
+int load_snapshot(const char* path, uint64_t fingerprint) {
+    DEBUG_PRINT(__FILE__ " load_snapshot(%s)\n", path);
+
+    Snapshot snap = snapshot_open(path, fingerprint);
+    if (snap == NULL)
+        return -1;
+
+    pthread_mutex_lock(&cache_lock);
+
+    size_t count = snap->count < sizer->capacity ? snap->count
+                                                 : sizer->capacity;
+    int restored = 0;
+
+    // least recently used first, so the hottest entry ends up newest
+    for (size_t ix = count; ix-- > 0;) {
+        KeyType key = snap->entries[ix].key;
+
+        if (key <= MAX_KEY && key_map[key] == KEY_NOT_PRESENT) {
+            _insert(key, snapshot_value(snap, ix));
+            restored++;
+        }
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+
+    snapshot_close(snap);
+    return restored;
+}
+
+
+void set_eviction_handler(Eviction_fptr handler) {
+    DEBUG_PRINT(__FILE__ " set_eviction_handler()\n");
+    pthread_mutex_lock(&cache_lock);
+    eviction_handler = handler;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+void insert(KeyType key, ValueType value) {
+    pthread_mutex_lock(&cache_lock);
+
+    if (key > MAX_KEY || key_map[key] != KEY_NOT_PRESENT)
+        slab_release(value_slab, value);  // already held, or never could be
+    else
+        _insert(key, value);
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+// Prefetched entries go in as the least recently used, so they are the
+// first to go unless they are asked for
+void _admit_prefetched(KeyType key, ValueType value) {
+    size_t insert_idx = saved_values++;
+    LRUnode node      = node_new(key, value);
+
+    node->prefetched = true;
+    _push_least_recent(node);
+
+    cache[insert_idx] = node;
+    key_map[key]      = insert_idx;
+    saved_bytes += node_bytes(node);
+}
+
+
+// Index of an entry that was prefetched and never used, or KEY_NOT_PRESENT
+int _unused_prefetched(void) {
+    for (size_t ix = 0; ix < saved_values; ix++)
+        if (cache[ix]->prefetched)
+            return ix;
+    return KEY_NOT_PRESENT;
+}
+
+
+// Puts a new prefetched value in place of an unused one, keeping its age
+void _replace_prefetched(size_t idx, KeyType key, ValueType value) {
+    LRUnode node = cache[idx];
+
+    saved_bytes -= node_bytes(node);
+    key_map[node->key] = KEY_NOT_PRESENT;
+    slab_release(value_slab, node->value);
+
+    node->key    = key;
+    node->value  = value;
+    key_map[key] = idx;
+    saved_bytes += node_bytes(node);
+}
+
+
+void insert_many(const KeyType keys[], ValueType values[], size_t count) {
+    DEBUG_PRINT(__FILE__ " insert_many(%zu)\n", count);
+
+    pthread_mutex_lock(&cache_lock);
+
+    for (size_t ix = 0; ix < count; ix++) {
+        KeyType key = keys[ix];
+        int idx;
+
+        if (key > MAX_KEY || key_map[key] != KEY_NOT_PRESENT) {
+            slab_release(value_slab, values[ix]);
+            continue;
+        }
+
+        if (saved_values < sizer->capacity &&
+            !sizer_over_budget(sizer, saved_bytes))
+            _admit_prefetched(key, values[ix]);
+        else if ((idx = _unused_prefetched()) != KEY_NOT_PRESENT)
+            _replace_prefetched(idx, key, values[ix]);
+        else if (saved_values > 0) {
+            _evict(key_map[least_recent->key]);  // it would have gone next anyway
+            _admit_prefetched(key, values[ix]);
+        } else {
+            slab_release(value_slab, values[ix]);
+            continue;
+        }
+        cache_prefetched++;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+// Every key not held can be taken, as the least recently used
+size_t admit_many(KeyType keys[], size_t count) {
+    size_t kept = 0;
+
+    pthread_mutex_lock(&cache_lock);
+
+    for (size_t ix = 0; ix < count; ix++)
+        if (keys[ix] <= MAX_KEY && key_map[keys[ix]] == KEY_NOT_PRESENT)
+            keys[kept++] = keys[ix];
+
+    pthread_mutex_unlock(&cache_lock);
+    return kept;
+}
+
+
+// Copies value into the calling thread's own buffer
+ValueType _return_copy(ValueType value) {
+    if (value == NULL)
+        return NULL;
+
+    size_t size = strlen(value) + 1;
+    if (size > returned_size) {
+        returned_value = realloc(returned_value, size);
+        returned_size  = size;
+        pthread_setspecific(returned_key, returned_value);
+    }
+    return memcpy(returned_value, value, size);
+}
+
+
+// Computes a missed key with the lock released, unless another thread is
+// already computing it, in which case its result is waited for
+// Takes the lock held and returns with it held
+ValueType _provide_missed(Vec lengths, KeyType key) {
+    if (sizer_record_miss(sizer, key))
+        cache_ghost_hits++;
+
+    Flight flight = flights_wait(flights, key);
+
+    if (flight != NULL) {
+        cache_coalesced++;
+        ValueType result = _return_copy(flight->value);
+        flight_leave(flight);
+        return result;
+    }
+
+    flight = flights_start(flights, key);
+    pthread_mutex_unlock(&cache_lock);
+
+    INSTRUMENT_START(downstream_timer);
+    ValueType result = (*_downstream)(lengths, key);
+    INSTRUMENT_STOP(STAGE_DOWNSTREAM, downstream_timer);
+
+    pthread_mutex_lock(&cache_lock);
+    INSTRUMENT_START(insert_timer);
+
+    // it may have been published or inserted while unlocked
+    ValueType returned = _return_copy(result);
+    if (_is_present(key))
+        slab_release(value_slab, result);
+    else
+        _insert(key, result);
+
+    INSTRUMENT_STOP(STAGE_INSERT, insert_timer);
+
+    flights_land(flights, flight, returned);
+    return returned;
+}
+
+
 // used externally but not referenced externally --
 // only by the set_provider function
 ValueType _caching_provider(Vec lengths, KeyType key) {
+    pthread_mutex_lock(&cache_lock);
     cache_requests++;
 
+    // resize before the lookup, so the value returned is never evicted
+    if (sizer_is_adaptive(sizer))
+        _shrink_to_fit();
+
+    INSTRUMENT_START(lookup_timer);
+
     if (_is_present(key)) {
         cache_hits++;
-        return _get(key);
+
+        if (sizer_is_adaptive(sizer))
+            sizer_record_hit(sizer, _recency_rank(key));
+
+        LRUnode node = cache[key_map[key]];
+        if (node->prefetched) {
+            node->prefetched = false;
+            cache_prefetch_hits++;
+        }
+
+        ValueType result = _return_copy(_get(key));
+        INSTRUMENT_STOP(STAGE_LOOKUP, lookup_timer);
+        pthread_mutex_unlock(&cache_lock);
+        return result;
     } else
         cache_misses++;
 
-    ValueType result = (*_downstream)(lengths, key);
-    _insert(key, result);
+    INSTRUMENT_STOP(STAGE_LOOKUP, lookup_timer);
+    ValueType result = _provide_missed(lengths, key);
 
+    pthread_mutex_unlock(&cache_lock);
     return result;
 }
 
@@ -230,3 +720,8 @@ ProviderFunction set_provider(ProviderFunction downstream) {
     _downstream = downstream;
     return _caching_provider;
 }
+
+
+void* alloc_value(size_t size) {
+    return slab_alloc(value_slab, size);
+}
@@ -0,0 +1,223 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "inputreader.h"
+#include "server.h"
+#include "workload.h"
+
+/*
+** Load generator for main --server.
+** Opens --connections connections at once, each on a thread of its own, and
+** sends --count lengths over each in pipelined rounds: the --pipeline
+** lengths of a round are sent together, then all of their answers read.
+** Reports the requests answered per second and the mean time of a round.
+*/
+
+#define DEFAULT_CONNECTIONS 4
+#define DEFAULT_PIPELINE 16
+#define DEFAULT_COUNT 100000
+#define DEFAULT_MAX_KEY 1000
+#define DEFAULT_SKEW 1.0
+#define MAX_CONNECTIONS 1024
+#define MAX_PIPELINE 4096  // a round is sent whole before any answer is read
+#define LENGTH_DIGITS 8    // MAX_ROD_LENGTH and its newline
+#define RECEIVE_SIZE (1 << 16)
+
+#define USAGE_FMT                                                          \
+    "Usage: %s PORT|PATH [--connections=N] [--pipeline=N] [--count=N] "    \
+    "[--max-key=N] [--generate=uniform|zipf] [--skew=X] [--seed=N]\n"
+
+// One connection and what it saw
+typedef struct client {
+    pthread_t thread;
+    const char* address;
+    Workload load;
+    size_t count;     // requests to send
+    size_t pipeline;  // requests in each round
+    size_t answered;
+    size_t errors;  // answers that were error messages
+    double round_seconds;  // summed over every round
+    size_t rounds;
+    bool failed;
+    char* buffer;   // answers as they are received
+    char last;      // the last character received
+    bool at_start;  // the next character starts an answer
+} Client;
+
+
+double secondsSince(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+bool sendAll(int fd, const char* text, size_t length) {
+    while (length > 0) {
+        ssize_t sent = write(fd, text, length);
+        if (sent <= 0)
+            return false;
+        text += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+// Reads until count more answers have ended, each with an empty line
+bool receiveAnswers(Client* client, int fd, size_t count) {
+    while (count > 0) {
+        ssize_t got = read(fd, client->buffer, RECEIVE_SIZE);
+        if (got <= 0)
+            return false;
+
+        for (ssize_t ix = 0; ix < got; ix++) {
+            char next = client->buffer[ix];
+
+            if (client->at_start && next == 'E')
+                client->errors++;
+            client->at_start = false;
+
+            if (next == '\n' && client->last == '\n') {
+                client->answered++;
+                client->at_start = true;
+                count--;
+            }
+            client->last = next;
+        }
+    }
+    return true;
+}
+
+void* runClient(void* arg) {
+    Client* client = arg;
+    char* request  = malloc(client->pipeline * LENGTH_DIGITS);
+
+    client->buffer   = malloc(RECEIVE_SIZE);
+    client->at_start = true;
+
+    int fd         = openSocket(client->address, false);
+    client->failed = fd < 0;
+
+    for (size_t sent = 0; !client->failed && sent < client->count;) {
+        size_t round = client->count - sent < client->pipeline
+                           ? client->count - sent
+                           : client->pipeline;
+        size_t length = 0;
+
+        for (size_t ix = 0; ix < round; ix++)
+            length += sprintf(request + length, "%zu\n",
+                              workload_next(client->load));
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        client->failed = !sendAll(fd, request, length) ||
+                         !receiveAnswers(client, fd, round);
+
+        client->round_seconds += secondsSince(&start);
+        client->rounds++;
+        sent += round;
+    }
+
+    if (fd >= 0)
+        close(fd);
+    free(client->buffer);
+    free(request);
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    const char* address  = NULL;
+    const char* generate = "uniform";
+    size_t connections   = DEFAULT_CONNECTIONS;
+    size_t pipeline      = DEFAULT_PIPELINE;
+    size_t count         = DEFAULT_COUNT;
+    size_t max_key       = DEFAULT_MAX_KEY;
+    size_t seed          = 1;
+    double skew          = DEFAULT_SKEW;
+
+    for (int ix = 1; ix < argc; ix++) {
+        const char* value = NULL;
+        bool valid        = true;
+
+        if (matchFlag(argv[ix], "connections", &value))
+            valid = parseSize(value, &connections) && connections > 0 &&
+                    connections <= MAX_CONNECTIONS;
+        else if (matchFlag(argv[ix], "pipeline", &value))
+            valid = parseSize(value, &pipeline) && pipeline > 0 &&
+                    pipeline <= MAX_PIPELINE;
+        else if (matchFlag(argv[ix], "count", &value))
+            valid = parseSize(value, &count) && count > 0;
+        else if (matchFlag(argv[ix], "max-key", &value))
+            valid = parseSize(value, &max_key) && max_key > 0 &&
+                    max_key <= MAX_ROD_LENGTH;
+        else if (matchFlag(argv[ix], "generate", &value))
+            valid = (generate = value) != NULL;
+        else if (matchFlag(argv[ix], "skew", &value))
+            valid = value != NULL && (skew = atof(value)) > 0;
+        else if (matchFlag(argv[ix], "seed", &value))
+            valid = parseSize(value, &seed);
+        else if (strncmp(argv[ix], "--", 2) != 0 && address == NULL)
+            address = argv[ix];
+        else
+            valid = false;
+
+        if (!valid) {
+            printErr(FLAG_INVALID, argv[ix], COMMAND_LINE_ARG_SIZE);
+            fprintf(stderr, USAGE_FMT, argv[0]);
+            return 1;
+        }
+    }
+
+    WorkloadType type;
+    if (address == NULL || !parseWorkloadType(generate, &type)) {
+        fprintf(stderr, USAGE_FMT, argv[0]);
+        return 1;
+    }
+
+    Client* clients = calloc(connections, sizeof(Client));
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // each connection sends its own stream of keys
+    for (size_t ix = 0; ix < connections; ix++) {
+        clients[ix].address  = address;
+        clients[ix].load     = new_workload(type, max_key, skew, seed + ix);
+        clients[ix].count    = count;
+        clients[ix].pipeline = pipeline;
+        pthread_create(&clients[ix].thread, NULL, runClient, &clients[ix]);
+    }
+
+    size_t answered = 0, errors = 0, rounds = 0, failed = 0;
+    double round_seconds = 0;
+
+    for (size_t ix = 0; ix < connections; ix++) {
+        pthread_join(clients[ix].thread, NULL);
+        workload_free(clients[ix].load);
+
+        answered += clients[ix].answered;
+        errors += clients[ix].errors;
+        rounds += clients[ix].rounds;
+        round_seconds += clients[ix].round_seconds;
+        failed += clients[ix].failed;
+    }
+    double seconds = secondsSince(&start);
+
+    printf("%s: %zu connections, pipeline %zu, %zu keys (%s)\n", address,
+           connections, pipeline, max_key, generate);
+    printf("  %zu answers in %.3f s, %.0f requests/s\n", answered, seconds,
+           answered / seconds);
+    printf("  %.1f us per round\n",
+           rounds > 0 ? round_seconds * 1e6 / rounds : 0);
+    if (errors > 0)
+        printf("  %zu answers were errors\n", errors);
+    if (failed > 0)
+        printf("  %zu connections failed\n", failed);
+
+    free(clients);
+    return failed > 0 || answered != connections * count;
+}
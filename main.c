@@ -1,49 +1,173 @@
 #include <limits.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
+#include "answertable.h"
 #include "cache.h"
 #include "inputreader.h"
+#include "instrument.h"
+#include "pricetable.h"
 #include "rodcutsolver.h"
+#include "server.h"
 
+#define COMMAND_PREFIX '!'
+#define SWAP_COMMAND "!swap "  // followed by the path of a cache module
+#define RELOAD_COMMAND "!reload"  // reads the price file again, as SIGHUP does
 
-void processLengths(ProviderFunction provider, Vec length_prices);
+#define STREAM_BLOCK_SIZE (1 << 16)   // bytes of lengths read at once
+#define STREAM_OUTPUT_SIZE (1 << 16)  // bytes of copied results per write
+#define STREAM_IOVECS 256             // pieces of output per write
+
+#define BATCH_CHUNK_LINES 64    // lines a worker takes at a time
+#define BATCH_WINDOW_CHUNKS 4   // chunks in the ring for every worker
+
+// Results of --stream waiting to be written, in order. Values the stream
+// owns are written from where they are; others are copied into buffer
+typedef struct streamoutput {
+    struct iovec pieces[STREAM_IOVECS];
+    size_t piece_count;
+    CacheValue held[STREAM_IOVECS];  // owned values pieces point into
+    size_t held_count;
+    char buffer[STREAM_OUTPUT_SIZE];
+    size_t used;
+} StreamOutput;
+
+// The cache and the prices, and what they are wired into, so either can be
+// replaced at runtime
+typedef struct session {
+    const Options* opts;
+    ProviderFunction solver;    // answers whatever gets past every cache
+    Cache* cache;               // NULL if there is none
+    CacheInstance* instance;    // the cache's handles, NULL if there are none
+    ProviderFunction provider;  // what each request goes to
+    Vec length_prices;          // what every request is solved for
+    PriceTable price_table;     // NULL unless the prices are a mapped table
+    uint64_t fingerprint;       // of the prices
+    AnswerTable table;          // NULL if there is none
+} Session;
+
+// Lines of --batch input, answered together by one worker
+typedef struct batchchunk {
+    size_t count;
+    bool done;  // every line answered; read and set under the batch's lock
+    char lines[BATCH_CHUNK_LINES][BUFFER_SIZE];
+    CacheValue results[BATCH_CHUNK_LINES];  // NULL for a line in error
+    int errors[BATCH_CHUNK_LINES];
+} BatchChunk;
+
+// The reorder buffer of --batch: a ring of chunks counted in input order.
+// Workers answer them in whatever order they finish, the reading thread
+// writes them out strictly in order. Chunks from written to filled are out
+// with the workers or waiting to be written
+typedef struct batch {
+    Session* session;
+    BatchChunk* ring;
+    size_t window;   // chunks in the ring
+    size_t filled;   // chunks handed to the workers
+    size_t taken;    // chunks a worker has started on
+    size_t written;  // chunks written out, only used by the reading thread
+    bool closing;    // no more chunks are coming
+    pthread_mutex_t lock;
+    pthread_cond_t ready;     // a chunk was filled, or closing was set
+    pthread_cond_t answered;  // a chunk is done
+    pthread_t* workers;
+    size_t worker_count;
+} Batch;
+
+// Where the lines of --stream input go
+typedef struct stream {
+    Session* session;
+    StreamOutput out;
+    Batch* batch;  // NULL if each line is answered as it is read
+} Stream;
+
+
+ProviderFunction installCache(Cache* cache, ProviderFunction solver,
+                              const Options* opts);
+bool swapCache(Session* session, const char* libname);
+void requestReload(int signal_number);
+void reloadPrices(Session* session);
+void runCommand(Session* session, const char* command);
+CacheValue requestValue(Session* session, size_t length);
+CacheValue answerClient(void* session, size_t length);
+void reloadForClients(void* session);
+void processLengths(Session* session);
+void streamLengths(Session* session, int fd);
+
+// set by SIGHUP, and taken up before the next request
+volatile sig_atomic_t reload_requested = 0;
 
 
 int main(int argc, char* argv[]) {
-    if (!isArgCountValid(argc)) {
+    Options opts;
+    const char* bad_arg = argv[0];
+    int arg_state       = parseArgs(argc, argv, &opts, &bad_arg);
+
+    if (arg_state != ARGS_OK) {
+        if (arg_state == FLAG_INVALID)
+            printErr(FLAG_INVALID, bad_arg, COMMAND_LINE_ARG_SIZE);
         printErr(ARG_COUNT_INVALID, argv[0], COMMAND_LINE_ARG_SIZE);
         return 1;
     }
 
-    const char* filename      = argv[FILE_ARG];
-    const char* cache_module  = argv[CACHE_ARG];
+    const char* filename     = opts.filename;
+    const char* cache_module = opts.cache_module;
 
-    ProviderFunction provider = solveRodCutting;
+    // answers are looked up once the table is checked against the prices
+    Session session  = {0};
+    session.opts     = &opts;
+    session.solver   = opts.table_file ? solveFromTable : solveRodCutting;
+    session.provider = session.solver;
 
-    bool cache_installed      = argc > CACHE_ARG;
-    Cache* cache              = NULL;
+    if (cache_module != NULL) {
+        session.cache = load_cache_module(cache_module);
 
-    if (cache_installed) {
-        cache = load_cache_module(cache_module);
-
-        if (cache == NULL) {
+        if (session.cache == NULL) {
             printErr(CACHE_INVALID, cache_module, COMMAND_LINE_ARG_SIZE);
             return 1;
         }
 
-        provider = cache->set_provider_func(provider);
+        for (size_t ix = 0; ix < opts.tier_count; ix++) {
+            if (!load_tier_module(opts.tier_modules[ix],
+                                  opts.tier_capacities[ix])) {
+                printErr(CACHE_INVALID, opts.tier_modules[ix],
+                         COMMAND_LINE_ARG_SIZE);
+                return 1;
+            }
+        }
+
+        session.provider = installCache(session.cache, session.solver, &opts);
+        session.instance = open_installed_cache(session.cache, session.provider);
 
-        printf("Cache loaded\n\n");
+        if (!opts.stream)
+            printf("Cache loaded\n\n");
     }
 
-    printf("Reading lengths from '%s'...\n", filename);
+    for (size_t ix = 0; ix < opts.shadow_count; ix++) {
+        if (!load_shadow_module(opts.shadow_modules[ix])) {
+            printErr(CACHE_INVALID, opts.shadow_modules[ix],
+                     COMMAND_LINE_ARG_SIZE);
+            return 1;
+        }
+    }
+    session.provider = add_shadows(session.provider);
 
-    const Vec length_prices = extractFile(filename);
+    if (!opts.stream)
+        printf("Reading lengths from '%s'...\n", filename);
 
-    printf("\n");
+    PriceTable price_table  = NULL;
+    const Vec length_prices = loadPrices(filename, !opts.quiet, &price_table);
+
+    if (!opts.stream)
+        printf("\n");
 
     if (length_prices == NULL) {
         printErr(FILE_INVALID, filename, COMMAND_LINE_ARG_SIZE);
@@ -51,23 +175,298 @@ int main(int argc, char* argv[]) {
     }
     if (vec_length(length_prices) == 0) {
         printErr(FILE_NO_VALID_LINES, filename, COMMAND_LINE_ARG_SIZE);
-        vec_free(length_prices);
+        freePrices(length_prices, price_table);
         return 1;
     }
 
-    processLengths(provider, length_prices);
+    session.length_prices = length_prices;
+    session.price_table   = price_table;
+
+    // a binary table carries the fingerprint of the text it came from
+    session.fingerprint = price_table ? price_table->fingerprint
+                                      : fingerprintPrices(length_prices);
+
+    if (opts.table_file != NULL) {
+        session.table = openAnswerTable(opts.table_file, session.fingerprint);
+
+        if (session.table == NULL) {
+            printErr(TABLE_INVALID, opts.table_file, COMMAND_LINE_ARG_SIZE);
+            freePrices(length_prices, price_table);
+            return 1;
+        }
+        setAnswerTable(session.table);
+    }
+
+    if (session.cache != NULL && opts.snapshot_file != NULL) {
+        int restored = session.cache->load_snapshot(opts.snapshot_file,
+                                                    session.fingerprint);
+
+        if (restored < 0)
+            printErr(SNAPSHOT_NOT_RESTORED, opts.snapshot_file,
+                     COMMAND_LINE_ARG_SIZE);
+        else if (!opts.stream)
+            printf("Restored %d cached lengths from '%s'\n", restored,
+                   opts.snapshot_file);
+    }
+
+    // SA_RESTART, so a read waiting for input goes on waiting
+    struct sigaction reload_action = {0};
+    reload_action.sa_handler       = requestReload;
+    reload_action.sa_flags         = SA_RESTART;
+    sigemptyset(&reload_action.sa_mask);
+    sigaction(SIGHUP, &reload_action, NULL);
+
+    int exit_code = 0;
+
+    if (opts.server_address != NULL) {
+        if (!serveLengths(opts.server_address, answerClient, reloadForClients,
+                          &session)) {
+            printErr(SERVER_INVALID, opts.server_address,
+                     COMMAND_LINE_ARG_SIZE);
+            exit_code = 1;
+        }
+    } else if (opts.stream) {
+        int fd = opts.stream_file ? open(opts.stream_file, O_RDONLY)
+                                  : STDIN_FILENO;
+
+        if (fd < 0) {
+            printErr(FILE_INVALID, opts.stream_file, COMMAND_LINE_ARG_SIZE);
+            exit_code = 1;
+        } else {
+            streamLengths(&session, fd);
+        }
+
+        if (opts.stream_file && fd >= 0)
+            close(fd);
+    } else {
+        processLengths(&session);
+    }
+
+    // a swap may have replaced the cache loaded at startup
+    Cache* cache = session.cache;
+
+    if (opts.print_stats) {
+        printf("\n\n");
+        fflush(stdout);
+
+        if (cache != NULL) {
+            CacheStat* list_of_stats = cache->get_statistics();
+            print_cache_stats(fileno(stdout), list_of_stats);
+
+            if (list_of_stats)
+                free(list_of_stats);
+        }
+        print_tier_stats(fileno(stdout));
+        print_shadow_stats(fileno(stdout));
+    }
+
+    cleanup_shadows();
+
+    if (session.instance != NULL)
+        close_cache_instance(session.instance);
 
     if (cache != NULL) {
+        if (opts.snapshot_file != NULL &&
+            !cache->save_snapshot(opts.snapshot_file, session.fingerprint))
+            printErr(SNAPSHOT_NOT_SAVED, opts.snapshot_file,
+                     COMMAND_LINE_ARG_SIZE);
+
+        setOutputAllocator(NULL);
         cache->cache_cleanup();
         free(cache);
     }
+    cleanup_tiers();
+
+    // a reload may have replaced the prices and the table
+    if (session.table != NULL)
+        closeAnswerTable(session.table);
+
+    freePrices(session.length_prices, session.price_table);
+    freeSolverWorkspace();
+    if (!opts.stream)
+        printf("\n");  // Move command line to a new line after all outputs
+    return exit_code;
+}
+
+ProviderFunction installCache(Cache* cache, ProviderFunction solver,
+                              const Options* opts) {
+    ProviderFunction provider =
+        cache->set_provider_func(add_tiers(cache, solver));
+
+    // a budget alone lets the cache pick any capacity that fits it
+    if (opts->min_capacity > 0)
+        cache->set_capacity(opts->min_capacity, opts->max_capacity,
+                            opts->byte_budget);
+    else if (opts->byte_budget > 0)
+        cache->set_capacity(1, SIZE_MAX, opts->byte_budget);
+
+    // the solver's answers go to the last tier, and can come from its pool
+    setOutputAllocator(bottom_tier(cache)->alloc_value);
+
+    // every miss solves the shorter lengths too, offer some of them
+    if (opts->publish_count > 0)
+        setSolutionPublisher(cache->insert_many, cache->admit_many,
+                             opts->publish_count);
 
-    vec_free(length_prices);
-    printf("\n");  // Move command line to a new line after all outputs
-    return 0;
+    return provider;
 }
 
-void processLengths(ProviderFunction provider, Vec length_prices) {
+bool swapCache(Session* session, const char* libname) {
+    Cache* replacement = load_cache_module(libname);
+    if (replacement == NULL)
+        return false;
+
+    ProviderFunction provider =
+        installCache(replacement, session->solver, session->opts);
+
+    // the old cache's entries go over before its cleanup()
+    size_t moved = 0;
+    if (session->cache != NULL)
+        moved = migrate_cache(session->cache, replacement,
+                              session->fingerprint);
+
+    if (session->instance != NULL)
+        close_cache_instance(session->instance);
+
+    session->cache    = replacement;
+    session->instance = open_installed_cache(replacement, provider);
+    session->provider = add_shadows(provider);
+
+    printf("Swapped in cache '%s', %zu entries moved\n", libname, moved);
+    return true;
+}
+
+void requestReload(int signal_number) {
+    (void)signal_number;
+    reload_requested = 1;
+}
+
+// Reloads the prices if SIGHUP asked for it since the last request
+void takeReload(Session* session) {
+    if (reload_requested) {
+        reload_requested = 0;
+        reloadPrices(session);
+    }
+}
+
+// what the reload in progress changed, for isStale()
+PriceChanges reload_changes = NULL;
+
+// Helper function for reloadPrices(), handed to the caches
+bool isStale(KeyType key, const char* value) {
+    return isAnswerStale(reload_changes, key, value);
+}
+
+// Reads the price file again, and drops only the cached answers the new
+// prices could change. The solver keeps nothing between requests, and an
+// answer table only serves the prices it was built from
+void reloadPrices(Session* session) {
+    const Options* opts    = session->opts;
+    PriceTable price_table = NULL;
+    Vec length_prices      = loadPrices(opts->filename, false, &price_table);
+
+    if (length_prices == NULL || vec_length(length_prices) == 0) {
+        freePrices(length_prices, price_table);
+        printErr(PRICES_NOT_RELOADED, opts->filename, COMMAND_LINE_ARG_SIZE);
+        return;
+    }
+
+    uint64_t fingerprint = price_table ? price_table->fingerprint
+                                       : fingerprintPrices(length_prices);
+
+    if (fingerprint == session->fingerprint) {
+        freePrices(length_prices, price_table);
+        printf("Prices in '%s' are unchanged\n", opts->filename);
+        return;
+    }
+
+    size_t dropped = 0;
+
+    if (session->cache != NULL) {
+        reload_changes = comparePrices(session->length_prices, length_prices);
+        dropped        = invalidate_caches(session->cache, isStale);
+        freePriceChanges(reload_changes);
+        reload_changes = NULL;
+
+        if (dropped == INVALIDATE_UNSUPPORTED) {
+            freePrices(length_prices, price_table);
+            printErr(PRICES_NOT_RELOADED, opts->filename,
+                     COMMAND_LINE_ARG_SIZE);
+            return;
+        }
+    }
+
+    // without a table for the new prices, every length is solved
+    if (opts->table_file != NULL) {
+        AnswerTable table = openAnswerTable(opts->table_file, fingerprint);
+        if (table == NULL)
+            printErr(TABLE_INVALID, opts->table_file, COMMAND_LINE_ARG_SIZE);
+
+        setAnswerTable(table);
+        if (session->table != NULL)
+            closeAnswerTable(session->table);
+        session->table = table;
+    }
+
+    freePrices(session->length_prices, session->price_table);
+    session->length_prices = length_prices;
+    session->price_table   = price_table;
+    session->fingerprint   = fingerprint;
+
+    printf("Reloaded prices from '%s', %zu cached answers dropped\n",
+           opts->filename, dropped);
+}
+
+// Runs a line that starts with '!' instead of a rod length
+void runCommand(Session* session, const char* command) {
+    char line[BUFFER_SIZE];
+    copyWithoutNewline(command, line, BUFFER_SIZE);
+
+    if (strncmp(line, SWAP_COMMAND, strlen(SWAP_COMMAND)) == 0) {
+        const char* libname = line + strlen(SWAP_COMMAND);
+
+        if (!swapCache(session, libname))
+            printErr(CACHE_INVALID, libname, BUFFER_SIZE);
+
+    } else if (strcmp(line, RELOAD_COMMAND) == 0) {
+        reloadPrices(session);
+
+    } else {
+        printErr(COMMAND_INVALID, line, BUFFER_SIZE);
+    }
+}
+
+// Returns a handle to the answer for length. The cache's handle is shared
+// when it has one, the solver's own result is taken over
+CacheValue requestValue(Session* session, size_t length) {
+    CacheValue result;
+
+    INSTRUMENT_START(request_timer);
+    if (session->instance != NULL) {
+        show_shadows(session->length_prices, length);
+        result = session->instance->ops->get(session->instance->context,
+                                             session->length_prices, length);
+    } else {
+        ValueType results = session->provider(session->length_prices, length);
+        result = session->cache == NULL ? cache_value_adopt(results)
+                                        : cache_value_new(results);
+    }
+    INSTRUMENT_STOP(STAGE_REQUEST, request_timer);
+
+    return result;
+}
+
+// Answers a length for a --server client
+CacheValue answerClient(void* session, size_t length) {
+    return requestValue(session, length);
+}
+
+// Reloads the prices on SIGHUP, between the server's requests
+void reloadForClients(void* session) {
+    reloadPrices(session);
+}
+
+void processLengths(Session* session) {
     while (true) {
         printf("\nEnter a rod length (EOF to exit): ");
 
@@ -77,7 +476,12 @@ void processLengths(ProviderFunction provider, Vec length_prices) {
         if (input_state == USER_EXIT)
             return;
 
-        if (input_state == INPUT_OK) {
+        takeReload(session);
+
+        if (input_state == INPUT_OK && buffer[0] == COMMAND_PREFIX) {
+            runCommand(session, buffer);
+
+        } else if (input_state == INPUT_OK) {
             long rod_length;
             int write_state = writeInputToInt(buffer, &rod_length);
 
@@ -85,8 +489,10 @@ void processLengths(ProviderFunction provider, Vec length_prices) {
                 printErr(write_state, buffer, BUFFER_SIZE);
 
             } else {
-                char* results = provider(length_prices, (size_t)rod_length);
-                printf("%s", results);
+                CacheValue results =
+                    requestValue(session, (size_t)rod_length);
+                printf("%s", results->text);
+                cache_value_release(results);
             }
 
         } else {
@@ -98,3 +504,351 @@ void processLengths(ProviderFunction provider, Vec length_prices) {
             clearBuffer();
     }
 }
+
+
+// Writes every piece of output, however many calls it takes
+bool writePieces(int fd, struct iovec pieces[], size_t count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, pieces, count);
+        if (written < 0)
+            return false;
+
+        // skip what went out, which may end partway into a piece
+        while (count > 0 && (size_t)written >= pieces->iov_len) {
+            written -= pieces->iov_len;
+            pieces++;
+            count--;
+        }
+        if (count > 0) {
+            pieces->iov_base = (char*)pieces->iov_base + written;
+            pieces->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+void flushOutput(StreamOutput* out) {
+    writePieces(STDOUT_FILENO, out->pieces, out->piece_count);
+
+    for (size_t ix = 0; ix < out->held_count; ix++)
+        cache_value_release(out->held[ix]);
+
+    out->piece_count = 0;
+    out->held_count  = 0;
+    out->used        = 0;
+}
+
+// Copies text into the output buffer, after the last piece if that ends
+// where the copy starts
+void outputCopy(StreamOutput* out, const char* text, size_t length) {
+    if (length > STREAM_OUTPUT_SIZE - out->used ||
+        out->piece_count == STREAM_IOVECS)
+        flushOutput(out);
+
+    if (length > STREAM_OUTPUT_SIZE) {
+        struct iovec piece = {(void*)text, length};
+        writePieces(STDOUT_FILENO, &piece, 1);
+        return;
+    }
+
+    char* copy = memcpy(out->buffer + out->used, text, length);
+    out->used += length;
+
+    if (out->piece_count > 0) {
+        struct iovec* last = &out->pieces[out->piece_count - 1];
+
+        if ((char*)last->iov_base + last->iov_len == copy) {
+            last->iov_len += length;
+            return;
+        }
+    }
+    out->pieces[out->piece_count++] = (struct iovec){copy, length};
+}
+
+// Writes value from where it is, and releases it once it has been written
+void outputValue(StreamOutput* out, CacheValue value) {
+    if (out->piece_count == STREAM_IOVECS)
+        flushOutput(out);
+
+    out->pieces[out->piece_count++] =
+        (struct iovec){(void*)value->text, value->length};
+    out->held[out->held_count++] = value;
+}
+
+// Runs one line of --stream input
+void streamLine(Stream* stream, const char* line) {
+    StreamOutput* out = &stream->out;
+
+    // what a command or an error prints goes after the results before it
+    if (line[0] == COMMAND_PREFIX) {
+        flushOutput(out);
+        runCommand(stream->session, line);
+        fflush(stdout);
+        return;
+    }
+
+    long rod_length;
+    int write_state = writeInputToInt(line, &rod_length);
+
+    if (write_state != INPUT_OK) {
+        flushOutput(out);
+        printErr(write_state, line, BUFFER_SIZE);
+        return;
+    }
+
+    // the answer is written from where it is, held until it has been
+    outputValue(out, requestValue(stream->session, (size_t)rod_length));
+    outputCopy(out, "\n", 1);
+}
+
+
+// Answers every line of a chunk, away from the thread reading the input
+void answerChunk(Batch* batch, BatchChunk* chunk) {
+    for (size_t ix = 0; ix < chunk->count; ix++) {
+        long rod_length;
+        chunk->errors[ix]  = writeInputToInt(chunk->lines[ix], &rod_length);
+        chunk->results[ix] = NULL;
+
+        if (chunk->errors[ix] == INPUT_OK)
+            chunk->results[ix] =
+                requestValue(batch->session, (size_t)rod_length);
+    }
+}
+
+void* batchWorker(void* arg) {
+    Batch* batch = arg;
+
+    pthread_mutex_lock(&batch->lock);
+    while (true) {
+        while (batch->taken == batch->filled && !batch->closing)
+            pthread_cond_wait(&batch->ready, &batch->lock);
+
+        if (batch->taken == batch->filled)
+            break;  // closing, and nothing left to take
+
+        BatchChunk* chunk = &batch->ring[batch->taken++ % batch->window];
+        pthread_mutex_unlock(&batch->lock);
+
+        answerChunk(batch, chunk);
+
+        pthread_mutex_lock(&batch->lock);
+        chunk->done = true;
+        pthread_cond_signal(&batch->answered);
+    }
+    pthread_mutex_unlock(&batch->lock);
+
+    freeSolverWorkspace();
+    return NULL;
+}
+
+Batch* startBatch(Session* session, size_t workers) {
+    if (workers == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers    = cores > 0 ? (size_t)cores : 1;
+        if (workers > MAX_BATCH_WORKERS)
+            workers = MAX_BATCH_WORKERS;
+    }
+
+    Batch* batch   = calloc(1, sizeof(Batch));
+    batch->session = session;
+    batch->window  = workers * BATCH_WINDOW_CHUNKS;
+    batch->ring    = calloc(batch->window, sizeof(BatchChunk));
+    batch->workers = malloc(workers * sizeof(pthread_t));
+
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->ready, NULL);
+    pthread_cond_init(&batch->answered, NULL);
+
+    // answers still come if only some of the threads could be started
+    while (batch->worker_count < workers &&
+           pthread_create(&batch->workers[batch->worker_count], NULL,
+                          batchWorker, batch) == 0)
+        batch->worker_count++;
+
+    if (batch->worker_count == 0) {
+        free(batch->workers);
+        free(batch->ring);
+        free(batch);
+        return NULL;
+    }
+    return batch;
+}
+
+// Hands the chunk being filled to the workers, if it has any lines
+void dispatchChunk(Batch* batch) {
+    BatchChunk* chunk = &batch->ring[batch->filled % batch->window];
+    if (chunk->count == 0)
+        return;
+
+    pthread_mutex_lock(&batch->lock);
+    chunk->done = false;
+    batch->filled++;
+    pthread_cond_signal(&batch->ready);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+// Writes out the oldest chunk, waiting for its answers if wait is set
+// Returns false if there was none, or it was not answered yet
+bool writeOldest(Stream* stream, bool wait) {
+    Batch* batch = stream->batch;
+    if (batch->written == batch->filled)
+        return false;
+
+    BatchChunk* chunk = &batch->ring[batch->written % batch->window];
+
+    pthread_mutex_lock(&batch->lock);
+    while (wait && !chunk->done)
+        pthread_cond_wait(&batch->answered, &batch->lock);
+    bool done = chunk->done;
+    pthread_mutex_unlock(&batch->lock);
+
+    if (!done)
+        return false;
+
+    for (size_t ix = 0; ix < chunk->count; ix++) {
+        if (chunk->results[ix] != NULL) {
+            outputValue(&stream->out, chunk->results[ix]);
+            outputCopy(&stream->out, "\n", 1);
+        } else {
+            flushOutput(&stream->out);
+            printErr(chunk->errors[ix], chunk->lines[ix], BUFFER_SIZE);
+        }
+    }
+
+    // only this thread fills and writes chunks, the slot is free again
+    chunk->count = 0;
+    batch->written++;
+    return true;
+}
+
+// Writes out every chunk filled so far, once the workers have answered it
+void drainBatch(Stream* stream) {
+    dispatchChunk(stream->batch);
+    while (writeOldest(stream, true))
+        ;
+}
+
+// Runs one line of --batch input: lengths are gathered into chunks for the
+// workers, commands wait until every length before them is written
+void batchLine(Stream* stream, const char* line) {
+    Batch* batch = stream->batch;
+
+    if (line[0] == COMMAND_PREFIX) {
+        drainBatch(stream);
+        streamLine(stream, line);
+        return;
+    }
+
+    // a full ring waits on its oldest chunk before the slot is filled again
+    while (batch->filled - batch->written == batch->window)
+        writeOldest(stream, true);
+
+    BatchChunk* chunk = &batch->ring[batch->filled % batch->window];
+    memcpy(chunk->lines[chunk->count++], line, BUFFER_SIZE);
+
+    if (chunk->count == BATCH_CHUNK_LINES) {
+        dispatchChunk(batch);
+        while (writeOldest(stream, false))
+            ;
+    }
+}
+
+// Writes every remaining answer and stops the workers
+void finishBatch(Stream* stream) {
+    Batch* batch = stream->batch;
+
+    drainBatch(stream);
+
+    pthread_mutex_lock(&batch->lock);
+    batch->closing = true;
+    pthread_cond_broadcast(&batch->ready);
+    pthread_mutex_unlock(&batch->lock);
+
+    for (size_t ix = 0; ix < batch->worker_count; ix++)
+        pthread_join(batch->workers[ix], NULL);
+
+    pthread_mutex_destroy(&batch->lock);
+    pthread_cond_destroy(&batch->ready);
+    pthread_cond_destroy(&batch->answered);
+    free(batch->workers);
+    free(batch->ring);
+    free(batch);
+}
+
+
+// Helper function for streamLengths()
+// Only the first BUFFER_SIZE - 1 characters of a line count, as in
+// processLengths()
+void takeLine(Stream* stream, const char* text, size_t length) {
+    char line[BUFFER_SIZE] = {0};
+    if (length > BUFFER_SIZE - 1)
+        length = BUFFER_SIZE - 1;
+    memcpy(line, text, length);
+
+    // a reload waits, as a command does, for every length before it
+    if (reload_requested) {
+        if (stream->batch != NULL)
+            drainBatch(stream);
+        flushOutput(&stream->out);
+        takeReload(stream->session);
+        fflush(stdout);
+    }
+
+    if (stream->batch != NULL)
+        batchLine(stream, line);
+    else
+        streamLine(stream, line);
+}
+
+void streamLengths(Session* session, int fd) {
+    Stream* stream = malloc(sizeof(Stream));
+    char* block    = malloc(STREAM_BLOCK_SIZE);
+    size_t kept    = 0;      // start of a line cut off by the last block
+    bool skipping  = false;  // in the ignored rest of a long line
+    ssize_t got;
+
+    stream->session         = session;
+    stream->out.piece_count = 0;
+    stream->out.held_count  = 0;
+    stream->out.used        = 0;
+    stream->batch           = NULL;
+    fflush(stdout);
+
+    // without threads, the lengths are answered here as they are read
+    if (session->opts->batch)
+        stream->batch = startBatch(session, session->opts->batch_workers);
+
+    while ((got = read(fd, block + kept, STREAM_BLOCK_SIZE - kept)) > 0) {
+        char* line = block;
+        char* end  = block + kept + got;
+        char* eol;
+
+        while ((eol = memchr(line, '\n', end - line)) != NULL) {
+            if (!skipping)
+                takeLine(stream, line, eol - line);
+            skipping = false;
+            line     = eol + 1;
+        }
+
+        // a line too long to count in full is run on what there is of it
+        kept = skipping ? 0 : end - line;
+        if (kept >= BUFFER_SIZE - 1) {
+            takeLine(stream, line, kept);
+            skipping = true;
+            kept     = 0;
+        }
+        memmove(block, line, kept);
+    }
+
+    if (got < 0)
+        printErr(READ_ERROR, "", BUFFER_SIZE);
+    else if (kept > 0)
+        takeLine(stream, block, kept);
+
+    if (stream->batch != NULL)
+        finishBatch(stream);
+
+    flushOutput(&stream->out);
+    free(block);
+    free(stream);
+}
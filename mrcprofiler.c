@@ -0,0 +1,274 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inputreader.h"
+#include "workload.h"
+
+/*
+** Offline LRU miss-ratio-curve profiler.
+** Reads a trace of rod lengths (one per line, as typed into main) or generates
+** a workload, and computes the hit ratio an LRU cache of every size from 1 to
+** --max-size would have had, in one pass, using stack distances.
+**
+** The stack distance of a reference is the number of distinct keys used since
+** the previous reference to the same key. It is counted with a Fenwick tree
+** over access timestamps that holds a 1 at the latest access of every key.
+** An LRU cache of size C hits exactly the references with distance < C.
+**
+** --sample=RATE turns on SHARDS-style spatial sampling: only keys whose hash
+** falls under RATE are tracked, and their distances are scaled by 1 / RATE.
+** Memory stays bounded by the number of distinct keys however long the trace.
+**
+** Output is CSV on stdout: cache_size,hit_ratio
+*/
+
+#define MAX_KEY MAX_ROD_LENGTH
+#define TREE_SIZE (2 * (MAX_KEY + 1))  // compacted when it fills up
+
+#define SAMPLE_MODULUS (1 << 24)
+
+#define DEFAULT_COUNT 100000
+#define DEFAULT_GEN_MAX_KEY 1000
+#define DEFAULT_MAX_SIZE 1000
+#define DEFAULT_SKEW 1.0
+
+#define USAGE_FMT                                                        \
+    "Usage: %s [trace.txt] [--generate=uniform|zipf] [--count=N] "       \
+    "[--max-key=N] [--skew=X] [--seed=N] [--sample=RATE] [--max-size=N]\n"
+
+typedef struct profiler {
+    size_t last_access[MAX_KEY + 1];  // latest timestamp of a key, 0 if never
+    size_t key_at[TREE_SIZE + 1];     // key accessed at a timestamp
+    long tree[TREE_SIZE + 1];         // Fenwick tree over timestamps
+    size_t now;                       // latest timestamp handed out
+
+    size_t* histogram;  // references per scaled distance, last is "too far"
+    size_t max_size;
+
+    uint64_t sample_threshold;
+    double sample_rate;
+
+    size_t references;   // every reference seen
+    size_t sampled;      // references that passed the sampling filter
+    size_t cold_misses;  // first references to a key
+} Profiler;
+
+
+void treeAdd(Profiler* prof, size_t index, long delta) {
+    for (; index <= TREE_SIZE; index += index & -index)
+        prof->tree[index] += delta;
+}
+
+long treeSum(const Profiler* prof, size_t index) {
+    long sum = 0;
+    for (; index > 0; index -= index & -index)
+        sum += prof->tree[index];
+    return sum;
+}
+
+// Renumber the live timestamps as 1..k, keeping their order, so the tree
+// never needs more slots than there are distinct keys
+void compactTimestamps(Profiler* prof) {
+    size_t live = 0;
+
+    for (size_t time = 1; time <= prof->now; time++) {
+        size_t key = prof->key_at[time];
+        if (key == 0 || prof->last_access[key] != time)
+            continue;
+
+        live++;
+        prof->key_at[live]     = key;
+        prof->last_access[key] = live;
+    }
+
+    memset(prof->tree, 0, sizeof(prof->tree));
+    memset(prof->key_at + live + 1, 0,
+           (TREE_SIZE - live) * sizeof(prof->key_at[0]));
+
+    for (size_t time = 1; time <= live; time++)
+        treeAdd(prof, time, 1);
+
+    prof->now = live;
+}
+
+bool isSampled(const Profiler* prof, size_t key) {
+    uint64_t state = key;
+    return random_next(&state) % SAMPLE_MODULUS < prof->sample_threshold;
+}
+
+void recordReference(Profiler* prof, size_t key) {
+    prof->references++;
+
+    if (!isSampled(prof, key))
+        return;
+
+    prof->sampled++;
+
+    if (prof->now == TREE_SIZE)
+        compactTimestamps(prof);
+
+    size_t last = prof->last_access[key];
+    size_t time = ++prof->now;
+
+    if (last == 0) {
+        prof->cold_misses++;
+    } else {
+        long distance = treeSum(prof, time - 1) - treeSum(prof, last);
+        size_t scaled = (size_t)(distance / prof->sample_rate);
+
+        if (scaled > prof->max_size)
+            scaled = prof->max_size;
+        prof->histogram[scaled]++;
+
+        treeAdd(prof, last, -1);
+    }
+
+    treeAdd(prof, time, 1);
+    prof->key_at[time]     = key;
+    prof->last_access[key] = time;
+}
+
+// Returns false if the file could not be opened
+bool readTrace(Profiler* prof, const char* filename) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL)
+        return false;
+
+    char line[MAX_LINE_LENGTH];
+
+    while (fgets(line, MAX_LINE_LENGTH, file)) {
+        if (line[0] == '\n' || line[0] == '#')
+            continue;
+
+        long rod_length;
+        int write_state = writeInputToInt(line, &rod_length);
+
+        if (write_state != INPUT_OK)
+            printErr(write_state, line, MAX_LINE_LENGTH);
+        else
+            recordReference(prof, (size_t)rod_length);
+    }
+
+    fclose(file);
+    return true;
+}
+
+// With sampling, hot keys can make the sample larger or smaller than
+// references * rate. As in SHARDS_adj, the difference is credited to the
+// smallest distance, which is where the hot keys that caused it land
+void printCurve(const Profiler* prof) {
+    printf("cache_size,hit_ratio\n");
+
+    double expected = prof->references * prof->sample_rate;
+    double hits     = expected - (double)prof->sampled;
+
+    for (size_t size = 1; size <= prof->max_size; size++) {
+        hits += prof->histogram[size - 1];
+
+        double ratio = expected > 0 ? hits / expected : 0;
+        if (ratio < 0)
+            ratio = 0;
+        if (ratio > 1)
+            ratio = 1;
+        printf("%zu,%.6f\n", size, ratio);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    const char* trace_file = NULL;
+    const char* generate   = NULL;
+    size_t count           = DEFAULT_COUNT;
+    size_t gen_max_key     = DEFAULT_GEN_MAX_KEY;
+    size_t seed            = 1;
+    size_t max_size        = DEFAULT_MAX_SIZE;
+    double skew            = DEFAULT_SKEW;
+    double sample_rate     = 1.0;
+
+    for (int ix = 1; ix < argc; ix++) {
+        const char* value = NULL;
+        bool valid        = true;
+
+        if (matchFlag(argv[ix], "generate", &value))
+            valid = (generate = value) != NULL;
+        else if (matchFlag(argv[ix], "count", &value))
+            valid = parseSize(value, &count);
+        else if (matchFlag(argv[ix], "max-key", &value))
+            valid = parseSize(value, &gen_max_key) && gen_max_key > 0 &&
+                    gen_max_key <= MAX_KEY;
+        else if (matchFlag(argv[ix], "seed", &value))
+            valid = parseSize(value, &seed);
+        else if (matchFlag(argv[ix], "max-size", &value))
+            valid = parseSize(value, &max_size) && max_size > 0;
+        else if (matchFlag(argv[ix], "skew", &value))
+            valid = value != NULL && (skew = atof(value)) > 0;
+        else if (matchFlag(argv[ix], "sample", &value))
+            valid = value != NULL && (sample_rate = atof(value)) > 0 &&
+                    sample_rate <= 1;
+        else if (strncmp(argv[ix], "--", 2) != 0 && trace_file == NULL)
+            trace_file = argv[ix];
+        else
+            valid = false;
+
+        if (!valid) {
+            printErr(FLAG_INVALID, argv[ix], COMMAND_LINE_ARG_SIZE);
+            fprintf(stderr, USAGE_FMT, argv[0]);
+            return 1;
+        }
+    }
+
+    if ((trace_file == NULL) == (generate == NULL)) {
+        fprintf(stderr, USAGE_FMT, argv[0]);
+        return 1;
+    }
+
+    // the histogram has a slot past the largest size
+    size_t* histogram = max_size < SIZE_MAX / sizeof(size_t)
+                            ? calloc(max_size + 1, sizeof(size_t))
+                            : NULL;
+    if (histogram == NULL) {
+        fprintf(stderr, "Error: --max-size=%zu is too large\n", max_size);
+        return 1;
+    }
+
+    Profiler* prof         = calloc(1, sizeof(Profiler));
+    prof->max_size         = max_size;
+    prof->histogram        = histogram;
+    prof->sample_rate      = sample_rate;
+    prof->sample_threshold = (uint64_t)(sample_rate * SAMPLE_MODULUS);
+
+    int status             = 0;
+
+    if (trace_file != NULL) {
+        if (!readTrace(prof, trace_file)) {
+            printErr(FILE_INVALID, trace_file, COMMAND_LINE_ARG_SIZE);
+            status = 1;
+        }
+    } else {
+        WorkloadType type;
+        if (!parseWorkloadType(generate, &type)) {
+            printErr(FLAG_INVALID, generate, COMMAND_LINE_ARG_SIZE);
+            status = 1;
+        } else {
+            Workload load = new_workload(type, gen_max_key, skew, seed);
+            for (size_t ix = 0; ix < count; ix++)
+                recordReference(prof, workload_next(load));
+            workload_free(load);
+        }
+    }
+
+    if (status == 0) {
+        printCurve(prof);
+        fprintf(stderr,
+                "references: %zu, sampled: %zu, cold misses: %zu "
+                "(sample rate %g)\n",
+                prof->references, prof->sampled, prof->cold_misses,
+                sample_rate);
+    }
+
+    free(prof->histogram);
+    free(prof);
+    return status;
+}
@@ -0,0 +1,229 @@
+#include "pricetable.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "inputreader.h"
+#include "keypair.h"
+#include "rodcutsolver.h"
+
+#define MAX_ANSWER_CUTS 64  // more lines than fit in MAX_OUTPUT_LENGTH
+
+
+// Helper function for writePriceTable()
+// qsort() comparison, shortest length first
+int comparePairs(const void* first, const void* second) {
+    size_t first_key  = ((const KeyPair*)first)->key;
+    size_t second_key = ((const KeyPair*)second)->key;
+    return (first_key > second_key) - (first_key < second_key);
+}
+
+bool writePriceTable(const char* filename, const Vec length_prices) {
+    FILE* file = fopen(filename, "wb");
+    if (file == NULL)
+        return false;
+
+    size_t count = vec_length(length_prices);
+
+    // zeroed, so the padding in each pair is written as zeros too
+    KeyPair* pairs = calloc(count + 1, sizeof(KeyPair));
+
+    for (size_t ix = 0; ix < count; ix++) {
+        const KeyPair* pair = vec_get(length_prices, ix);
+        pairs[ix].key       = pair->key;
+        pairs[ix].value     = pair->value;
+    }
+    qsort(pairs, count, sizeof(KeyPair), comparePairs);
+
+    PriceTableHeader header = {PRICE_TABLE_MAGIC,
+                               fingerprintPrices(length_prices), count,
+                               sizeof(KeyPair)};
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(pairs, sizeof(KeyPair), count, file) == count;
+
+    ok      = fclose(file) == 0 && ok;
+
+    free(pairs);
+    return ok;
+}
+
+bool isPriceTableFile(const char* filename) {
+    struct stat info;
+    uint64_t magic = 0;
+
+    // tables are mapped, and reading a pipe here would eat its first line
+    if (stat(filename, &info) != 0 || !S_ISREG(info.st_mode))
+        return false;
+
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL)
+        return false;
+
+    bool read = fread(&magic, sizeof(magic), 1, file) == 1;
+    fclose(file);
+
+    return read && magic == PRICE_TABLE_MAGIC;
+}
+
+PriceTable openPriceTable(const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat info;
+    void* map = MAP_FAILED;
+
+    if (fstat(fd, &info) == 0 &&
+        (size_t)info.st_size >= sizeof(PriceTableHeader))
+        map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const PriceTableHeader* header = map;
+    const KeyPair* pairs           = (const KeyPair*)(header + 1);
+    size_t size                    = info.st_size;
+
+    bool valid = header->magic == PRICE_TABLE_MAGIC &&
+                 header->pair_size == sizeof(KeyPair) &&
+                 header->count <= size / sizeof(KeyPair) &&
+                 sizeof(PriceTableHeader) +
+                         header->count * sizeof(KeyPair) ==
+                     size;
+
+    // the solver relies on the order, and lookups on there being no dupes
+    for (size_t ix = 0; valid && ix < header->count; ix++)
+        valid = isLengthInRange(pairs[ix].key) &&
+                (ix == 0 || pairs[ix - 1].key < pairs[ix].key);
+
+    if (!valid) {
+        munmap(map, size);
+        return NULL;
+    }
+
+    PriceTable table   = malloc(sizeof(struct pricetable));
+    table->map         = map;
+    table->map_size    = size;
+    table->fingerprint = header->fingerprint;
+    table->prices = vec_wrap((void*)pairs, sizeof(KeyPair), header->count);
+    vec_index_keys(table->prices);
+
+    return table;
+}
+
+void closePriceTable(PriceTable table) {
+    vec_free(table->prices);
+    munmap(table->map, table->map_size);
+    free(table);
+}
+
+Vec loadPrices(const char* filename, bool log_lines, PriceTable* table) {
+    *table = NULL;
+
+    if (!isPriceTableFile(filename))
+        return loadPriceFile(filename, log_lines);
+
+    *table = openPriceTable(filename);
+    if (*table == NULL)
+        return NULL;
+
+    if (log_lines)
+        printf("Mapped %zu lengths\n", vec_length((*table)->prices));
+    return (*table)->prices;
+}
+
+void freePrices(Vec prices, PriceTable table) {
+    if (table != NULL)
+        closePriceTable(table);
+    else if (prices != NULL)
+        vec_free(prices);
+}
+
+
+// Helper function for comparePrices()
+// Writes what each length up to max_length is worth cutting into values[]
+void cutValues(const Vec prices, size_t max_length, int values[]) {
+    for (size_t ix = 0; ix < vec_length(prices); ix++) {
+        const KeyPair* pair = vec_get(prices, ix);
+
+        if (pair->key <= max_length && pair->value > 0)
+            values[pair->key] = pair->value;
+    }
+}
+
+// Helper function for comparePrices()
+// Returns the longest length in prices that a rod could be cut into
+size_t longestLength(const Vec prices) {
+    size_t longest = 0;
+
+    for (size_t ix = 0; ix < vec_length(prices); ix++) {
+        const KeyPair* pair = vec_get(prices, ix);
+
+        if (pair->key > longest && pair->key <= MAX_ROD_LENGTH)
+            longest = pair->key;
+    }
+    return longest;
+}
+
+PriceChanges comparePrices(const Vec old_prices, const Vec new_prices) {
+    size_t old_longest = longestLength(old_prices);
+    size_t new_longest = longestLength(new_prices);
+
+    PriceChanges changes  = malloc(sizeof(struct pricechanges));
+    changes->max_length   = old_longest > new_longest ? old_longest
+                                                      : new_longest;
+    changes->changed      = calloc(changes->max_length + 1, sizeof(bool));
+    changes->first_raised = SIZE_MAX;
+
+    int* old_values = calloc(changes->max_length + 1, sizeof(int));
+    int* new_values = calloc(changes->max_length + 1, sizeof(int));
+    cutValues(old_prices, changes->max_length, old_values);
+    cutValues(new_prices, changes->max_length, new_values);
+
+    for (size_t length = changes->max_length; length > 0; length--) {
+        changes->changed[length] = old_values[length] != new_values[length];
+
+        if (new_values[length] > old_values[length])
+            changes->first_raised = length;
+    }
+
+    free(old_values);
+    free(new_values);
+    return changes;
+}
+
+void freePriceChanges(PriceChanges changes) {
+    free(changes->changed);
+    free(changes);
+}
+
+bool isAnswerStale(const PriceChanges changes, size_t rod_length,
+                   const char* answer) {
+    // a dearer length may now make a better plan than any cut before
+    if (answer == NULL || rod_length >= changes->first_raised)
+        return true;
+
+    SolutionCut cuts[MAX_ANSWER_CUTS];
+    size_t remainder;
+    int count = parseSolution(answer, cuts, MAX_ANSWER_CUTS, &remainder);
+    if (count < 0)
+        return true;
+
+    size_t cut_length = 0;
+
+    for (int ix = 0; ix < count; ix++) {
+        if (cuts[ix].length > changes->max_length ||
+            changes->changed[cuts[ix].length])
+            return true;
+        cut_length += (size_t)cuts[ix].length * cuts[ix].count;
+    }
+
+    // lines left out of a long answer may have cut anything
+    return cut_length + remainder != rod_length;
+}
@@ -0,0 +1,82 @@
+#ifndef PRICETABLE_H
+#define PRICETABLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "vec.h"
+
+/*
+** Binary price tables, converted once from a text price file.
+**
+** File layout: a PriceTableHeader, then one KeyPair for every priced length,
+** sorted by length with no duplicates, exactly as a Vec holds them. The file
+** is mapped and wrapped in a Vec as it is, so nothing is parsed or copied,
+** and the fingerprint is the one fingerprintPrices() gave the text file.
+*/
+
+#define PRICE_TABLE_MAGIC 0x3153454349525052ULL  // "RPRICES1"
+
+typedef struct pricetableheader {
+    uint64_t magic;
+    uint64_t fingerprint;  // fingerprintPrices() of the prices
+    uint64_t count;        // KeyPairs after the header
+    uint64_t pair_size;    // sizeof(KeyPair) of the writer
+} PriceTableHeader;
+
+typedef struct pricetable {
+    void* map;
+    size_t map_size;
+    uint64_t fingerprint;
+    Vec prices;  // wraps the mapped pairs
+} *PriceTable;
+
+
+// Writes the prices, sorted by length, to filename
+// Returns false if the file could not be written
+bool writePriceTable(const char* filename, const Vec length_prices);
+
+// Returns true if filename is a regular file that starts like a binary
+// price table
+bool isPriceTableFile(const char* filename);
+
+// Maps a table file. Returns NULL if it is missing or malformed: wrongly
+// sized, unsorted, or with a length out of range
+PriceTable openPriceTable(const char* filename);
+
+void closePriceTable(PriceTable table);
+
+// Reads prices from a file in either format: a binary table is mapped, and
+// *table set to close once the prices are no longer used; a text file is
+// parsed by loadPriceFile() and *table set to NULL
+// Returns NULL if the file cannot be read
+Vec loadPrices(const char* filename, bool log_lines, PriceTable* table);
+
+// Frees prices returned by loadPrices()
+void freePrices(Vec prices, PriceTable table);
+
+
+// What replacing one set of prices with another changed, for telling which
+// answers solved for the old prices still hold
+typedef struct pricechanges {
+    size_t max_length;    // longest length priced in either, up to a rod
+    bool* changed;        // by length: worth a different amount to cut
+    size_t first_raised;  // shortest length worth more now, SIZE_MAX if none
+} *PriceChanges;
+
+// Compares the prices answers were solved for with the ones replacing them.
+// A length priced at 0 or less, or not at all, is worth nothing to cut
+PriceChanges comparePrices(const Vec old_prices, const Vec new_prices);
+
+void freePriceChanges(PriceChanges changes);
+
+// Returns false only if answer, solved for rod_length with the old prices,
+// is still a best answer with the new ones: every length it cuts kept its
+// price, so it is worth what it was, and no length that fits in rod_length
+// got dearer, so no other plan is worth more than it was. Where plans tie,
+// solving again may pick another worth the same
+bool isAnswerStale(const PriceChanges changes, size_t rod_length,
+                   const char* answer);
+
+#endif
@@ -0,0 +1,642 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "hash.h"
+#include "instrument.h"
+#include "singleflight.h"
+#include "snapshot.h"
+#include "trace.h"
+
+/* Robin Hood: one flat open-addressing table, values inline */
+
+/*
+** Each entry is one 128-byte slot of a cache-line-aligned table, holding its
+** key, its probe distance and, for values shorter than INLINE_LENGTH, the
+** value itself. A hit reads one slot and copies the value out of it: two
+** cache lines, with no node or string to chase. Longer values are kept out
+** of line and cost one more pointer.
+**
+** Robin Hood insertion keeps probe sequences short: an entry further from
+** its home slot takes the place of one that is nearer to its own, and
+** lookups stop as soon as they pass an entry nearer than they are. Removal
+** shifts the entries after it back one slot, so there are no tombstones.
+** The table is kept at most half full, and rebuilt when the capacity grows.
+**
+** Eviction is CLOCK over the table: a hit sets an entry's referenced bit,
+** and the hand clears bits until it finds an entry without one.
+*/
+
+#define MAX_KEY UINT32_MAX
+#define CACHE_SIZE 50      // default capacity
+#define MAX_CAPACITY 4096  // most entries set_capacity() can allow
+
+#define SLOT_SIZE 128
+#define INLINE_LENGTH (SLOT_SIZE - 8)  // longest inline value, with its NUL
+
+#define EMPTY 0  // distance of an empty slot, the home slot is 1
+
+#define REFERENCED 0x1   // CLOCK bit, set on every hit
+#define PREFETCHED 0x2   // inserted ahead of any request, and not used since
+#define OUT_OF_LINE 0x4  // value.pointer holds the value
+#define KEY_ONLY 0x8     // no value at all, as a shadow keeps
+
+typedef struct slot {
+    uint32_t key;
+    uint8_t distance;  // 1 + probes from the home slot, EMPTY if unused
+    uint8_t flags;
+    uint16_t length;
+    union {
+        char text[INLINE_LENGTH];
+        char* pointer;
+    } value;
+} Slot;
+
+_Static_assert(sizeof(Slot) == SLOT_SIZE, "a slot is two cache lines");
+
+Slot* table        = NULL;  // CACHE_LINE aligned, a power of two of slots
+size_t table_mask  = 0;     // slots - 1
+size_t used        = 0;     // entries in the table
+size_t capacity    = CACHE_SIZE;
+size_t clock_hand  = 0;
+KeyType last_prefetched = MAX_KEY + 1ULL;  // none yet
+
+int cache_requests;
+int cache_hits;
+int cache_misses;
+int cache_evictions;
+int cache_prefetched;
+int cache_prefetch_hits;
+int cache_coalesced;
+
+// every function called from outside holds this while it works
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+Flights flights            = NULL;  // misses being computed right now
+
+// each thread's copy of the value it was last given
+__thread char* returned_value = NULL;
+__thread size_t returned_size = 0;
+pthread_key_t returned_key;  // frees the copy when its thread exits
+
+ProviderFunction _downstream = NULL;
+Eviction_fptr eviction_handler = NULL;  // takes evicted values, if set
+
+
+// Fibonacci hashing spreads the dense keys over the whole table
+size_t home_of(uint32_t key) {
+    return fibonacci_hash(key, table_mask + 1);
+}
+
+// NULL for a key-only slot
+const char* slot_value(const Slot* slot) {
+    if (slot->flags & KEY_ONLY)
+        return NULL;
+    return slot->flags & OUT_OF_LINE ? slot->value.pointer : slot->value.text;
+}
+
+// An allocated copy of the slot's value, or its out of line value itself.
+// Clear OUT_OF_LINE afterwards, the slot no longer owns it
+ValueType slot_take_value(Slot* slot) {
+    if (slot->flags & KEY_ONLY)
+        return NULL;
+    if (slot->flags & OUT_OF_LINE)
+        return slot->value.pointer;
+    return strndup(slot->value.text, slot->length);
+}
+
+void slot_clear(Slot* slot) {
+    if (slot->flags & OUT_OF_LINE)
+        free(slot->value.pointer);
+    slot->distance = EMPTY;
+    slot->flags    = 0;
+}
+
+
+// Allocates an empty table of at least twice as many slots as limit
+void _make_table(size_t limit) {
+    size_t slots = 1;
+    while (slots < 2 * limit)
+        slots <<= 1;
+
+    table      = aligned_alloc(64, slots * sizeof(Slot));
+    table_mask = slots - 1;
+    clock_hand = 0;
+
+    for (size_t ix = 0; ix < slots; ix++) {
+        table[ix].distance = EMPTY;
+        table[ix].flags    = 0;
+    }
+}
+
+
+void initialize(void) {
+    DEBUG_PRINT(__FILE__ " initialize()\n");
+    pthread_key_create(&returned_key, free);
+
+    cache_requests      = 0;
+    cache_hits          = 0;
+    cache_misses        = 0;
+    cache_evictions     = 0;
+    cache_prefetched    = 0;
+    cache_prefetch_hits = 0;
+    cache_coalesced     = 0;
+
+    used     = 0;
+    capacity = CACHE_SIZE;
+    flights  = new_flights(&cache_lock);
+    _make_table(capacity);
+}
+
+
+void cleanup(void) {
+    DEBUG_PRINT(__FILE__ " cleanup()\n");
+
+    pthread_mutex_lock(&cache_lock);
+
+    if (table != NULL) {
+        for (size_t ix = 0; ix <= table_mask; ix++)
+            if (table[ix].distance != EMPTY)
+                slot_clear(&table[ix]);
+        free(table);
+        table = NULL;
+    }
+    used = 0;
+
+    if (flights != NULL) {
+        flights_free(flights);
+        flights = NULL;
+    }
+
+    free(returned_value);
+    returned_value = NULL;
+    returned_size  = 0;
+    pthread_key_delete(returned_key);
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+void reset_statistics(void) {
+    DEBUG_PRINT(__FILE__ " reset_statistics()\n");
+    pthread_mutex_lock(&cache_lock);
+    cache_requests      = 0;
+    cache_hits          = 0;
+    cache_misses        = 0;
+    cache_evictions     = 0;
+    cache_prefetched    = 0;
+    cache_prefetch_hits = 0;
+    cache_coalesced     = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+CacheStat* statistics(void) {
+    DEBUG_PRINT(__FILE__ " statistics()\n");
+
+    CacheStat* stats_cache = malloc(10 * sizeof(CacheStat));
+
+    pthread_mutex_lock(&cache_lock);
+    stats_cache[0] = (CacheStat){Cache_requests, cache_requests};
+    stats_cache[1] = (CacheStat){Cache_hits, cache_hits};
+    stats_cache[2] = (CacheStat){Cache_misses, cache_misses};
+    stats_cache[3] = (CacheStat){Cache_evictions, cache_evictions};
+    stats_cache[4] = (CacheStat){Cache_size, used};
+    stats_cache[5] = (CacheStat){Cache_capacity, capacity};
+    stats_cache[6] = (CacheStat){Cache_prefetched, cache_prefetched};
+    stats_cache[7] = (CacheStat){Cache_prefetch_hits, cache_prefetch_hits};
+    stats_cache[8] = (CacheStat){Cache_coalesced, cache_coalesced};
+    stats_cache[9] = (CacheStat){END_OF_STATS, 0};
+    pthread_mutex_unlock(&cache_lock);
+
+    return stats_cache;
+}
+
+
+// Returns the slot holding key, or NULL
+Slot* _find(KeyType key) {
+    if (key > MAX_KEY)
+        return NULL;
+
+    size_t idx = home_of(key);
+
+    // an entry nearer its home than we are to ours means key is not here
+    for (uint8_t distance = 1; table[idx].distance >= distance; distance++) {
+        if (table[idx].key == key)
+            return &table[idx];
+        idx = (idx + 1) & table_mask;
+    }
+    return NULL;
+}
+
+
+// Empties the slot at idx and shifts the entries after it back into place
+void _remove_at(size_t idx) {
+    size_t next = (idx + 1) & table_mask;
+
+    slot_clear(&table[idx]);
+
+    while (table[next].distance > 1) {
+        table[idx] = table[next];
+        table[idx].distance--;
+        idx  = next;
+        next = (next + 1) & table_mask;
+    }
+    table[idx].distance = EMPTY;
+    table[idx].flags    = 0;
+    used--;
+}
+
+
+// Removes an entry chosen by CLOCK. The hand stays put, since the entry
+// shifted into its slot has not been looked at yet
+void _evict(void) {
+    INSTRUMENT_START(evict_timer);
+
+    while (true) {
+        Slot* slot = &table[clock_hand];
+
+        if (slot->distance != EMPTY && !(slot->flags & REFERENCED)) {
+            TRACE(TRACE_EVICT, slot->key, clock_hand);
+
+            if (eviction_handler != NULL) {
+                eviction_handler(slot->key, slot_take_value(slot));
+                slot->flags &= ~OUT_OF_LINE;
+            }
+            _remove_at(clock_hand);
+            cache_evictions++;
+            INSTRUMENT_STOP(STAGE_EVICT, evict_timer);
+            return;
+        }
+
+        slot->flags &= ~REFERENCED;
+        clock_hand = (clock_hand + 1) & table_mask;
+    }
+}
+
+
+// Places a filled-in slot, which must not be in the table yet
+void _place(Slot entry) {
+    size_t idx     = home_of(entry.key);
+    entry.distance = 1;
+
+    while (table[idx].distance != EMPTY) {
+        // the richer entry gives up its slot and moves on instead
+        if (table[idx].distance < entry.distance) {
+            Slot displaced = table[idx];
+            table[idx]     = entry;
+            entry          = displaced;
+        }
+        idx = (idx + 1) & table_mask;
+        entry.distance++;
+    }
+    table[idx] = entry;
+    used++;
+}
+
+
+// Stores value under key, evicting first if full. Takes ownership of value.
+// A NULL value keeps the key alone
+void _insert(KeyType key, ValueType value, uint8_t flags) {
+    if (key > MAX_KEY) {
+        free(value);
+        return;
+    }
+
+    if (used >= capacity)
+        _evict();
+
+    Slot entry;
+    entry.key    = key;
+    entry.flags  = flags;
+    entry.length = value ? strlen(value) : 0;
+
+    if (value == NULL)
+        entry.flags |= KEY_ONLY;
+    else if (entry.length < INLINE_LENGTH) {
+        memcpy(entry.value.text, value, entry.length + 1);
+        free(value);
+    } else {
+        entry.flags |= OUT_OF_LINE;
+        entry.value.pointer = value;
+    }
+
+    _place(entry);
+
+    // the entry may have been shifted on past others, so find where it went
+    TRACE(TRACE_INSERT, key, _find(key) - table);
+}
+
+
+// Moves every entry into a table sized for limit
+void _rebuild(size_t limit) {
+    Slot* old_table = table;
+    size_t old_mask = table_mask;
+
+    _make_table(limit);
+    used = 0;
+
+    for (size_t ix = 0; ix <= old_mask; ix++)
+        if (old_table[ix].distance != EMPTY)
+            _place(old_table[ix]);
+
+    free(old_table);
+}
+
+
+// Values are inline, so a byte budget is a number of slots
+void set_capacity(size_t min, size_t max, size_t byte_budget) {
+    DEBUG_PRINT(__FILE__ " set_capacity(%zu, %zu, %zu)\n", min, max,
+                byte_budget);
+
+    if (byte_budget > 0 && byte_budget / SLOT_SIZE < max)
+        max = byte_budget / SLOT_SIZE;
+    if (max < min)
+        max = min;
+    if (max > MAX_CAPACITY)
+        max = MAX_CAPACITY;
+    if (max < 1)
+        max = 1;
+
+    pthread_mutex_lock(&cache_lock);
+
+    capacity = max;
+    while (used > capacity)
+        _evict();
+
+    if (2 * capacity > table_mask + 1)
+        _rebuild(capacity);
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+// Copies value into the calling thread's own buffer
+ValueType _return_copy(const char* value, size_t length) {
+    if (value == NULL)
+        return NULL;
+
+    if (length + 1 > returned_size) {
+        returned_value = realloc(returned_value, length + 1);
+        returned_size  = length + 1;
+        pthread_setspecific(returned_key, returned_value);
+    }
+    return memcpy(returned_value, value, length + 1);
+}
+
+
+// Slots CLOCK would keep longest, the referenced ones, first
+size_t _hottest_first(Slot* slots[], size_t max) {
+    size_t count = 0;
+
+    for (int referenced = REFERENCED; referenced >= 0; referenced -= REFERENCED)
+        for (size_t ix = 0; ix <= table_mask && count < max; ix++)
+            if (table[ix].distance != EMPTY &&
+                (table[ix].flags & REFERENCED) == referenced)
+                slots[count++] = &table[ix];
+    return count;
+}
+
+
+bool save_snapshot(const char* path, uint64_t fingerprint) {
+    DEBUG_PRINT(__FILE__ " save_snapshot(%s)\n", path);
+
+    Slot* slots[MAX_CAPACITY];
+    KeyType keys[MAX_CAPACITY];
+    ValueType values[MAX_CAPACITY];
+
+    pthread_mutex_lock(&cache_lock);
+
+    size_t count = _hottest_first(slots, MAX_CAPACITY);
+    for (size_t ix = 0; ix < count; ix++) {
+        keys[ix]   = slots[ix]->key;
+        values[ix] = (ValueType)slot_value(slots[ix]);
+    }
+
+    bool saved = snapshot_write(path, fingerprint, keys, values, count);
+
+    pthread_mutex_unlock(&cache_lock);
+    return saved;
+}
+
+
+int load_snapshot(const char* path, uint64_t fingerprint) {
+    DEBUG_PRINT(__FILE__ " load_snapshot(%s)\n", path);
+
+    Snapshot snap = snapshot_open(path, fingerprint);
+    if (snap == NULL)
+        return -1;
+
+    pthread_mutex_lock(&cache_lock);
+
+    size_t count = snap->count < capacity ? snap->count : capacity;
+    int restored = 0;
+
+    for (size_t ix = 0; ix < count; ix++) {
+        KeyType key = snap->entries[ix].key;
+
+        if (_find(key) == NULL) {
+            _insert(key, snapshot_value(snap, ix), 0);
+            restored++;
+        }
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+
+    snapshot_close(snap);
+    return restored;
+}
+
+
+size_t export_entries(KeyType keys[], ValueType values[], size_t max) {
+    DEBUG_PRINT(__FILE__ " export_entries(%zu)\n", max);
+
+    Slot* slots[MAX_CAPACITY];
+
+    pthread_mutex_lock(&cache_lock);
+
+    size_t count = _hottest_first(slots, max < MAX_CAPACITY ? max
+                                                            : MAX_CAPACITY);
+    for (size_t ix = 0; ix < count; ix++) {
+        keys[ix]   = slots[ix]->key;
+        values[ix] = slot_take_value(slots[ix]);
+    }
+
+    // removing shifts slots, so the values are all taken first
+    for (size_t ix = 0; ix < count; ix++) {
+        Slot* slot = _find(keys[ix]);
+        slot->flags &= ~OUT_OF_LINE;
+        _remove_at(slot - table);
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+    return count;
+}
+
+
+size_t invalidate(Stale_fptr stale) {
+    DEBUG_PRINT(__FILE__ " invalidate()\n");
+
+    KeyType keys[MAX_CAPACITY];
+    size_t count = 0;
+
+    pthread_mutex_lock(&cache_lock);
+
+    for (size_t ix = 0; ix <= table_mask && count < MAX_CAPACITY; ix++)
+        if (table[ix].distance != EMPTY &&
+            stale(table[ix].key, slot_value(&table[ix])))
+            keys[count++] = table[ix].key;
+
+    // removing shifts slots, so the stale ones are all found first
+    for (size_t ix = 0; ix < count; ix++)
+        _remove_at(_find(keys[ix]) - table);
+
+    pthread_mutex_unlock(&cache_lock);
+    return count;
+}
+
+
+void set_eviction_handler(Eviction_fptr handler) {
+    DEBUG_PRINT(__FILE__ " set_eviction_handler()\n");
+    pthread_mutex_lock(&cache_lock);
+    eviction_handler = handler;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+void insert(KeyType key, ValueType value) {
+    pthread_mutex_lock(&cache_lock);
+
+    if (_find(key) != NULL)
+        free(value);  // already held
+    else
+        _insert(key, value, 0);
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+// Prefetched values go in unreferenced, so they are among the next CLOCK
+// picks. Once the table is full each takes the place of the one prefetched
+// before it, if still unused, and otherwise of the entry CLOCK picks
+void insert_many(const KeyType keys[], ValueType values[], size_t count) {
+    DEBUG_PRINT(__FILE__ " insert_many(%zu)\n", count);
+
+    pthread_mutex_lock(&cache_lock);
+
+    for (size_t ix = 0; ix < count; ix++) {
+        if (keys[ix] > MAX_KEY || _find(keys[ix]) != NULL) {
+            free(values[ix]);
+            continue;
+        }
+
+        Slot* unused = used >= capacity ? _find(last_prefetched) : NULL;
+        if (unused != NULL && (unused->flags & PREFETCHED))
+            _remove_at(unused - table);
+
+        _insert(keys[ix], values[ix], PREFETCHED);
+        last_prefetched = keys[ix];
+        cache_prefetched++;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+size_t admit_many(KeyType keys[], size_t count) {
+    size_t kept = 0;
+
+    pthread_mutex_lock(&cache_lock);
+
+    for (size_t ix = 0; ix < count; ix++)
+        if (keys[ix] <= MAX_KEY && _find(keys[ix]) == NULL)
+            keys[kept++] = keys[ix];
+
+    pthread_mutex_unlock(&cache_lock);
+    return kept;
+}
+
+
+// Computes a missed key with the lock released, unless another thread is
+// already computing it, in which case its result is waited for
+// Takes the lock held and returns with it held
+ValueType _provide_missed(Vec lengths, KeyType key) {
+    Flight flight = flights_wait(flights, key);
+
+    if (flight != NULL) {
+        cache_coalesced++;
+        ValueType result = flight->value
+                               ? _return_copy(flight->value,
+                                              strlen(flight->value))
+                               : NULL;
+        flight_leave(flight);
+        return result;
+    }
+
+    flight = flights_start(flights, key);
+    pthread_mutex_unlock(&cache_lock);
+
+    INSTRUMENT_START(downstream_timer);
+    ValueType result = (*_downstream)(lengths, key);
+    INSTRUMENT_STOP(STAGE_DOWNSTREAM, downstream_timer);
+
+    pthread_mutex_lock(&cache_lock);
+    INSTRUMENT_START(insert_timer);
+
+    ValueType returned = result ? _return_copy(result, strlen(result)) : NULL;
+
+    // it may have been published or inserted while unlocked
+    if (_find(key) != NULL)
+        free(result);
+    else
+        _insert(key, result, 0);
+
+    INSTRUMENT_STOP(STAGE_INSERT, insert_timer);
+
+    flights_land(flights, flight, returned);
+    return returned;
+}
+
+
+// used externally but not referenced externally --
+// only by the set_provider function
+ValueType _caching_provider(Vec lengths, KeyType key) {
+    pthread_mutex_lock(&cache_lock);
+    cache_requests++;
+
+    INSTRUMENT_START(lookup_timer);
+    Slot* slot = _find(key);
+
+    TRACE(slot != NULL ? TRACE_PRESENT : TRACE_ABSENT, key,
+          slot != NULL ? (size_t)(slot - table) : TRACE_NO_SLOT);
+
+    if (slot != NULL) {
+        cache_hits++;
+
+        if (slot->flags & PREFETCHED)
+            cache_prefetch_hits++;
+        slot->flags = (slot->flags & ~PREFETCHED) | REFERENCED;
+
+        ValueType result = _return_copy(slot_value(slot), slot->length);
+        INSTRUMENT_STOP(STAGE_LOOKUP, lookup_timer);
+        pthread_mutex_unlock(&cache_lock);
+        return result;
+    }
+
+    cache_misses++;
+    INSTRUMENT_STOP(STAGE_LOOKUP, lookup_timer);
+    ValueType result = _provide_missed(lengths, key);
+
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+}
+
+
+ProviderFunction set_provider(ProviderFunction downstream) {
+    DEBUG_PRINT(__FILE__ " set_provider()\n");
+    _downstream = downstream;
+    return _caching_provider;
+}
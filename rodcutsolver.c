@@ -2,12 +2,31 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 
+#include "instrument.h"
 #include "keypair.h"
 #include "vec.h"
 
 const size_t MAX_OUTPUT_LENGTH = 256;
 
+#define MAX_PUBLISHED 64  // most sub-lengths published after a solve
+
+OutputAllocator output_allocator     = malloc;
+SolutionPublisher solution_publisher = NULL;
+PublishFilter publish_filter         = NULL;
+size_t publish_limit                 = 0;
+
+// One thread's scratch space: tables grown to the longest rod it has solved
+// and kept for the next solve
+typedef struct workspace {
+    int* max_profit;
+    size_t* cuts;
+    size_t capacity;  // entries in each table
+} Workspace;
+
+__thread Workspace workspace;
+
 
 // Helper function for solveRodCutting()
 // Returns a list of rod lengths and how many to cut
@@ -52,69 +71,130 @@ size_t calculateRemainder(const Vec cuts, size_t rod_length) {
 // Helper function for solveRodCutting()
 // Returns an allocated string of the rod cutting solution
 // Takes a list of lengths and prices, a list of cuts to make, the total profit,
-// and the remainder
+// the remainder, and what to allocate the string with
 // String will need to be freed by the caller
 char* getOutputStr(const Vec length_prices, const Vec cut_list, int profit,
-                   size_t remainder) {
-    char* output  = malloc(MAX_OUTPUT_LENGTH);
-    size_t offset = 0;  // Keeps track of end of string
+                   size_t remainder, OutputAllocator allocate) {
+    char* output = allocate(MAX_OUTPUT_LENGTH);
+    SolutionCut lines[vec_length(cut_list) + 1];
+    size_t line_count = 0;
 
-    output[0]     = '\0';
-
-    // Get each KeyPair in the cut_list vector and append its values
+    // Get each KeyPair in the cut_list vector and look up its price
     for (size_t ix = 0; ix < vec_length(cut_list); ix++) {
         const KeyPair* cut        = vec_get(cut_list, ix);
+        const KeyPair* price_pair = vec_find_pair(length_prices, cut->key);
 
-        const size_t length       = cut->key;
-        const int count           = cut->value;
+        if (price_pair != NULL)
+            lines[line_count++] = (SolutionCut){
+                cut->key, cut->value, cut->value * price_pair->value};
+    }
 
-        const KeyPair* price_pair = vec_find_pair(length_prices, length);
+    formatSolution(output, MAX_OUTPUT_LENGTH, lines, line_count, profit,
+                   remainder);
+    return output;
+}
 
-        if (price_pair != NULL) {
-            int price = price_pair->value;
-            int chars =
-                snprintf(output + offset, MAX_OUTPUT_LENGTH - offset,
-                         "%d @ %zu = %d\n", count, length, count * price);
+size_t formatSolution(char* output, size_t size, const SolutionCut cuts[],
+                      size_t cut_count, int profit, size_t remainder) {
+    char totals[MAX_OUTPUT_LENGTH];
+    int totals_len = snprintf(totals, sizeof(totals),
+                              "Remainder: %zu\n"
+                              "Value: %d\n",
+                              remainder, profit);
 
-            offset += chars;
+    // Keep room for the totals, they matter more than the last cut lines
+    size_t cuts_size = size > (size_t)totals_len ? size - totals_len : 1;
+    size_t offset    = 0;  // Keeps track of end of string
+
+    output[0]        = '\0';
+
+    for (size_t ix = 0; ix < cut_count; ix++) {
+        int chars = snprintf(output + offset, cuts_size - offset,
+                             "%d @ %u = %d\n", (int)cuts[ix].count,
+                             cuts[ix].length, cuts[ix].value);
+
+        if (chars < 0 || (size_t)chars >= cuts_size - offset) {
+            output[offset] = '\0';
+            break;
         }
+        offset += chars;
     }
 
-    snprintf(output + offset, MAX_OUTPUT_LENGTH - offset,
-             "Remainder: %zu\n"
-             "Value: %d\n",
-             remainder, profit);
-
-    return output;
+    int chars = snprintf(output + offset, size - offset, "%s", totals);
+    offset += (size_t)chars < size - offset ? (size_t)chars : size - offset - 1;
+    return offset;
 }
 
-char* solveRodCutting(const Vec length_prices, size_t rod_length) {
-    const size_t arr_size = rod_length + 1;
-    int prices[arr_size];
-    int max_profit[arr_size];
-    size_t cuts[arr_size];
-
-    // Initialize elements of arrays
-    for (size_t ix = 0; ix < arr_size; ix++) {
-        prices[ix]     = 0;
-        max_profit[ix] = 0;
-        cuts[ix]       = 0;
+int parseSolution(const char* text, SolutionCut cuts[], size_t max_cuts,
+                  size_t* remainder) {
+    size_t count = 0;
+    int pieces, value, used;
+    unsigned length;
+
+    while (sscanf(text, "%d @ %u = %d%n", &pieces, &length, &value, &used) ==
+           3) {
+        if (count == max_cuts || pieces < 0)
+            return -1;
+
+        cuts[count++] = (SolutionCut){length, pieces, value};
+        text += used;
+        text += *text == '\n';
     }
-    // Set length prices. Each index in prices[] corresponds to a length
-    for (size_t iy = 0; iy < vec_length(length_prices); iy++) {
-        KeyPair* pair = vec_get(length_prices, iy);
-        if (pair->key < arr_size)
-            prices[pair->key] = pair->value;
+
+    if (sscanf(text, "Remainder: %zu", remainder) != 1)
+        return -1;
+    return (int)count;
+}
+
+// Helper function for fillRodCutting()
+// qsort() comparison, shortest length first
+int compareLengths(const void* first, const void* second) {
+    size_t first_key  = ((const KeyPair*)first)->key;
+    size_t second_key = ((const KeyPair*)second)->key;
+    return (first_key > second_key) - (first_key < second_key);
+}
+
+void fillRodCutting(const Vec length_prices, size_t max_length,
+                    int max_profit[], size_t cuts[]) {
+    // Sorted, so the loop below tries lengths in the same order as scanning
+    // every length would. Prices already sorted, as a mapped price table's
+    // are, are read where they are; others are sorted into a copy
+    const KeyPair* priced = vec_items(length_prices);
+    size_t price_count    = vec_length(length_prices);
+    KeyPair* sorted       = NULL;
+
+    if (!vec_keys_sorted(length_prices)) {
+        sorted      = malloc((price_count + 1) * sizeof(KeyPair));
+        price_count = 0;
+
+        for (size_t iy = 0; iy < vec_length(length_prices); iy++) {
+            KeyPair* pair = vec_get(length_prices, iy);
+            if (pair->value > 0 && pair->key <= max_length)
+                sorted[price_count++] = *pair;
+        }
+        qsort(sorted, price_count, sizeof(KeyPair), compareLengths);
+        priced = sorted;
     }
 
+    max_profit[0] = 0;
+    cuts[0]       = 0;
+
     // Algorithm to solve rod cutting problem
-    for (size_t first_cut = 1; first_cut <= rod_length; first_cut++) {
-        int curr_max = 0;
-        int best_cut = 0;
+    for (size_t first_cut = 1; first_cut <= max_length; first_cut++) {
+        int curr_max    = 0;
+        size_t best_cut = 0;
+
+        for (size_t ix = 0; ix < price_count; ix++) {
+            const size_t sub_cut = priced[ix].key;
+            if (sub_cut > first_cut)
+                break;
+
+            // only positively priced lengths can be cut
+            if (priced[ix].value <= 0)
+                continue;
 
-        for (size_t sub_cut = 1; sub_cut <= first_cut; sub_cut++) {
-            int profit = prices[sub_cut] + max_profit[first_cut - sub_cut];
-            if (prices[sub_cut] > 0 && profit > curr_max) {
+            int profit = priced[ix].value + max_profit[first_cut - sub_cut];
+            if (profit > curr_max) {
                 curr_max = profit;
                 best_cut = sub_cut;
             }
@@ -123,12 +203,112 @@ char* solveRodCutting(const Vec length_prices, size_t rod_length) {
         cuts[first_cut]       = best_cut;
     }
 
+    free(sorted);
+}
+
+RodCutTable solveAllLengths(const Vec length_prices, size_t max_length) {
+    RodCutTable table = malloc(sizeof(struct rodcuttable));
+    table->max_length = max_length;
+    table->max_profit = malloc((max_length + 1) * sizeof(int));
+    table->cuts       = malloc((max_length + 1) * sizeof(size_t));
+
+    fillRodCutting(length_prices, max_length, table->max_profit, table->cuts);
+    return table;
+}
+
+void freeRodCutTable(RodCutTable table) {
+    free(table->max_profit);
+    free(table->cuts);
+    free(table);
+}
+
+// Helper function for solveRodCutting()
+// Returns an allocated string of the solution for rod_length, read from
+// tables filled by fillRodCutting()
+char* formatFromTables(const Vec length_prices, size_t rod_length,
+                       const int max_profit[], const size_t cuts[],
+                       OutputAllocator allocate) {
+    INSTRUMENT_START(cut_timer);
     const Vec cut_list     = createCutList(rod_length, cuts);
     const int profit       = max_profit[rod_length];
     const size_t remainder = calculateRemainder(cut_list, rod_length);
+    INSTRUMENT_STOP(STAGE_CUT_LIST, cut_timer);
 
-    char* output = getOutputStr(length_prices, cut_list, profit, remainder);
+    INSTRUMENT_START(format_timer);
+    char* output =
+        getOutputStr(length_prices, cut_list, profit, remainder, allocate);
+    INSTRUMENT_STOP(STAGE_FORMAT, format_timer);
 
     vec_free(cut_list);
     return output;
 }
+
+void setOutputAllocator(OutputAllocator allocator) {
+    output_allocator = allocator ? allocator : malloc;
+}
+
+char* allocateOutput(void) {
+    return output_allocator(MAX_OUTPUT_LENGTH);
+}
+
+void setSolutionPublisher(SolutionPublisher publisher, PublishFilter filter,
+                          size_t max_count) {
+    solution_publisher = publisher;
+    publish_filter     = filter;
+    publish_limit      = max_count < MAX_PUBLISHED ? max_count : MAX_PUBLISHED;
+}
+
+// Helper function for solveRodCutting()
+// Publishes what is left of rod_length after each of its cuts, longest
+// first: the lengths its own answer is made of
+void publishSubLengths(const Vec length_prices, size_t rod_length,
+                       const Workspace* ws) {
+    size_t lengths[MAX_PUBLISHED];
+    char* solutions[MAX_PUBLISHED];
+    size_t count  = 0;
+    size_t length = rod_length;
+
+    while (count < publish_limit && ws->cuts[length] > 0 &&
+           ws->cuts[length] < length) {
+        length -= ws->cuts[length];
+        lengths[count++] = length;
+    }
+
+    // nothing is formatted for lengths the cache would not take
+    if (count > 0 && publish_filter != NULL)
+        count = publish_filter(lengths, count);
+
+    // the publisher may hand them to a cache other than ours
+    for (size_t ix = 0; ix < count; ix++)
+        solutions[ix] = formatFromTables(length_prices, lengths[ix],
+                                         ws->max_profit, ws->cuts, malloc);
+
+    if (count > 0)
+        solution_publisher(lengths, solutions, count);
+}
+
+char* solveRodCutting(const Vec length_prices, size_t rod_length) {
+    Workspace* ws = &workspace;
+
+    if (rod_length + 1 > ws->capacity) {
+        ws->capacity   = rod_length + 1;
+        ws->max_profit = realloc(ws->max_profit, ws->capacity * sizeof(int));
+        ws->cuts       = realloc(ws->cuts, ws->capacity * sizeof(size_t));
+    }
+
+    INSTRUMENT_START(dp_timer);
+    fillRodCutting(length_prices, rod_length, ws->max_profit, ws->cuts);
+    INSTRUMENT_STOP(STAGE_DP, dp_timer);
+
+    if (solution_publisher != NULL)
+        publishSubLengths(length_prices, rod_length, ws);
+
+    return formatFromTables(length_prices, rod_length, ws->max_profit,
+                            ws->cuts, output_allocator);
+}
+
+void freeSolverWorkspace(void) {
+    free(workspace.max_profit);
+    free(workspace.cuts);
+    workspace = (Workspace){0};
+}
@@ -1,16 +1,84 @@
 #ifndef RODCUTSOLVER_H
 #define RODCUTSOLVER_H
 
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "vec.h"
 
 extern const size_t MAX_OUTPUT_LENGTH;
 
+// One line of a solution: count pieces of a length, worth value in total
+typedef struct solutioncut {
+    uint32_t length;
+    uint32_t count;
+    int32_t value;
+} SolutionCut;
+
+// Best profit and first cut for every rod length from 0 to max_length
+typedef struct rodcuttable {
+    size_t max_length;
+    int* max_profit;
+    size_t* cuts;  // 0 if nothing can be cut from that length
+} *RodCutTable;
+
+
+// Returns memory for a solution of size bytes, like malloc()
+typedef void* (*OutputAllocator)(size_t size);
+
+// Takes ownership of count allocated solutions, one for each length
+typedef void (*SolutionPublisher)(const size_t lengths[], char* solutions[],
+                                  size_t count);
+
+// Keeps in lengths, in order, the count lengths whose solutions would be
+// taken, and returns how many
+typedef size_t (*PublishFilter)(size_t lengths[], size_t count);
+
 
 // Returns an allocated string of the solution to the rod cutting problem
 // Takes a list of possible lengths and prices, and a rod length to cut
 // Returned string will need to be freed by the caller
 char* solveRodCutting(const Vec length_prices, size_t rod_length);
 
+// Each thread solves in a workspace of its own, kept between solves. Threads
+// that call solveRodCutting() call this before they exit
+void freeSolverWorkspace(void);
+
+// Solutions returned by solveRodCutting() and solveFromTable() come from
+// allocator, such as the pool of the cache they are returned to. Published
+// solutions always come from malloc(). NULL goes back to malloc()
+void setOutputAllocator(OutputAllocator allocator);
+
+// Returns MAX_OUTPUT_LENGTH bytes from the output allocator
+char* allocateOutput(void);
+
+// After each solve, solveRodCutting() hands publisher the solutions of up to
+// max_count of the shorter lengths its answer is cut down through, longest
+// first. Only those filter keeps are formatted. A NULL publisher turns
+// this off
+void setSolutionPublisher(SolutionPublisher publisher, PublishFilter filter,
+                          size_t max_count);
+
+// Fills max_profit[] and cuts[] for every length from 0 to max_length
+// Runs in O(max_length * number of prices)
+void fillRodCutting(const Vec length_prices, size_t max_length,
+                    int max_profit[], size_t cuts[]);
+
+// Returns an allocated table of every answer up to max_length
+RodCutTable solveAllLengths(const Vec length_prices, size_t max_length);
+
+void freeRodCutTable(RodCutTable table);
+
+// Writes the solution text for a list of cuts into output, which holds size
+// bytes. Lines that don't fit are left out. Returns the length written
+size_t formatSolution(char* output, size_t size, const SolutionCut cuts[],
+                      size_t cut_count, int profit, size_t remainder);
+
+// Reads back text written by formatSolution(): up to max_cuts lines into
+// cuts[], and the remainder into *remainder. Lines left out stay out
+// Returns the number of lines read, or -1 if text is not a solution or has
+// more than max_cuts lines
+int parseSolution(const char* text, SolutionCut cuts[], size_t max_cuts,
+                  size_t* remainder);
+
 #endif
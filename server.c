@@ -0,0 +1,387 @@
+#define _GNU_SOURCE  // accept4()
+
+#include "server.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "inputreader.h"
+
+#define COMMAND_PREFIX '!'
+
+#define SERVER_BACKLOG 128
+#define SERVER_EVENTS 64              // events taken from epoll at once
+#define SERVER_INPUT_SIZE (1 << 16)   // bytes of a connection's unread lines
+#define SERVER_OUTPUT_LIMIT (1 << 20) // unsent answers before reading stops
+#define SERVER_ERROR_SIZE 256
+
+// One client. Lines are answered as they arrive, and the answers queued in
+// output until the socket takes them
+typedef struct connection {
+    int fd;
+    char* input;
+    size_t input_start;  // first byte not answered yet
+    size_t input_used;
+    bool skipping;       // in the ignored rest of a long line
+    bool hung_up;        // the client has sent all it will
+    char* output;
+    size_t output_start;  // first byte not sent yet
+    size_t output_used;
+    size_t output_capacity;
+    uint32_t events;  // what epoll watches the socket for
+    struct connection* prev;
+    struct connection* next;
+} Connection;
+
+typedef struct server {
+    int epoll_fd;
+    Connection listener;
+    Connection signals;  // SIGINT, SIGTERM and SIGHUP, read from a signalfd
+    Connection* open;    // every client connection
+    AnswerFunction answer;
+    ReloadFunction reload;
+    void* context;
+    size_t requests;
+    size_t connections;
+} Server;
+
+
+// Helper function for openSocket()
+// Returns true if address is all digits, and so a port
+bool isPort(const char* address) {
+    size_t port;
+    return parseSize(address, &port) && port > 0 && port <= 65535;
+}
+
+int openSocket(const char* address, bool listening) {
+    struct sockaddr_storage storage = {0};
+    socklen_t size;
+    int family;
+
+    if (isPort(address)) {
+        struct sockaddr_in* inet = (struct sockaddr_in*)&storage;
+        inet->sin_family         = AF_INET;
+        inet->sin_port           = htons(atoi(address));
+        inet->sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+        family                   = AF_INET;
+        size                     = sizeof(struct sockaddr_in);
+    } else {
+        struct sockaddr_un* local = (struct sockaddr_un*)&storage;
+        if (strlen(address) >= sizeof(local->sun_path))
+            return -1;
+
+        local->sun_family = AF_UNIX;
+        strcpy(local->sun_path, address);
+        family = AF_UNIX;
+        size   = sizeof(struct sockaddr_un);
+    }
+
+    int fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    bool ok;
+    if (listening) {
+        int on = 1;
+        if (family == AF_UNIX)
+            unlink(address);
+        else
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        ok = bind(fd, (struct sockaddr*)&storage, size) == 0 &&
+             listen(fd, SERVER_BACKLOG) == 0;
+    } else {
+        ok = connect(fd, (struct sockaddr*)&storage, size) == 0;
+    }
+
+    // answers are small, and should not wait for the next one to fill a packet
+    if (ok && family == AF_INET) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    if (!ok) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+// Registers or updates what epoll watches conn's socket for
+void watch(Server* server, Connection* conn, uint32_t events) {
+    if (events == conn->events)
+        return;
+
+    struct epoll_event event = {events, {.ptr = conn}};
+    epoll_ctl(server->epoll_fd, conn->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+              conn->fd, &event);
+    conn->events = events;
+}
+
+void closeConnection(Server* server, Connection* conn) {
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        server->open = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+
+    free(conn->input);
+    free(conn->output);
+    free(conn);
+}
+
+void acceptConnections(Server* server) {
+    int fd;
+
+    while ((fd = accept4(server->listener.fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        Connection* conn = calloc(1, sizeof(Connection));
+        conn->fd         = fd;
+        conn->input      = malloc(SERVER_INPUT_SIZE);
+        conn->next       = server->open;
+        if (server->open != NULL)
+            server->open->prev = conn;
+        server->open = conn;
+        server->connections++;
+
+        watch(server, conn, EPOLLIN);
+    }
+}
+
+
+void queueOutput(Connection* conn, const char* text, size_t length) {
+    if (conn->output_used + length > conn->output_capacity) {
+        conn->output_capacity = 2 * (conn->output_used + length);
+        conn->output = realloc(conn->output, conn->output_capacity);
+    }
+    memcpy(conn->output + conn->output_used, text, length);
+    conn->output_used += length;
+}
+
+// Queues the answer to one line. Only the first BUFFER_SIZE - 1 characters
+// of a line count, as in processLengths()
+void answerLine(Server* server, Connection* conn, const char* text,
+                size_t length) {
+    char line[BUFFER_SIZE];
+    if (length > BUFFER_SIZE - 1)
+        length = BUFFER_SIZE - 1;
+    memcpy(line, text, length);
+    line[length] = '\0';
+
+    long rod_length;
+    int write_state = line[0] == COMMAND_PREFIX
+                          ? COMMAND_NOT_SERVED
+                          : writeInputToInt(line, &rod_length);
+
+    server->requests++;
+
+    if (write_state != INPUT_OK) {
+        char message[SERVER_ERROR_SIZE];
+        FILE* to = fmemopen(message, sizeof(message), "w");
+
+        fprintErr(to, write_state, line, BUFFER_SIZE);
+        size_t written = ftell(to);
+        fclose(to);
+
+        queueOutput(conn, message, written);
+        queueOutput(conn, "\n", 1);
+        return;
+    }
+
+    CacheValue value = server->answer(server->context, rod_length);
+    queueOutput(conn, value->text, value->length);
+    queueOutput(conn, "\n", 1);
+    cache_value_release(value);
+}
+
+// Answers the complete lines read so far, until there is too much output
+// waiting for the client to take
+// Returns true if it stopped there, with lines perhaps left to answer
+bool answerLines(Server* server, Connection* conn) {
+    char* end = conn->input + conn->input_used;
+    char* line;
+    char* eol;
+
+    while (true) {
+        if (conn->output_used - conn->output_start >= SERVER_OUTPUT_LIMIT)
+            return true;
+
+        line = conn->input + conn->input_start;
+        eol  = memchr(line, '\n', end - line);
+        if (eol == NULL)
+            break;
+
+        if (!conn->skipping)
+            answerLine(server, conn, line, eol - line);
+        conn->skipping    = false;
+        conn->input_start = eol + 1 - conn->input;
+    }
+
+    // a line too long to count in full is answered on what there is of it,
+    // and the last line may have no newline
+    size_t kept = conn->skipping ? 0 : end - line;
+    if (kept >= BUFFER_SIZE - 1 || (conn->hung_up && kept > 0)) {
+        answerLine(server, conn, line, kept);
+        conn->skipping = true;
+        kept           = 0;
+    }
+
+    memmove(conn->input, end - kept, kept);
+    conn->input_start = 0;
+    conn->input_used  = kept;
+    return false;
+}
+
+// Returns false if the connection failed
+bool sendOutput(Connection* conn) {
+    while (conn->output_start < conn->output_used) {
+        ssize_t sent = send(conn->fd, conn->output + conn->output_start,
+                            conn->output_used - conn->output_start,
+                            MSG_NOSIGNAL);
+        if (sent < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+        conn->output_start += sent;
+    }
+
+    conn->output_start = 0;
+    conn->output_used  = 0;
+    return true;
+}
+
+void serviceConnection(Server* server, Connection* conn, uint32_t events) {
+    if (events & EPOLLIN) {
+        ssize_t got = read(conn->fd, conn->input + conn->input_used,
+                           SERVER_INPUT_SIZE - conn->input_used);
+        if (got > 0)
+            conn->input_used += got;
+        else if (got == 0 || (errno != EAGAIN && errno != EINTR))
+            conn->hung_up = true;
+    }
+
+    // lines left at the output limit are answered as soon as the socket has
+    // taken it all, or else when it can take more
+    bool stopped, waiting;
+    do {
+        stopped = answerLines(server, conn);
+
+        if (!sendOutput(conn) || (events & EPOLLERR)) {
+            closeConnection(server, conn);
+            return;
+        }
+        waiting = conn->output_start < conn->output_used;
+    } while (stopped && !waiting);
+
+    // everything sent was answered, and every answer has gone out
+    if (conn->hung_up && conn->input_used == 0 && !waiting) {
+        closeConnection(server, conn);
+        return;
+    }
+
+    bool room = conn->output_used - conn->output_start < SERVER_OUTPUT_LIMIT &&
+                conn->input_used < SERVER_INPUT_SIZE;
+
+    watch(server, conn,
+          (room && !conn->hung_up ? EPOLLIN : 0) | (waiting ? EPOLLOUT : 0));
+}
+
+
+// Reads a signal off the signalfd, reloading on SIGHUP
+// Returns false if it should stop the server
+bool takeSignal(Server* server) {
+    struct signalfd_siginfo info;
+    if (read(server->signals.fd, &info, sizeof(info)) != sizeof(info))
+        return true;
+
+    if (info.ssi_signo != SIGHUP)
+        return false;
+
+    server->reload(server->context);
+    fflush(stdout);
+    return true;
+}
+
+
+bool serveLengths(const char* address, AnswerFunction answer,
+                  ReloadFunction reload, void* context) {
+    Server server  = {0};
+    server.answer  = answer;
+    server.reload  = reload;
+    server.context = context;
+
+    server.listener.fd = openSocket(address, true);
+    if (server.listener.fd < 0)
+        return false;
+    fcntl(server.listener.fd, F_SETFL, O_NONBLOCK);
+
+    // the signals end the loop, so the cache is saved and cleaned up as ever,
+    // or reload between requests
+    sigset_t handled, previous;
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGINT);
+    sigaddset(&handled, SIGTERM);
+    if (reload != NULL)
+        sigaddset(&handled, SIGHUP);
+    sigprocmask(SIG_BLOCK, &handled, &previous);
+
+    server.signals.fd = signalfd(-1, &handled, SFD_CLOEXEC);
+    server.epoll_fd   = epoll_create1(EPOLL_CLOEXEC);
+    watch(&server, &server.listener, EPOLLIN);
+    watch(&server, &server.signals, EPOLLIN);
+
+    printf("Listening on '%s'\n", address);
+    fflush(stdout);
+
+    struct epoll_event events[SERVER_EVENTS];
+    bool running = true;
+
+    while (running) {
+        int count = epoll_wait(server.epoll_fd, events, SERVER_EVENTS, -1);
+        if (count < 0 && errno != EINTR)
+            break;
+
+        for (int ix = 0; ix < count; ix++) {
+            Connection* conn = events[ix].data.ptr;
+
+            if (conn == &server.listener)
+                acceptConnections(&server);
+            else if (conn == &server.signals)
+                running = takeSignal(&server);
+            else
+                serviceConnection(&server, conn, events[ix].events);
+        }
+    }
+
+    while (server.open != NULL)
+        closeConnection(&server, server.open);
+
+    close(server.epoll_fd);
+    close(server.signals.fd);
+    close(server.listener.fd);
+    if (!isPort(address))
+        unlink(address);
+    sigprocmask(SIG_SETMASK, &previous, NULL);
+
+    printf("Served %zu requests over %zu connections\n", server.requests,
+           server.connections);
+    return true;
+}
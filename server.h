@@ -0,0 +1,42 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "cache.h"
+
+/*
+** Socket server for main --server.
+**
+** Protocol: clients send rod lengths one per line, as --stream reads them,
+** and may send any number before reading an answer. Every line gets one
+** answer, in the order the lines were sent: the solution text, or a single
+** "Error: ..." line, followed by an empty line. Solutions never contain an
+** empty line, so that is where each answer ends. Lines starting with '!'
+** are answered with an error, commands are not run for clients.
+**
+** One thread serves every connection through an epoll loop, reading and
+** writing without blocking, so a slow client does not hold up the others.
+*/
+
+// Answers one length for the server, which releases the handle once the
+// answer has been copied out
+typedef CacheValue (*AnswerFunction)(void* context, size_t length);
+
+// Reloads whatever the answers come from, between requests
+typedef void (*ReloadFunction)(void* context);
+
+// Returns a socket for address: a port number for TCP on 127.0.0.1, or
+// otherwise the path of a UNIX domain socket. A listening UNIX socket
+// replaces any file at path
+// Returns -1 if it cannot be opened
+int openSocket(const char* address, bool listening);
+
+// Serves lengths on address until SIGINT or SIGTERM, and removes a UNIX
+// socket once done. SIGHUP calls reload, unless it is NULL
+// Returns false if address could not be listened on
+bool serveLengths(const char* address, AnswerFunction answer,
+                  ReloadFunction reload, void* context);
+
+#endif
@@ -0,0 +1,658 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "hash.h"
+#include "instrument.h"
+#include "singleflight.h"
+#include "slab.h"
+#include "snapshot.h"
+#include "trace.h"
+
+/* Set associative: hardware-style sets of ways, pseudo-LRU in each set */
+
+/*
+** A key hashes to one set of WAYS entries and can only live there. The
+** set's keys, value lengths and recency bits share one 64-byte line, and
+** its value pointers a second line, so a lookup reads one line and a hit
+** one more. The ways are compared all at once into a bit mask, with no
+** branch per way.
+**
+** Each set keeps its own tree pseudo-LRU: WAYS - 1 bits, one per node of a
+** binary tree over the ways, each pointing away from the half used last.
+** Following the bits from the root finds the victim. This is close to LRU
+** within the set, and there is no recency list shared by the whole cache.
+**
+** Sets are locked in stripes, so threads only contend when their keys
+** land in sets under the same lock. Capacity is whole sets, as many as it
+** takes to hold the entries asked for.
+*/
+
+#define MAX_KEY UINT32_MAX
+#define EMPTY_KEY 0        // keys of unused ways, rod lengths start at 1
+#define CACHE_SIZE 64      // default capacity
+#define MAX_CAPACITY 4096  // most entries set_capacity() can allow
+
+#define WAYS_LOG2 3  // 8 ways; 2 gives 4 ways
+#define WAYS (1 << WAYS_LOG2)
+#define ENTRY_BYTES 64  // a way's share of its two lines and a short value
+
+#define STRIPES 16  // locks over the sets, a power of two
+
+typedef struct set {
+    uint32_t keys[WAYS];  // EMPTY_KEY in unused ways
+    uint16_t lengths[WAYS];
+    uint8_t plru;        // tree bits, node n at bit n, set means go right
+    uint8_t prefetched;  // a bit per way inserted ahead of any request
+    uint8_t padding[CACHE_LINE - WAYS * 6 - 2];
+} Set;
+
+_Static_assert(sizeof(Set) == CACHE_LINE, "a set is one cache line");
+
+typedef struct stripe {
+    _Alignas(CACHE_LINE) pthread_mutex_t lock;  // over every set it indexes
+    Flights flights;  // misses being computed right now in those sets
+    size_t used;
+
+    int requests;
+    int hits;
+    int misses;
+    int evictions;
+    int prefetched;
+    int prefetch_hits;
+    int coalesced;
+} Stripe;
+
+Set* sets              = NULL;  // CACHE_LINE aligned
+char** values          = NULL;  // WAYS per set, also a line per set
+_Atomic size_t set_total = 0;   // sets, only changed with every lock held
+size_t capacity         = CACHE_SIZE;
+
+Stripe stripes[STRIPES];
+
+// each thread's copy of the value it was last given
+__thread char* returned_value = NULL;
+__thread size_t returned_size = 0;
+pthread_key_t returned_key;  // frees the copy when its thread exits
+
+ProviderFunction _downstream = NULL;
+Eviction_fptr eviction_handler = NULL;  // takes evicted values, if set
+
+
+// Fibonacci hashing spreads the dense keys over the sets
+size_t _set_of(KeyType key, size_t count) {
+    return fibonacci_hash(key, count);
+}
+
+// Sets under one stripe differ by a multiple of STRIPES, so a set is always
+// under the same lock, whatever the number of sets
+Stripe* _stripe_of(size_t set) {
+    return &stripes[set & (STRIPES - 1)];
+}
+
+// Locks the stripe of key's set and returns the set. The number of sets
+// cannot change while it is held
+size_t _lock_set(KeyType key) {
+    while (true) {
+        size_t count = atomic_load(&set_total);
+        size_t set   = _set_of(key, count);
+
+        pthread_mutex_lock(&_stripe_of(set)->lock);
+        if (atomic_load(&set_total) == count)
+            return set;
+        pthread_mutex_unlock(&_stripe_of(set)->lock);  // resized meanwhile
+    }
+}
+
+void _lock_all(void) {
+    for (size_t ix = 0; ix < STRIPES; ix++)
+        pthread_mutex_lock(&stripes[ix].lock);
+}
+
+void _unlock_all(void) {
+    for (size_t ix = STRIPES; ix-- > 0;)
+        pthread_mutex_unlock(&stripes[ix].lock);
+}
+
+
+// Bit w is set if way w holds key. Keys in a set are distinct, so at most
+// one bit is, and none for EMPTY_KEY
+unsigned _find(const Set* s, KeyType key) {
+    unsigned hits = 0;
+    for (unsigned way = 0; way < WAYS; way++)
+        hits |= (unsigned)(s->keys[way] == key) << way;
+    return hits & -(unsigned)(key != EMPTY_KEY);
+}
+
+unsigned _empty_ways(const Set* s) {
+    unsigned empty = 0;
+    for (unsigned way = 0; way < WAYS; way++)
+        empty |= (unsigned)(s->keys[way] == EMPTY_KEY) << way;
+    return empty;
+}
+
+// Points every node on the way's path away from it
+uint8_t _touch(uint8_t plru, unsigned way) {
+    unsigned node = 0;
+    for (int level = WAYS_LOG2 - 1; level >= 0; level--) {
+        unsigned right = (way >> level) & 1;
+        plru = (plru & ~(1u << node)) | (!right << node);
+        node = 2 * node + 1 + right;
+    }
+    return plru;
+}
+
+// The way the bits lead to from the root
+unsigned _victim(uint8_t plru) {
+    unsigned node = 0;
+    for (int level = 0; level < WAYS_LOG2; level++)
+        node = 2 * node + 1 + ((plru >> node) & 1);
+    return node - (WAYS - 1);
+}
+
+
+// Allocates empty sets, enough for limit entries, at least one
+void _make_table(size_t limit) {
+    size_t count = limit > WAYS ? (limit + WAYS - 1) / WAYS : 1;
+
+    sets   = aligned_alloc(CACHE_LINE, count * sizeof(Set));
+    values = aligned_alloc(CACHE_LINE, count * WAYS * sizeof(char*));
+    memset(sets, 0, count * sizeof(Set));
+    atomic_store(&set_total, count);
+}
+
+size_t _set_count(void) {
+    return atomic_load(&set_total);
+}
+
+
+// Removes the entry in the way, giving its value to the eviction handler
+// if there is one. Takes its stripe's lock held
+void _evict(size_t set, unsigned way) {
+    INSTRUMENT_START(evict_timer);
+    Set* s         = &sets[set];
+    Stripe* stripe = _stripe_of(set);
+    char** value   = &values[set * WAYS + way];
+
+    TRACE(TRACE_EVICT, s->keys[way], set * WAYS + way);
+
+    if (eviction_handler != NULL)
+        eviction_handler(s->keys[way], *value);
+    else
+        free(*value);
+
+    s->keys[way] = EMPTY_KEY;
+    s->prefetched &= ~(1u << way);
+    stripe->used--;
+    stripe->evictions++;
+    INSTRUMENT_STOP(STAGE_EVICT, evict_timer);
+}
+
+
+// Stores value under key in its set, evicting the pseudo-LRU way if the set
+// is full. A prefetched value evicts an unused prefetched way first, and
+// leaves the bits alone, so a full set's victim stays its way. Takes
+// ownership of value, and its stripe's lock held. A NULL value keeps the key
+// alone
+void _insert(size_t set, KeyType key, ValueType value, bool prefetched) {
+    size_t length = value != NULL ? strlen(value) : 0;
+
+    if (key == EMPTY_KEY || key > MAX_KEY || length > UINT16_MAX) {
+        free(value);
+        return;
+    }
+
+    Set* s         = &sets[set];
+    unsigned empty = _empty_ways(s);
+    unsigned way   = empty ? (unsigned)__builtin_ctz(empty)
+                     : prefetched && s->prefetched
+                         ? (unsigned)__builtin_ctz(s->prefetched)
+                         : _victim(s->plru);
+
+    if (!empty)
+        _evict(set, way);
+
+    s->keys[way]    = key;
+    s->lengths[way] = length;
+    s->plru         = prefetched ? s->plru : _touch(s->plru, way);
+    s->prefetched   = (s->prefetched & ~(1u << way)) | (prefetched << way);
+    values[set * WAYS + way] = value;
+    _stripe_of(set)->used++;
+
+    TRACE(TRACE_INSERT, key, set * WAYS + way);
+}
+
+
+void initialize(void) {
+    DEBUG_PRINT(__FILE__ " initialize()\n");
+    pthread_key_create(&returned_key, free);
+
+    for (size_t ix = 0; ix < STRIPES; ix++) {
+        Stripe* stripe = &stripes[ix];
+        memset(stripe, 0, sizeof(Stripe));
+        pthread_mutex_init(&stripe->lock, NULL);
+        stripe->flights = new_flights(&stripe->lock);
+    }
+
+    capacity = CACHE_SIZE;
+    _make_table(capacity);
+}
+
+
+void cleanup(void) {
+    DEBUG_PRINT(__FILE__ " cleanup()\n");
+
+    _lock_all();
+
+    if (sets != NULL) {
+        for (size_t ix = 0; ix < _set_count() * WAYS; ix++)
+            if (sets[ix / WAYS].keys[ix % WAYS] != EMPTY_KEY)
+                free(values[ix]);
+        free(sets);
+        free(values);
+        sets   = NULL;
+        values = NULL;
+    }
+
+    for (size_t ix = 0; ix < STRIPES; ix++) {
+        stripes[ix].used = 0;
+        if (stripes[ix].flights != NULL) {
+            flights_free(stripes[ix].flights);
+            stripes[ix].flights = NULL;
+        }
+    }
+
+    free(returned_value);
+    returned_value = NULL;
+    returned_size  = 0;
+    pthread_key_delete(returned_key);
+
+    _unlock_all();
+}
+
+
+void reset_statistics(void) {
+    DEBUG_PRINT(__FILE__ " reset_statistics()\n");
+
+    for (size_t ix = 0; ix < STRIPES; ix++) {
+        Stripe* stripe = &stripes[ix];
+
+        pthread_mutex_lock(&stripe->lock);
+        stripe->requests      = 0;
+        stripe->hits          = 0;
+        stripe->misses        = 0;
+        stripe->evictions     = 0;
+        stripe->prefetched    = 0;
+        stripe->prefetch_hits = 0;
+        stripe->coalesced     = 0;
+        pthread_mutex_unlock(&stripe->lock);
+    }
+}
+
+
+CacheStat* statistics(void) {
+    DEBUG_PRINT(__FILE__ " statistics()\n");
+
+    Stripe total;
+    memset(&total, 0, sizeof(Stripe));
+
+    _lock_all();
+    for (size_t ix = 0; ix < STRIPES; ix++) {
+        total.used += stripes[ix].used;
+        total.requests += stripes[ix].requests;
+        total.hits += stripes[ix].hits;
+        total.misses += stripes[ix].misses;
+        total.evictions += stripes[ix].evictions;
+        total.prefetched += stripes[ix].prefetched;
+        total.prefetch_hits += stripes[ix].prefetch_hits;
+        total.coalesced += stripes[ix].coalesced;
+    }
+    _unlock_all();
+
+    CacheStat* stats_cache = malloc(10 * sizeof(CacheStat));
+
+    stats_cache[0] = (CacheStat){Cache_requests, total.requests};
+    stats_cache[1] = (CacheStat){Cache_hits, total.hits};
+    stats_cache[2] = (CacheStat){Cache_misses, total.misses};
+    stats_cache[3] = (CacheStat){Cache_evictions, total.evictions};
+    stats_cache[4] = (CacheStat){Cache_size, total.used};
+    stats_cache[5] = (CacheStat){Cache_capacity, capacity};
+    stats_cache[6] = (CacheStat){Cache_prefetched, total.prefetched};
+    stats_cache[7] = (CacheStat){Cache_prefetch_hits, total.prefetch_hits};
+    stats_cache[8] = (CacheStat){Cache_coalesced, total.coalesced};
+    stats_cache[9] = (CacheStat){END_OF_STATS, 0};
+
+    return stats_cache;
+}
+
+
+// Rounds up to whole sets. A byte budget counts ENTRY_BYTES an entry
+void set_capacity(size_t min, size_t max, size_t byte_budget) {
+    DEBUG_PRINT(__FILE__ " set_capacity(%zu, %zu, %zu)\n", min, max,
+                byte_budget);
+
+    if (byte_budget > 0 && byte_budget / ENTRY_BYTES < max)
+        max = byte_budget / ENTRY_BYTES;
+    if (max < min)
+        max = min;
+    if (max > MAX_CAPACITY)
+        max = MAX_CAPACITY;
+
+    _lock_all();
+
+    Set* old_sets      = sets;
+    char** old_values  = values;
+    size_t old_entries = _set_count() * WAYS;
+
+    _make_table(max);
+    capacity = _set_count() * WAYS;
+
+    for (size_t ix = 0; ix < STRIPES; ix++)
+        stripes[ix].used = 0;
+
+    // entries whose new set is full push out the ones placed before them
+    for (size_t ix = 0; ix < old_entries; ix++) {
+        const Set* old = &old_sets[ix / WAYS];
+        KeyType key    = old->keys[ix % WAYS];
+
+        if (key != EMPTY_KEY)
+            _insert(_set_of(key, set_total), key, old_values[ix],
+                    (old->prefetched >> (ix % WAYS)) & 1);
+    }
+
+    free(old_sets);
+    free(old_values);
+
+    _unlock_all();
+}
+
+
+// Copies value into the calling thread's own buffer
+ValueType _return_copy(const char* value, size_t length) {
+    if (value == NULL)
+        return NULL;
+
+    if (length + 1 > returned_size) {
+        returned_value = realloc(returned_value, length + 1);
+        returned_size  = length + 1;
+        pthread_setspecific(returned_key, returned_value);
+    }
+    return memcpy(returned_value, value, length + 1);
+}
+
+
+// Entries with the victim of each set last, since it would go first.
+// Fills in the index of each into values[]. Takes every lock held
+size_t _hottest_first(size_t entries[], size_t max) {
+    size_t count = 0;
+
+    for (int victims = 0; victims <= 1; victims++)
+        for (size_t set = 0; set < _set_count(); set++) {
+            const Set* s = &sets[set];
+
+            for (unsigned way = 0; way < WAYS && count < max; way++)
+                if (s->keys[way] != EMPTY_KEY &&
+                    (way == _victim(s->plru)) == victims)
+                    entries[count++] = set * WAYS + way;
+        }
+    return count;
+}
+
+
+bool save_snapshot(const char* path, uint64_t fingerprint) {
+    DEBUG_PRINT(__FILE__ " save_snapshot(%s)\n", path);
+
+    size_t entries[MAX_CAPACITY];
+    KeyType keys[MAX_CAPACITY];
+    ValueType saved_values[MAX_CAPACITY];
+
+    _lock_all();
+
+    size_t count = _hottest_first(entries, MAX_CAPACITY);
+    for (size_t ix = 0; ix < count; ix++) {
+        keys[ix]         = sets[entries[ix] / WAYS].keys[entries[ix] % WAYS];
+        saved_values[ix] = values[entries[ix]];
+    }
+
+    bool saved = snapshot_write(path, fingerprint, keys, saved_values, count);
+
+    _unlock_all();
+    return saved;
+}
+
+
+int load_snapshot(const char* path, uint64_t fingerprint) {
+    DEBUG_PRINT(__FILE__ " load_snapshot(%s)\n", path);
+
+    Snapshot snap = snapshot_open(path, fingerprint);
+    if (snap == NULL)
+        return -1;
+
+    _lock_all();
+
+    size_t count = snap->count < capacity ? snap->count : capacity;
+    int restored = 0;
+
+    // hottest first, so within a set only free ways are taken
+    for (size_t ix = 0; ix < count; ix++) {
+        KeyType key = snap->entries[ix].key;
+        size_t set  = _set_of(key, set_total);
+
+        if (_empty_ways(&sets[set]) && !_find(&sets[set], key)) {
+            _insert(set, key, snapshot_value(snap, ix), false);
+            restored++;
+        }
+    }
+
+    _unlock_all();
+
+    snapshot_close(snap);
+    return restored;
+}
+
+
+size_t export_entries(KeyType keys[], ValueType exported[], size_t max) {
+    DEBUG_PRINT(__FILE__ " export_entries(%zu)\n", max);
+
+    size_t entries[MAX_CAPACITY];
+
+    _lock_all();
+
+    size_t count = _hottest_first(entries, max < MAX_CAPACITY ? max
+                                                              : MAX_CAPACITY);
+    for (size_t ix = 0; ix < count; ix++) {
+        Set* s   = &sets[entries[ix] / WAYS];
+        unsigned way = entries[ix] % WAYS;
+
+        keys[ix]     = s->keys[way];
+        exported[ix] = values[entries[ix]];
+
+        s->keys[way] = EMPTY_KEY;
+        s->prefetched &= ~(1u << way);
+        _stripe_of(entries[ix] / WAYS)->used--;
+    }
+
+    _unlock_all();
+    return count;
+}
+
+
+size_t invalidate(Stale_fptr stale) {
+    DEBUG_PRINT(__FILE__ " invalidate()\n");
+
+    size_t removed = 0;
+
+    _lock_all();
+
+    for (size_t set = 0; set < _set_count(); set++) {
+        Set* s = &sets[set];
+
+        for (unsigned way = 0; way < WAYS; way++) {
+            char** value = &values[set * WAYS + way];
+
+            if (s->keys[way] == EMPTY_KEY || !stale(s->keys[way], *value))
+                continue;
+
+            free(*value);
+            s->keys[way] = EMPTY_KEY;
+            s->prefetched &= ~(1u << way);
+            _stripe_of(set)->used--;
+            removed++;
+        }
+    }
+
+    _unlock_all();
+    return removed;
+}
+
+
+void set_eviction_handler(Eviction_fptr handler) {
+    DEBUG_PRINT(__FILE__ " set_eviction_handler()\n");
+    _lock_all();
+    eviction_handler = handler;
+    _unlock_all();
+}
+
+
+void insert(KeyType key, ValueType value) {
+    size_t set = _lock_set(key);
+
+    if (_find(&sets[set], key))
+        free(value);  // already held
+    else
+        _insert(set, key, value, false);
+
+    pthread_mutex_unlock(&_stripe_of(set)->lock);
+}
+
+
+// Prefetched values only take free ways
+// A full set gives a prefetched value its victim way
+void insert_many(const KeyType keys[], ValueType new_values[], size_t count) {
+    DEBUG_PRINT(__FILE__ " insert_many(%zu)\n", count);
+
+    for (size_t ix = 0; ix < count; ix++) {
+        size_t set     = _lock_set(keys[ix]);
+        Stripe* stripe = _stripe_of(set);
+
+        if (keys[ix] != EMPTY_KEY && keys[ix] <= MAX_KEY &&
+            !_find(&sets[set], keys[ix])) {
+            _insert(set, keys[ix], new_values[ix], true);
+            stripe->prefetched++;
+        } else
+            free(new_values[ix]);
+
+        pthread_mutex_unlock(&stripe->lock);
+    }
+}
+
+
+size_t admit_many(KeyType keys[], size_t count) {
+    size_t kept = 0;
+
+    for (size_t ix = 0; ix < count; ix++) {
+        size_t set = _lock_set(keys[ix]);
+
+        if (keys[ix] != EMPTY_KEY && keys[ix] <= MAX_KEY &&
+            !_find(&sets[set], keys[ix]))
+            keys[kept++] = keys[ix];
+
+        pthread_mutex_unlock(&_stripe_of(set)->lock);
+    }
+    return kept;
+}
+
+
+// Computes a missed key with the lock released, unless another thread is
+// already computing it, in which case its result is waited for
+// Takes the set's stripe locked and returns with it locked
+ValueType _provide_missed(Vec lengths, KeyType key, size_t set) {
+    Stripe* stripe = _stripe_of(set);
+    size_t count   = atomic_load(&set_total);
+    Flight flight  = flights_wait(stripe->flights, key);
+
+    if (flight != NULL) {
+        stripe->coalesced++;
+        ValueType result = flight->value
+                               ? _return_copy(flight->value,
+                                              strlen(flight->value))
+                               : NULL;
+        flight_leave(flight);
+        return result;
+    }
+
+    flight = flights_start(stripe->flights, key);
+    pthread_mutex_unlock(&stripe->lock);
+
+    INSTRUMENT_START(downstream_timer);
+    ValueType result = (*_downstream)(lengths, key);
+    INSTRUMENT_STOP(STAGE_DOWNSTREAM, downstream_timer);
+
+    pthread_mutex_lock(&stripe->lock);
+    INSTRUMENT_START(insert_timer);
+
+    ValueType returned = result ? _return_copy(result, strlen(result)) : NULL;
+
+    // it may have been published or inserted while unlocked, and after a
+    // resize the key's set may be under another stripe
+    if (atomic_load(&set_total) == count && !_find(&sets[set], key))
+        _insert(set, key, result, false);
+    else
+        free(result);
+
+    INSTRUMENT_STOP(STAGE_INSERT, insert_timer);
+
+    flights_land(stripe->flights, flight, returned);
+    return returned;
+}
+
+
+// used externally but not referenced externally --
+// only by the set_provider function
+ValueType _caching_provider(Vec lengths, KeyType key) {
+    size_t set     = _lock_set(key);
+    Stripe* stripe = _stripe_of(set);
+    Set* s         = &sets[set];
+
+    stripe->requests++;
+
+    INSTRUMENT_START(lookup_timer);
+    unsigned hit = _find(s, key);
+
+    TRACE(hit ? TRACE_PRESENT : TRACE_ABSENT, key,
+          hit ? set * WAYS + __builtin_ctz(hit) : TRACE_NO_SLOT);
+
+    if (hit) {
+        unsigned way = __builtin_ctz(hit);
+
+        stripe->hits++;
+        stripe->prefetch_hits += (s->prefetched >> way) & 1;
+        s->prefetched &= ~hit;
+        s->plru = _touch(s->plru, way);
+
+        ValueType result = _return_copy(values[set * WAYS + way],
+                                        s->lengths[way]);
+        INSTRUMENT_STOP(STAGE_LOOKUP, lookup_timer);
+        pthread_mutex_unlock(&stripe->lock);
+        return result;
+    }
+
+    stripe->misses++;
+    INSTRUMENT_STOP(STAGE_LOOKUP, lookup_timer);
+    ValueType result = _provide_missed(lengths, key, set);
+
+    pthread_mutex_unlock(&stripe->lock);
+    return result;
+}
+
+
+ProviderFunction set_provider(ProviderFunction downstream) {
+    DEBUG_PRINT(__FILE__ " set_provider()\n");
+    _downstream = downstream;
+    return _caching_provider;
+}
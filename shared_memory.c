@@ -0,0 +1,721 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "hash.h"
+#include "instrument.h"
+#include "keypair.h"
+#include "singleflight.h"
+#include "trace.h"
+
+/* Shared memory: one cache for every process on the host */
+
+/*
+** The index and the values live in a POSIX shared memory segment named after
+** the price table, so processes only ever share answers for the same prices.
+** Every link in the segment is an offset from its base, since each process
+** maps it at a different address.
+**
+** One process-shared robust mutex guards the segment. If a process dies
+** holding it, the next process to lock it gets EOWNERDEAD, throws away any
+** slot that was mid-write and rebuilds the bucket chains from the slots.
+** Solving happens outside the lock.
+**
+** Each process counts itself in the segment while attached, and the last
+** to detach removes it. One that crashes never detaches, so its segment is
+** left behind until removed with
+**   rm /dev/shm/rodcut-cache-*
+**
+** A segment's slots are fixed by the process that creates it, from its own
+** set_capacity(). A shadow (set_keys_only()) maps a private anonymous
+** segment instead, so it sees only its own process's keys.
+*/
+
+#define SHM_PREFIX "/rodcut-cache-"
+#define SHM_MAGIC 0x31434D4853444F52ULL  // "RODSHMC1"
+
+#define SHM_CAPACITY 4096  // most slots a segment can have
+#define BUCKET_COUNT 8192
+#define MAX_VALUE_LENGTH 256  // MAX_OUTPUT_LENGTH, including the terminator
+
+#define NO_OFFSET 0  // offset 0 is the header, so it never names a slot
+
+#define ATTACH_RETRIES 1000
+#define ATTACH_WAIT_US 1000
+
+enum slot_state { SLOT_FREE = 0, SLOT_BUSY = 1, SLOT_READY = 2 };
+
+typedef struct shmslot {
+    uint32_t key;
+    uint32_t next;  // offset of the next slot in the bucket, or NO_OFFSET
+    uint8_t state;
+    uint8_t referenced;  // CLOCK bit, set on every hit
+    uint16_t value_length;
+    char value[MAX_VALUE_LENGTH];
+} ShmSlot;
+
+typedef struct shmheader {
+    _Atomic uint64_t magic;  // set last, once the segment is ready
+    uint64_t fingerprint;
+    pthread_mutex_t lock;
+    uint32_t capacity;
+    uint32_t bucket_count;
+    uint32_t clock_hand;
+    uint32_t used;
+    uint32_t attached;  // processes that have it mapped
+    uint64_t evictions;
+    uint32_t buckets[BUCKET_COUNT];  // offset of the first slot, or NO_OFFSET
+} ShmHeader;
+
+#define SEGMENT_SIZE(slots) (sizeof(ShmHeader) + (slots) * sizeof(ShmSlot))
+
+ShmHeader* segment = NULL;  // NULL until the first request names the prices
+size_t segment_size = 0;     // bytes mapped
+char segment_name[sizeof(SHM_PREFIX) + 16];
+bool attach_failed = false;  // then every request goes straight downstream
+
+size_t capacity = SHM_CAPACITY;  // slots of a segment this process creates
+bool capacity_set = false;       // by set_capacity(), so it is warned about
+bool keys_only  = false;         // the segment is private, and holds no values
+uint32_t last_prefetched = 0;    // by this process, guarded by the segment lock
+
+// threads of this process update these without a lock
+_Atomic int cache_requests;
+_Atomic int cache_hits;
+_Atomic int cache_misses;
+_Atomic int cache_recoveries;
+_Atomic int cache_prefetched;
+_Atomic int cache_coalesced;
+
+// guards attaching and the flights, the segment has its own lock
+pthread_mutex_t local_lock = PTHREAD_MUTEX_INITIALIZER;
+Flights flights            = NULL;  // misses this process is computing
+
+ProviderFunction _downstream = NULL;
+
+// returned values are copied out, another process may reuse the slot
+__thread char returned_value[MAX_VALUE_LENGTH];
+
+
+ShmSlot* slot_at(uint32_t offset) {
+    return (ShmSlot*)((char*)segment + offset);
+}
+
+uint32_t slot_offset(size_t index) {
+    return sizeof(ShmHeader) + index * sizeof(ShmSlot);
+}
+
+size_t slot_index(const ShmSlot* slot) {
+    return ((const char*)slot - (const char*)segment - sizeof(ShmHeader)) /
+           sizeof(ShmSlot);
+}
+
+uint32_t* bucket_for(uint32_t key) {
+    return &segment->buckets[(key * 2654435761u) % segment->bucket_count];
+}
+
+
+// Hash of the price table, so different tables get different segments.
+// The same as fingerprintPrices(), which the module is not linked with
+uint64_t _fingerprint(Vec lengths) {
+    uint64_t hash  = lengths->length;
+    KeyPair* pairs = lengths->base;
+
+    for (size_t ix = 0; ix < lengths->length; ix++)
+        hash += splitmix_mix((uint64_t)pairs[ix].key << 32 ^
+                             (uint32_t)pairs[ix].value);
+    return hash;
+}
+
+
+// Link every ready slot back into the buckets, freeing any left mid-write.
+// Only called with the lock held and the previous owner dead
+void _recover(void) {
+    DEBUG_PRINT(__FILE__ " recover()\n");
+
+    memset(segment->buckets, 0, sizeof(segment->buckets));
+    segment->used = 0;
+
+    for (size_t ix = 0; ix < segment->capacity; ix++) {
+        ShmSlot* slot = slot_at(slot_offset(ix));
+
+        if (slot->state != SLOT_READY) {
+            slot->state = SLOT_FREE;
+            continue;
+        }
+
+        uint32_t* bucket = bucket_for(slot->key);
+        slot->next       = *bucket;
+        *bucket          = slot_offset(ix);
+        segment->used++;
+    }
+    if (segment->clock_hand >= segment->capacity)
+        segment->clock_hand = 0;
+
+    cache_recoveries++;
+}
+
+
+void _lock(void) {
+    if (pthread_mutex_lock(&segment->lock) == EOWNERDEAD) {
+        _recover();
+        pthread_mutex_consistent(&segment->lock);
+    }
+}
+
+
+void _unlock(void) {
+    pthread_mutex_unlock(&segment->lock);
+}
+
+
+// Set up a segment this process just created, zeroed
+void _format_segment(uint64_t fingerprint, size_t slots) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&segment->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    segment->fingerprint  = fingerprint;
+    segment->capacity     = slots;
+    segment->bucket_count = BUCKET_COUNT;
+
+    // ftruncate() zeroed the rest: empty buckets, free slots
+    atomic_store(&segment->magic, SHM_MAGIC);
+}
+
+
+// Maps a segment only this process sees
+bool _attach_private(uint64_t fingerprint) {
+    segment_size = SEGMENT_SIZE(capacity);
+
+    void* map = mmap(NULL, segment_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return false;
+
+    segment = map;
+    _format_segment(fingerprint, capacity);
+    return true;
+}
+
+
+void _warn_capacity(void) {
+    fprintf(stderr,
+            "Warning: shared memory cache %s holds %u entries, not the %zu "
+            "asked for\n",
+            segment_name, segment->capacity, capacity);
+}
+
+
+// Create or open the segment for the price table with fingerprint
+bool _attach(uint64_t fingerprint) {
+    if (keys_only)
+        return _attach_private(fingerprint);
+
+    snprintf(segment_name, sizeof(segment_name), SHM_PREFIX "%016llx",
+             (unsigned long long)fingerprint);
+
+    bool created = true;
+    int fd       = shm_open(segment_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+    if (fd < 0 && errno == EEXIST) {
+        created = false;
+        fd      = shm_open(segment_name, O_RDWR, 0600);
+    }
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    bool sized   = created ? ftruncate(fd, SEGMENT_SIZE(capacity)) == 0 : false;
+    segment_size = SEGMENT_SIZE(capacity);
+
+    // another process may still be sizing the segment it created
+    for (int tries = 0; !sized && tries < ATTACH_RETRIES; tries++) {
+        sized = fstat(fd, &info) == 0 && info.st_size > 0;
+        if (sized)
+            segment_size = info.st_size;
+        else
+            usleep(ATTACH_WAIT_US);
+    }
+
+    void* map = sized ? mmap(NULL, segment_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, fd, 0)
+                      : MAP_FAILED;
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return false;
+
+    segment = map;
+
+    if (created)
+        _format_segment(fingerprint, capacity);
+
+    for (int tries = 0; atomic_load(&segment->magic) != SHM_MAGIC; tries++) {
+        if (tries == ATTACH_RETRIES) {
+            munmap(segment, segment_size);
+            segment = NULL;
+            return false;
+        }
+        usleep(ATTACH_WAIT_US);
+    }
+
+    if (SEGMENT_SIZE(segment->capacity) != segment_size) {
+        munmap(segment, segment_size);
+        segment = NULL;
+        return false;
+    }
+
+    _lock();
+    segment->attached++;
+    _unlock();
+
+    if (capacity_set && segment->capacity != capacity)
+        _warn_capacity();
+
+    DEBUG_PRINT(__FILE__ " attached to %s (%s)\n", segment_name,
+                created ? "created" : "existing");
+    return true;
+}
+
+
+// Attaches unless attached already, or unable to
+void _attach_once(uint64_t fingerprint) {
+    pthread_mutex_lock(&local_lock);
+    if (segment == NULL && !attach_failed && !_attach(fingerprint)) {
+        fprintf(stderr, "Warning: shared memory cache unavailable\n");
+        attach_failed = true;
+    }
+    pthread_mutex_unlock(&local_lock);
+}
+
+
+// Unmaps the segment, removing it if no other process has it mapped
+void _detach(void) {
+    if (!keys_only) {
+        _lock();
+        if (--segment->attached == 0)
+            shm_unlink(segment_name);
+        _unlock();
+    }
+
+    munmap(segment, segment_size);
+    segment = NULL;
+}
+
+
+void initialize(void) {
+    DEBUG_PRINT(__FILE__ " initialize()\n");
+
+    cache_requests   = 0;
+    cache_hits       = 0;
+    cache_misses     = 0;
+    cache_recoveries = 0;
+    cache_prefetched = 0;
+    cache_coalesced  = 0;
+    segment          = NULL;
+    attach_failed    = false;
+    capacity         = SHM_CAPACITY;
+    capacity_set     = false;
+    keys_only        = false;
+    flights          = new_flights(&local_lock);
+}
+
+
+void cleanup(void) {
+    DEBUG_PRINT(__FILE__ " cleanup()\n");
+
+    if (segment != NULL)
+        _detach();
+    if (flights != NULL) {
+        flights_free(flights);
+        flights = NULL;
+    }
+}
+
+
+void reset_statistics(void) {
+    DEBUG_PRINT(__FILE__ " reset_statistics()\n");
+    cache_requests   = 0;
+    cache_hits       = 0;
+    cache_misses     = 0;
+    cache_recoveries = 0;
+    cache_prefetched = 0;
+    cache_coalesced  = 0;
+}
+
+
+CacheStat* statistics(void) {
+    DEBUG_PRINT(__FILE__ " statistics()\n");
+
+    int used = 0, evictions = 0, slots = capacity;
+    if (segment != NULL) {
+        _lock();
+        used      = segment->used;
+        evictions = segment->evictions;
+        slots     = segment->capacity;
+        _unlock();
+    }
+
+    CacheStat* stats_cache = malloc(10 * sizeof(CacheStat));
+    stats_cache[0]         = (CacheStat){Cache_requests, cache_requests};
+    stats_cache[1]         = (CacheStat){Cache_hits, cache_hits};
+    stats_cache[2]         = (CacheStat){Cache_misses, cache_misses};
+    stats_cache[3]         = (CacheStat){Cache_evictions, evictions};
+    stats_cache[4]         = (CacheStat){Cache_size, used};
+    stats_cache[5]         = (CacheStat){Cache_capacity, slots};
+    stats_cache[6]         = (CacheStat){Cache_recoveries, cache_recoveries};
+    stats_cache[7]         = (CacheStat){Cache_prefetched, cache_prefetched};
+    stats_cache[8]         = (CacheStat){Cache_coalesced, cache_coalesced};
+    stats_cache[9]         = (CacheStat){END_OF_STATS, 0};
+
+    return stats_cache;
+}
+
+
+// A segment's slots are fixed when it is created, so this sizes the next
+// one this process creates. One already mapped keeps its own, with a warning
+void set_capacity(size_t min, size_t max, size_t byte_budget) {
+    DEBUG_PRINT(__FILE__ " set_capacity(%zu, %zu, %zu)\n", min, max,
+                byte_budget);
+
+    if (byte_budget > 0 && byte_budget / sizeof(ShmSlot) < max)
+        max = byte_budget / sizeof(ShmSlot);
+    if (max < min)
+        max = min;
+    if (max > SHM_CAPACITY)
+        max = SHM_CAPACITY;
+    if (max < 1)
+        max = 1;
+
+    pthread_mutex_lock(&local_lock);
+    capacity     = max;
+    capacity_set = true;
+    if (segment != NULL && segment->capacity != capacity)
+        _warn_capacity();
+    pthread_mutex_unlock(&local_lock);
+}
+
+
+void set_keys_only(void) {
+    DEBUG_PRINT(__FILE__ " set_keys_only()\n");
+    pthread_mutex_lock(&local_lock);
+    keys_only = true;
+    pthread_mutex_unlock(&local_lock);
+}
+
+
+// Returns the slot holding key, or NULL. Lock must be held
+ShmSlot* _find(uint32_t key) {
+    for (uint32_t offset = *bucket_for(key); offset != NO_OFFSET;) {
+        ShmSlot* slot = slot_at(offset);
+        if (slot->key == key)
+            return slot;
+        offset = slot->next;
+    }
+    return NULL;
+}
+
+
+// Unlink the slot at offset from its bucket. Lock must be held
+void _unlink(uint32_t offset) {
+    ShmSlot* slot = slot_at(offset);
+    uint32_t* link = bucket_for(slot->key);
+
+    while (*link != NO_OFFSET && *link != offset)
+        link = &slot_at(*link)->next;
+
+    if (*link == offset)
+        *link = slot->next;
+}
+
+
+// Returns a free slot, evicting with CLOCK if there is none. Lock must be held
+uint32_t _claim_slot(void) {
+    while (true) {
+        size_t index    = segment->clock_hand;
+        uint32_t offset = slot_offset(index);
+        ShmSlot* slot   = slot_at(offset);
+
+        segment->clock_hand = (segment->clock_hand + 1) % segment->capacity;
+
+        if (slot->state == SLOT_FREE)
+            return offset;
+
+        if (slot->referenced) {
+            slot->referenced = 0;
+            continue;
+        }
+
+        INSTRUMENT_START(evict_timer);
+        TRACE(TRACE_EVICT, slot->key, index);
+
+        slot->state = SLOT_BUSY;
+        _unlink(offset);
+        segment->used--;
+        segment->evictions++;
+        INSTRUMENT_STOP(STAGE_EVICT, evict_timer);
+        return offset;
+    }
+}
+
+
+bool _is_present(KeyType key) {
+    ShmSlot* slot = NULL;
+
+    if (key <= UINT32_MAX) {
+        _lock();
+        slot = _find(key);
+        if (slot != NULL) {
+            memcpy(returned_value, slot->value, slot->value_length + 1);
+            slot->referenced = 1;
+        }
+        _unlock();
+    }
+
+    TRACE(slot != NULL ? TRACE_PRESENT : TRACE_ABSENT, key,
+          slot != NULL ? slot_index(slot) : TRACE_NO_SLOT);
+
+    return slot != NULL;
+}
+
+
+// The slot of the value this process prefetched last, taken out of its
+// bucket, or NO_OFFSET if it has been used or is gone. Lock must be held
+uint32_t _take_unused_prefetched(void) {
+    ShmSlot* slot = _find(last_prefetched);
+    if (slot == NULL || slot->referenced)
+        return NO_OFFSET;
+
+    uint32_t offset = slot_offset(slot_index(slot));
+    slot->state     = SLOT_BUSY;
+    _unlink(offset);
+    segment->used--;
+    return offset;
+}
+
+
+// Stores a copy of value unless another process got there first. A NULL one
+// stores the key alone. Values go in unreferenced, so a prefetched one nobody
+// asks for is among the next CLOCK takes. Once the segment is full, each
+// prefetched value takes the place of the one this process prefetched before
+// it, if still unused, so prefetching pushes out few entries in use. Returns
+// true if it was stored
+bool _store(KeyType key, ValueType value, bool prefetched) {
+    size_t length = value != NULL ? strlen(value) : 0;
+    if (key > UINT32_MAX || length >= MAX_VALUE_LENGTH)
+        return false;
+
+    _lock();
+
+    bool stored = _find(key) == NULL;
+
+    if (stored) {
+        uint32_t offset = NO_OFFSET;
+        if (prefetched && segment->used == segment->capacity)
+            offset = _take_unused_prefetched();
+        if (offset == NO_OFFSET)
+            offset = _claim_slot();
+        if (prefetched)
+            last_prefetched = key;
+
+        ShmSlot* slot = slot_at(offset);
+
+        // BUSY until the value is whole, so a crash here frees the slot
+        slot->state        = SLOT_BUSY;
+        slot->key          = key;
+        slot->value_length = length;
+        slot->referenced   = 0;
+        memcpy(slot->value, value != NULL ? value : "", length + 1);
+
+        uint32_t* bucket = bucket_for(key);
+        slot->next       = *bucket;
+        *bucket          = offset;
+        segment->used++;
+        slot->state = SLOT_READY;
+
+        TRACE(TRACE_INSERT, key, slot_index(slot));
+    }
+
+    _unlock();
+    return stored;
+}
+
+
+// Values only go in once set_fingerprint() or the first request has named
+// the prices
+void insert(KeyType key, ValueType value) {
+    if (segment != NULL && value != NULL)
+        _store(key, value, false);
+    free(value);
+}
+
+
+void insert_many(const KeyType keys[], ValueType values[], size_t count) {
+    DEBUG_PRINT(__FILE__ " insert_many(%zu)\n", count);
+
+    for (size_t ix = 0; ix < count; ix++) {
+        if (segment != NULL && values[ix] != NULL &&
+            _store(keys[ix], values[ix], true))
+            cache_prefetched++;
+        free(values[ix]);
+    }
+}
+
+
+size_t admit_many(KeyType keys[], size_t count) {
+    if (segment == NULL)
+        return 0;
+
+    size_t kept = 0;
+    _lock();
+
+    for (size_t ix = 0; ix < count; ix++)
+        if (keys[ix] <= UINT32_MAX && _find(keys[ix]) == NULL)
+            keys[kept++] = keys[ix];
+
+    _unlock();
+    return kept;
+}
+
+
+// A replacement attaches before the entries come, so they are in the
+// segment for it even once the cache it replaces detaches
+void set_fingerprint(uint64_t fingerprint) {
+    DEBUG_PRINT(__FILE__ " set_fingerprint(%016llx)\n",
+                (unsigned long long)fingerprint);
+    _attach_once(fingerprint);
+}
+
+
+// The segment stays shared, so these are copies. Slots CLOCK would keep
+// longest, the referenced ones, come first
+size_t export_entries(KeyType keys[], ValueType values[], size_t max) {
+    DEBUG_PRINT(__FILE__ " export_entries(%zu)\n", max);
+
+    if (segment == NULL)
+        return 0;
+
+    size_t count = 0;
+    _lock();
+
+    for (int referenced = 1; referenced >= 0; referenced--) {
+        for (size_t ix = 0; ix < segment->capacity && count < max; ix++) {
+            ShmSlot* slot = slot_at(slot_offset(ix));
+
+            if (slot->state == SLOT_READY && slot->referenced == referenced) {
+                keys[count]   = slot->key;
+                values[count] = strndup(slot->value, slot->value_length);
+                count++;
+            }
+        }
+    }
+
+    _unlock();
+    return count;
+}
+
+
+// The segment belongs to the old prices, and its answers still hold for
+// the processes using them, so it is left to them whole, or removed if there
+// are none. The next request attaches to the segment of the new prices,
+// which may already be warm
+size_t invalidate(Stale_fptr stale) {
+    DEBUG_PRINT(__FILE__ " invalidate()\n");
+    (void)stale;
+
+    pthread_mutex_lock(&local_lock);
+
+    size_t left = 0;
+
+    if (segment != NULL) {
+        _lock();
+        left = segment->used;
+        _unlock();
+
+        _detach();
+    }
+    attach_failed = false;
+
+    pthread_mutex_unlock(&local_lock);
+    return left;
+}
+
+
+// used externally but not referenced externally --
+// only by the set_provider function
+ValueType _caching_provider(Vec lengths, KeyType key) {
+    cache_requests++;
+
+    _attach_once(_fingerprint(lengths));
+
+    INSTRUMENT_START(lookup_timer);
+
+    if (segment != NULL && _is_present(key)) {
+        cache_hits++;
+        INSTRUMENT_STOP(STAGE_LOOKUP, lookup_timer);
+        return keys_only ? NULL : returned_value;
+    }
+
+    cache_misses++;
+    INSTRUMENT_STOP(STAGE_LOOKUP, lookup_timer);
+
+    // other threads of this process may be solving it already
+    pthread_mutex_lock(&local_lock);
+    Flight flight = flights_wait(flights, key);
+
+    if (flight != NULL) {
+        cache_coalesced++;
+        if (flight->value != NULL)
+            snprintf(returned_value, MAX_VALUE_LENGTH, "%s", flight->value);
+
+        ValueType result = flight->value ? returned_value : NULL;
+        flight_leave(flight);
+        pthread_mutex_unlock(&local_lock);
+        return result;
+    }
+
+    flight = flights_start(flights, key);
+    pthread_mutex_unlock(&local_lock);
+
+    INSTRUMENT_START(downstream_timer);
+    ValueType result = (*_downstream)(lengths, key);
+    INSTRUMENT_STOP(STAGE_DOWNSTREAM, downstream_timer);
+
+    INSTRUMENT_START(insert_timer);
+    if (segment != NULL && (result != NULL || keys_only))
+        _store(key, result, false);
+    INSTRUMENT_STOP(STAGE_INSERT, insert_timer);
+
+    if (result != NULL) {
+        snprintf(returned_value, MAX_VALUE_LENGTH, "%s", result);
+        free(result);
+        result = returned_value;
+    }
+
+    pthread_mutex_lock(&local_lock);
+    flights_land(flights, flight, result);
+    pthread_mutex_unlock(&local_lock);
+
+    return result;
+}
+
+
+ProviderFunction set_provider(ProviderFunction downstream) {
+    DEBUG_PRINT(__FILE__ " set_provider()\n");
+    _downstream = downstream;
+    return _caching_provider;
+}
@@ -0,0 +1,71 @@
+#include "singleflight.h"
+
+#include <string.h>
+
+
+Flights new_flights(pthread_mutex_t* lock) {
+    Flights f = malloc(sizeof(struct flights));
+    f->lock   = lock;
+    f->active = NULL;
+    return f;
+}
+
+void flights_free(Flights f) {
+    free(f);
+}
+
+Flight flights_wait(Flights f, KeyType key) {
+    Flight flight = f->active;
+    while (flight != NULL && flight->key != key)
+        flight = flight->next;
+
+    if (flight == NULL)
+        return NULL;
+
+    flight->waiters++;
+    while (!flight->landed)
+        pthread_cond_wait(&flight->done, f->lock);
+
+    return flight;
+}
+
+Flight flights_start(Flights f, KeyType key) {
+    Flight flight   = malloc(sizeof(struct flight));
+    flight->key     = key;
+    flight->value   = NULL;
+    flight->landed  = false;
+    flight->waiters = 0;
+    flight->next    = f->active;
+    pthread_cond_init(&flight->done, NULL);
+
+    f->active = flight;
+    return flight;
+}
+
+void _flight_free(Flight flight) {
+    pthread_cond_destroy(&flight->done);
+    free(flight->value);
+    free(flight);
+}
+
+void flights_land(Flights f, Flight flight, ValueType value) {
+    Flight* link = &f->active;
+    while (*link != flight)
+        link = &(*link)->next;
+    *link = flight->next;
+
+    if (flight->waiters == 0) {
+        _flight_free(flight);
+        return;
+    }
+
+    // the cache may evict value before every waiter has read it
+    flight->value  = value ? strdup(value) : NULL;
+    flight->landed = true;
+    pthread_cond_broadcast(&flight->done);
+}
+
+void flight_leave(Flight flight) {
+    if (--flight->waiters == 0)
+        _flight_free(flight);
+}
@@ -0,0 +1,53 @@
+#ifndef SINGLEFLIGHT_H
+#define SINGLEFLIGHT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "cache.h"
+
+/*
+** Miss coalescing, shared by the cache modules.
+**
+** Every call is made with the module's lock held. The first thread to miss
+** on a key starts a flight and computes the value with the lock released.
+** Threads that miss on the same key meanwhile wait on the flight instead of
+** computing it again. When the leader lands, each waiter reads the flight's
+** own copy of the value, which no eviction can free under it.
+*/
+
+typedef struct flight {
+    KeyType key;
+    ValueType value;  // the leader's result, copied once there are waiters
+    bool landed;
+    size_t waiters;
+    pthread_cond_t done;
+    struct flight* next;
+} *Flight;
+
+typedef struct flights {
+    pthread_mutex_t* lock;  // the module's lock, released while waiting
+    Flight active;          // flights in progress, few at any time
+} *Flights;
+
+
+Flights new_flights(pthread_mutex_t* lock);
+
+void flights_free(Flights f);
+
+// If key is being computed, waits for it and returns the landed flight.
+// Read flight->value, then call flight_leave(). Returns NULL otherwise
+Flight flights_wait(Flights f, KeyType key);
+
+// Registers the caller as the one computing key
+Flight flights_start(Flights f, KeyType key);
+
+// Ends a flight started by the caller and wakes its waiters. value stays
+// the caller's
+void flights_land(Flights f, Flight flight, ValueType value);
+
+// A waiter is done with flight->value
+void flight_leave(Flight flight);
+
+#endif
@@ -0,0 +1,296 @@
+#include "slab.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define LOCAL_SLABS 8  // slabs each thread keeps a list of its own for
+
+// A thread's free objects of one slab
+typedef struct locallist {
+    Slab slab;         // NULL if the entry is unused
+    unsigned long id;  // of the slab when the entry was taken
+    void* head;        // each free object holds the next
+    size_t count;
+} LocalList;
+
+__thread LocalList local_lists[LOCAL_SLABS];
+
+// slabs not yet freed, so a thread that exits knows where its lists go back
+pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+Slab live_slabs           = NULL;
+unsigned long next_id     = 1;
+
+pthread_key_t local_key;  // gives a thread's lists back when it exits
+pthread_once_t local_once = PTHREAD_ONCE_INIT;
+
+
+size_t _round_up(size_t size, size_t multiple) {
+    return (size + multiple - 1) / multiple * multiple;
+}
+
+// Carves count more objects out of the reserved range onto the free list,
+// or as many as still fit. Takes the lock held
+void _add_arena(Slab s, size_t count) {
+    size_t room = (s->reserved / s->object_size) - s->capacity;
+    if (count > room)
+        count = room;
+    if (count == 0)
+        return;
+
+    size_t start = s->capacity * s->object_size;
+    size_t end   = _round_up(start + count * s->object_size,
+                             (size_t)sysconf(_SC_PAGESIZE));
+    if (end > s->reserved)
+        end = s->reserved;
+
+    if (end > s->committed) {
+        if (mprotect(s->base + s->committed, end - s->committed,
+                     PROT_READ | PROT_WRITE) != 0)
+            return;
+        s->committed = end;
+    }
+
+    // thread the new objects onto the free list, first one first out
+    for (size_t ix = count; ix-- > 0;) {
+        void* object    = s->base + start + ix * s->object_size;
+        *(void**)object = s->free_list;
+        s->free_list    = object;
+    }
+
+    s->capacity += count;
+    atomic_fetch_add(&s->allocations, 1);
+}
+
+// Takes an object off the shared free list, growing it if it ran dry, or
+// NULL if the reserved range is used up. Takes the lock held
+void* _take(Slab s) {
+    // grow by as much as the slab already holds, so arenas stay few
+    if (s->free_list == NULL)
+        _add_arena(s, s->capacity);
+
+    void* object = s->free_list;
+    if (object != NULL)
+        s->free_list = *(void**)object;
+    return object;
+}
+
+// Moves count objects from the front of list back to the shared free list
+void _give_back(Slab s, LocalList* list, size_t count) {
+    pthread_mutex_lock(&s->lock);
+
+    for (; count > 0 && list->head != NULL; count--) {
+        void* object = list->head;
+        list->head   = *(void**)object;
+        list->count--;
+
+        *(void**)object = s->free_list;
+        s->free_list    = object;
+    }
+
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Returns the lists of an exiting thread to the slabs still alive
+void _return_lists(void* lists) {
+    LocalList* local = lists;
+
+    pthread_mutex_lock(&live_lock);
+    for (size_t ix = 0; ix < LOCAL_SLABS; ix++) {
+        for (Slab s = live_slabs; s != NULL; s = s->next_live)
+            if (s == local[ix].slab && s->id == local[ix].id) {
+                _give_back(s, &local[ix], local[ix].count);
+                break;
+            }
+        local[ix].slab = NULL;
+    }
+    pthread_mutex_unlock(&live_lock);
+}
+
+void _make_local_key(void) {
+    pthread_key_create(&local_key, _return_lists);
+}
+
+// The calling thread's list for s, or NULL if it has none to spare
+LocalList* _local_list(Slab s) {
+    LocalList* unused = NULL;
+
+    for (size_t ix = 0; ix < LOCAL_SLABS; ix++) {
+        LocalList* list = &local_lists[ix];
+
+        if (list->slab == s && list->id == s->id)
+            return list;
+
+        // the objects of a freed slab went with it
+        if (list->slab == NULL || list->slab == s)
+            unused = unused ? unused : list;
+    }
+
+    // entries may still name slabs freed since
+    if (unused == NULL) {
+        pthread_mutex_lock(&live_lock);
+        for (size_t ix = 0; ix < LOCAL_SLABS && unused == NULL; ix++) {
+            Slab live = live_slabs;
+            while (live != NULL && (live != local_lists[ix].slab ||
+                                    live->id != local_lists[ix].id))
+                live = live->next_live;
+            if (live == NULL)
+                unused = &local_lists[ix];
+        }
+        pthread_mutex_unlock(&live_lock);
+    }
+
+    if (unused != NULL) {
+        pthread_once(&local_once, _make_local_key);
+        pthread_setspecific(local_key, local_lists);
+
+        unused->slab  = s;
+        unused->id    = s->id;
+        unused->head  = NULL;
+        unused->count = 0;
+    }
+    return unused;
+}
+
+Slab new_slab(size_t object_size, size_t count) {
+    Slab s = malloc(sizeof(struct slab));
+
+    if (object_size < sizeof(void*))
+        object_size = sizeof(void*);
+    s->object_size   = _round_up(object_size,
+                                 object_size < CACHE_LINE ? SLAB_ALIGN
+                                                          : CACHE_LINE);
+    s->arena_objects = count > 0 ? count : 1;
+    s->capacity      = 0;
+    s->free_list     = NULL;
+    s->committed     = 0;
+    atomic_init(&s->allocations, 0);
+    pthread_mutex_init(&s->lock, NULL);
+
+    // only what gets carved out is ever backed, so most of this costs nothing
+    s->base = MAP_FAILED;
+    for (s->reserved = SLAB_RESERVE; s->reserved >= s->object_size;
+         s->reserved /= 2) {
+        s->base = mmap(NULL, s->reserved, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (s->base != MAP_FAILED)
+            break;
+    }
+    if (s->base == MAP_FAILED) {
+        s->base     = NULL;
+        s->reserved = 0;
+    }
+
+    pthread_mutex_lock(&live_lock);
+    s->id        = next_id++;
+    s->next_live = live_slabs;
+    live_slabs   = s;
+    pthread_mutex_unlock(&live_lock);
+
+    _add_arena(s, s->arena_objects);
+    return s;
+}
+
+void slab_free(Slab s) {
+    pthread_mutex_lock(&live_lock);
+    for (Slab* link = &live_slabs; *link != NULL; link = &(*link)->next_live)
+        if (*link == s) {
+            *link = s->next_live;
+            break;
+        }
+    pthread_mutex_unlock(&live_lock);
+
+    if (s->base != NULL)
+        munmap(s->base, s->reserved);
+
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+void* slab_alloc(Slab s, size_t size) {
+    if (size > s->object_size) {
+        atomic_fetch_add(&s->allocations, 1);
+        return malloc(size);
+    }
+
+    LocalList* list = _local_list(s);
+    void* object    = NULL;
+
+    if (list != NULL && list->head == NULL) {
+        // take a batch, so the next few need no lock
+        pthread_mutex_lock(&s->lock);
+        for (size_t ix = 0; ix < LOCAL_BATCH; ix++) {
+            void* taken = _take(s);
+            if (taken == NULL)
+                break;
+            *(void**)taken = list->head;
+            list->head     = taken;
+            list->count++;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    if (list != NULL && list->head != NULL) {
+        object     = list->head;
+        list->head = *(void**)object;
+        list->count--;
+        return object;
+    }
+
+    if (list == NULL) {
+        pthread_mutex_lock(&s->lock);
+        object = _take(s);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    if (object == NULL) {  // the reserved range is used up
+        atomic_fetch_add(&s->allocations, 1);
+        object = malloc(s->object_size);
+    }
+    return object;
+}
+
+// Nothing else is ever mapped in the range, so no lock is needed
+bool slab_owns(Slab s, const void* object) {
+    return (uintptr_t)object - (uintptr_t)s->base < s->reserved;
+}
+
+void slab_release(Slab s, void* object) {
+    if (object == NULL)
+        return;
+
+    if (!slab_owns(s, object)) {
+        free(object);  // came from malloc() after all
+        return;
+    }
+
+    LocalList* list = _local_list(s);
+
+    if (list == NULL) {
+        pthread_mutex_lock(&s->lock);
+        *(void**)object = s->free_list;
+        s->free_list    = object;
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+
+    *(void**)object = list->head;
+    list->head      = object;
+    list->count++;
+
+    // a thread that only frees hands its surplus on to the others
+    if (list->count >= 2 * LOCAL_BATCH)
+        _give_back(s, list, LOCAL_BATCH);
+}
+
+void slab_reserve(Slab s, size_t count) {
+    pthread_mutex_lock(&s->lock);
+    if (count > s->capacity)
+        _add_arena(s, count - s->capacity);
+    pthread_mutex_unlock(&s->lock);
+}
+
+size_t slab_allocations(Slab s) {
+    return atomic_load(&s->allocations);
+}
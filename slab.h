@@ -0,0 +1,69 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/*
+** Fixed-size object pool, shared by the cache modules and the solver.
+**
+** Each slab reserves one range of address space up front and carves its
+** objects out of it, a cache line aligned arena at a time, so whether the
+** slab owns some memory is one comparison, made without the lock. Freed
+** objects go on a free list to be handed out again, so a cache that has
+** filled up allocates nothing more. Every thread keeps a short free list of
+** its own, and takes the slab's lock only to trade a batch of objects with
+** the shared one. A request larger than the object size, a release of
+** memory the slab does not own, or a slab whose range is used up, falls
+** back to malloc() and free(), so values from anywhere can be released
+** through a slab.
+*/
+
+#define CACHE_LINE 64
+#define SLAB_ALIGN 16  // objects smaller than a cache line are rounded to it
+
+#define SLAB_RESERVE (1ULL << 34)  // address space asked for by each slab
+#define LOCAL_BATCH 32  // objects a thread takes from or gives back at once
+
+typedef struct slab {
+    size_t object_size;  // rounded, so every object stays aligned
+    size_t arena_objects;
+    size_t capacity;     // objects carved out so far
+    void* free_list;     // each free object holds the next
+
+    char* base;          // of the reserved range, page aligned
+    size_t reserved;     // bytes in it, 0 if none could be had
+    size_t committed;    // bytes at its start made usable so far
+    unsigned long id;    // tells a thread's list for a freed slab apart
+
+    atomic_size_t allocations;  // heap allocations: arenas and oversized
+    pthread_mutex_t lock;       // guards the shared free list and arenas
+    struct slab* next_live;     // in the list of slabs not yet freed
+} *Slab;
+
+
+// Returns a slab of objects of at least object_size bytes, with room for
+// count of them to begin with
+Slab new_slab(size_t object_size, size_t count);
+
+// Frees every arena. Objects still out are invalid afterwards
+void slab_free(Slab s);
+
+// Returns an object, or malloc() memory if size is larger than an object
+void* slab_alloc(Slab s, size_t size);
+
+// Takes back an object, or free()s memory the slab does not own
+void slab_release(Slab s, void* object);
+
+// True if object was carved out of the slab
+bool slab_owns(Slab s, const void* object);
+
+// Adds an arena if needed so count objects fit without another
+void slab_reserve(Slab s, size_t count);
+
+// Heap allocations the slab has made so far
+size_t slab_allocations(Slab s);
+
+#endif
@@ -0,0 +1,109 @@
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+bool snapshot_write(const char* path, uint64_t fingerprint,
+                    const KeyType* keys, const ValueType* values,
+                    size_t count) {
+    char tmp_path[strlen(path) + sizeof(".tmp")];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE* file = fopen(tmp_path, "wb");
+    if (file == NULL)
+        return false;
+
+    SnapshotHeader header = {SNAPSHOT_MAGIC, fingerprint, count, 0};
+    SnapshotEntry* entries = malloc((count + 1) * sizeof(SnapshotEntry));
+
+    for (size_t ix = 0; ix < count; ix++) {
+        size_t length = values[ix] ? strlen(values[ix]) : 0;
+
+        entries[ix]   = (SnapshotEntry){keys[ix], header.values_size, length};
+        header.values_size += length + 1;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(entries, sizeof(SnapshotEntry), count, file) == count;
+
+    for (size_t ix = 0; ok && ix < count; ix++) {
+        const char* value = values[ix] ? values[ix] : "";
+        ok = fwrite(value, entries[ix].value_length + 1, 1, file) == 1;
+    }
+
+    free(entries);
+    ok = fclose(file) == 0 && ok;
+
+    if (ok)
+        ok = rename(tmp_path, path) == 0;
+    else
+        remove(tmp_path);
+
+    return ok;
+}
+
+Snapshot snapshot_open(const char* path, uint64_t fingerprint) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat info;
+    void* map = MAP_FAILED;
+
+    if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(SnapshotHeader))
+        map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const SnapshotHeader* header = map;
+    size_t entries_size          = header->count * sizeof(SnapshotEntry);
+    size_t expected_size = sizeof(SnapshotHeader) + entries_size +
+                           header->values_size;
+
+    if (header->magic != SNAPSHOT_MAGIC || header->fingerprint != fingerprint ||
+        header->count > info.st_size / sizeof(SnapshotEntry) ||
+        expected_size != (size_t)info.st_size) {
+        munmap(map, info.st_size);
+        return NULL;
+    }
+
+    Snapshot snap  = malloc(sizeof(struct snapshot));
+    snap->map      = map;
+    snap->map_size = info.st_size;
+    snap->count    = header->count;
+    snap->entries  = (const SnapshotEntry*)(header + 1);
+    snap->values   = (const char*)(snap->entries + snap->count);
+
+    // bounds check only, so a truncated or corrupt file can't be read past
+    for (size_t ix = 0; ix < snap->count; ix++) {
+        const SnapshotEntry* entry = &snap->entries[ix];
+        if ((uint64_t)entry->value_offset + entry->value_length >=
+            header->values_size) {
+            snapshot_close(snap);
+            return NULL;
+        }
+    }
+
+    return snap;
+}
+
+ValueType snapshot_value(Snapshot snap, size_t index) {
+    const SnapshotEntry* entry = &snap->entries[index];
+    ValueType value            = malloc(entry->value_length + 1);
+
+    memcpy(value, snap->values + entry->value_offset, entry->value_length);
+    value[entry->value_length] = '\0';
+    return value;
+}
+
+void snapshot_close(Snapshot snap) {
+    munmap(snap->map, snap->map_size);
+    free(snap);
+}
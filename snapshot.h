@@ -0,0 +1,58 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cache.h"
+
+/*
+** Cache snapshot files, shared by the cache modules.
+**
+** Layout: a SnapshotHeader, then `count` SnapshotEntry records hottest first,
+** then a blob of NUL terminated values the entries point into.
+** Loading maps the file and hands the records back as they are; the module
+** only copies each value and rebuilds its own index.
+*/
+
+#define SNAPSHOT_MAGIC 0x31544F4E50414E53ULL  // "SNAPNOT1"
+
+typedef struct snapshotheader {
+    uint64_t magic;
+    uint64_t fingerprint;  // of the price table the values were solved for
+    uint64_t count;
+    uint64_t values_size;
+} SnapshotHeader;
+
+typedef struct snapshotentry {
+    uint64_t key;
+    uint32_t value_offset;  // into the value blob
+    uint32_t value_length;  // without the terminator
+} SnapshotEntry;
+
+typedef struct snapshot {
+    void* map;
+    size_t map_size;
+    size_t count;
+    const SnapshotEntry* entries;  // hottest first
+    const char* values;
+} *Snapshot;
+
+
+// Writes count entries, given hottest first, to path.
+// The file is replaced atomically. Returns false on failure
+bool snapshot_write(const char* path, uint64_t fingerprint,
+                    const KeyType* keys, const ValueType* values,
+                    size_t count);
+
+// Maps the snapshot at path. Returns NULL if it is missing, malformed or
+// was written for a different fingerprint
+Snapshot snapshot_open(const char* path, uint64_t fingerprint);
+
+// Returns an allocated copy of the value of an entry
+ValueType snapshot_value(Snapshot snap, size_t index);
+
+void snapshot_close(Snapshot snap);
+
+#endif
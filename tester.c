@@ -1,41 +1,188 @@
 #include <bsd/stdio.h>
 #include <bsd/stdlib.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "cache.h"
 #include "inputreader.h"
+#include "pricetable.h"
 #include "rodcutsolver.h"
+#include "server.h"
 #include "vec.h"
+#include "workload.h"
 
 /*
 ** This is a cache tester for NON-RECURSIVE functions.
 ** It does not support the provider function accessing the cache.
+**
+** --stress runs the provider from 1, 2, 4 ... up to N threads at once for
+** --duration seconds each, every thread drawing its own stream of keys
+** from 1..--max-key. Every value returned is compared with the solver's,
+** and each run reports its throughput, hit ratio and any mismatches.
+**
+** --shadow loads the module as a shadow instead, which keeps keys only, and
+** checks it counts the hits of a short key stream as any cache would.
+**
+** --checks round-trips the module's entries through a snapshot, a tier
+** below it, a hot swap and a price reload, checking every value against the
+** solver's. It also checks the binary price table, the vec key index and
+** a server answering one long burst of lines, which need no module. A check the module does not support is skipped.
 */
 
 #define TEST_COUNT 100
 #define MAX_TEST_NUMBER 100
 
+#define DEFAULT_STRESS_THREADS 8
+#define MAX_STRESS_THREADS 256
+#define DEFAULT_DURATION 2
+#define DEFAULT_MAX_KEY 1000
+#define DEFAULT_SKEW 1.0
+#define REPORTED_MISMATCHES 5  // printed in full, the rest only counted
+
+// the --shadow key stream, and the hits any cache holding two keys counts
+#define SHADOW_KEYS {5, 5, 5, 6, 6}
+#define SHADOW_HITS 3
+
+// --checks requests keys 1 to CHECK_KEYS, which fit any default capacity
+#define CHECK_KEYS 20
+#define CHECK_TOP_CAPACITY 4    // of the cache over a tier, so most go below
+#define CHECK_PRICE_RAISE 1000  // added to a price, to make answers stale
+#define INDEX_CHECK_PAIRS 500
+#define INDEX_CHECK_SPARSE_STRIDE 7919  // keys too far apart to index directly
+#define SERVER_CHECK_BYTES (4 << 20)  // of answers, more than the server queues
+#define SERVER_CHECK_WAIT 5000        // ms without progress before giving up
+#define SERVER_CHECK_TRIES 100        // to connect, 10 ms apart
+#define SERVER_CHECK_CHUNK (1 << 16)
+
+#define USAGE_FMT                                                           \
+    "Usage: %s lengths_file.txt [cache.so] [--stress[=THREADS]] "           \
+    "[--duration=SECONDS] [--max-key=N] [--capacity=N] "                    \
+    "[--generate=uniform|zipf] [--skew=X] [--seed=N] [--shadow] "           \
+    "[--checks]\n"
+
+// Settings of a --stress run
+typedef struct stress {
+    ProviderFunction provider;
+    bool owns_results;  // the provider is the solver, results are freed
+    Vec lengths;
+    char **answers;  // the solver's answer for every key
+    WorkloadType type;
+    size_t max_key;
+    double skew;
+    size_t seed;
+    atomic_bool stop;
+} Stress;
+
+// What one thread of a --stress run saw, on a cache line of its own
+typedef struct stressthread {
+    _Alignas(64) pthread_t thread;
+    Stress *stress;
+    size_t index;
+    size_t requests;
+    size_t mismatches;
+    size_t mismatched_keys[REPORTED_MISMATCHES];  // the first, distinct
+    size_t reported;
+} StressThread;
+
+volatile sig_atomic_t running_threads = 0;  // for the crash report
+
+size_t solver_calls        = 0;     // made through countingSolver()
+PriceChanges check_changes = NULL;  // of the --checks reload, for isStale()
+
 
 int rand_between(int min, int max);
+void runTests(ProviderFunction get_me_a_value, Vec lengths);
+// Runs 1, 2, 4 ... up to max_threads threads against stress->provider
+// Returns false if any value did not match the solver's
+bool runStress(Stress *stress, Cache *cache, size_t max_threads,
+               size_t duration);
+// Shows SHADOW_KEYS to module loaded as a shadow of the solver
+// Returns false if it did not count SHADOW_HITS
+bool runShadowCheck(const char *module, Vec lengths);
+// Runs every --checks check, those of module only if it is not NULL
+// Returns false if any of them failed
+bool runChecks(const char *module, Vec lengths);
 
 
 int main(int argc, char *argv[]) {
-    if (argc < 2 || argc > 3) {
-        fprintf(stderr, "Usage: %s lengths_file.txt [cache.so]\n", argv[0]);
+    const char *lengths_file = NULL;
+    const char *module       = NULL;
+    const char *generate     = "zipf";
+    size_t stress_threads    = 0;
+    size_t duration          = DEFAULT_DURATION;
+    size_t max_key           = DEFAULT_MAX_KEY;
+    size_t capacity          = 0;
+    size_t seed              = 1;
+    double skew              = DEFAULT_SKEW;
+    bool shadow              = false;
+    bool checks              = false;
+
+    for (int ix = 1; ix < argc; ix++) {
+        const char *value = NULL;
+        bool valid        = true;
+
+        if (matchFlag(argv[ix], "stress", &value)) {
+            stress_threads = DEFAULT_STRESS_THREADS;
+            valid = value == NULL || (parseSize(value, &stress_threads) &&
+                                      stress_threads > 0 &&
+                                      stress_threads <= MAX_STRESS_THREADS);
+        } else if (matchFlag(argv[ix], "duration", &value))
+            valid = parseSize(value, &duration) && duration > 0;
+        else if (matchFlag(argv[ix], "max-key", &value))
+            valid = parseSize(value, &max_key) && max_key > 0 &&
+                    max_key <= MAX_ROD_LENGTH;
+        else if (matchFlag(argv[ix], "capacity", &value))
+            valid = parseSize(value, &capacity) && capacity > 0;
+        else if (matchFlag(argv[ix], "generate", &value))
+            valid = (generate = value) != NULL;
+        else if (matchFlag(argv[ix], "skew", &value))
+            valid = value != NULL && (skew = atof(value)) > 0;
+        else if (matchFlag(argv[ix], "seed", &value))
+            valid = parseSize(value, &seed);
+        else if (matchFlag(argv[ix], "shadow", &value))
+            valid = (shadow = value == NULL);
+        else if (matchFlag(argv[ix], "checks", &value))
+            valid = (checks = value == NULL);
+        else if (strncmp(argv[ix], "--", 2) != 0 && lengths_file == NULL)
+            lengths_file = argv[ix];
+        else if (strncmp(argv[ix], "--", 2) != 0 && module == NULL)
+            module = argv[ix];
+        else
+            valid = false;
+
+        if (!valid) {
+            printErr(FLAG_INVALID, argv[ix], COMMAND_LINE_ARG_SIZE);
+            fprintf(stderr, USAGE_FMT, argv[0]);
+            return 1;
+        }
+    }
+
+    WorkloadType type;
+    if (lengths_file == NULL || !parseWorkloadType(generate, &type) ||
+        (shadow && (module == NULL || stress_threads > 0)) ||
+        (checks && (shadow || stress_threads > 0))) {
+        fprintf(stderr, USAGE_FMT, argv[0]);
         return 1;
     }
 
     // base (real) function
     ProviderFunction get_me_a_value = solveRodCutting;
 
-    bool cache_installed            = argc > 2;
+    bool cache_installed            = module != NULL && !shadow && !checks;
     Cache *cache                    = NULL;
 
     if (cache_installed) {
-        cache = load_cache_module(argv[2]);
+        cache = load_cache_module(module);
 
         if (cache == NULL) {
             fprintf(stderr, "Failed to load cache module\n");
@@ -43,18 +190,67 @@ int main(int argc, char *argv[]) {
         }
         // replace our real provider with a caching provider
         get_me_a_value = cache->set_provider_func(get_me_a_value);
+
+        if (capacity > 0)
+            cache->set_capacity(capacity, capacity, 0);
     }
 
-    printf("\nReading file '%s'...\n", argv[1]);
-    Vec lengths = extractFile(argv[1]);
+    printf("\nReading file '%s'...\n", lengths_file);
+    PriceTable price_table = NULL;
+    Vec lengths =
+        loadPrices(lengths_file, stress_threads == 0, &price_table);
 
     if (lengths == NULL || vec_length(lengths) == 0) {
         fprintf(stderr, "File is invalid or contains no valid lengths\n");
-        if (lengths != NULL)
-            vec_free(lengths);
+        freePrices(lengths, price_table);
         return 1;
     }
 
+    bool passed = true;
+
+    if (shadow) {
+        passed = runShadowCheck(module, lengths);
+    } else if (checks) {
+        passed = runChecks(module, lengths);
+    } else if (stress_threads > 0) {
+        Stress stress = {get_me_a_value, !cache_installed, lengths, NULL,
+                         type, max_key, skew, seed, false};
+
+        // the reference answers come straight from the solver
+        stress.answers = malloc((max_key + 1) * sizeof(char *));
+        for (size_t key = 1; key <= max_key; key++)
+            stress.answers[key] = solveRodCutting(lengths, key);
+
+        passed = runStress(&stress, cache, stress_threads, duration);
+
+        for (size_t key = 1; key <= max_key; key++)
+            free(stress.answers[key]);
+        free(stress.answers);
+    } else {
+        runTests(get_me_a_value, lengths);
+    }
+
+    if (cache_installed) {
+        printf("\n\n");
+
+        CacheStat *list_of_stats = cache->get_statistics();
+        print_cache_stats(fileno(stdout), list_of_stats);
+
+        if (list_of_stats)
+            free(list_of_stats);
+
+        printf("\n\n");
+
+        cache->cache_cleanup();
+        free(cache);
+    }
+
+    freePrices(lengths, price_table);
+    freeSolverWorkspace();
+    return passed ? 0 : 1;
+}
+
+void runTests(ProviderFunction get_me_a_value, Vec lengths) {
     // get a random key, and get the value associated with it
     // then get the value a second time to test if cached correctly
     for (int test_number = 0; test_number < TEST_COUNT; test_number++) {
@@ -80,26 +276,629 @@ int main(int argc, char *argv[]) {
         //     cache->reset_statistics();
         // }
     }
+}
 
-    if (cache_installed) {
-        printf("\n\n");
+int rand_between(int min, int max) {
+    int range = max - min;
+    return min + arc4random_uniform(range);
+}
 
-        CacheStat *list_of_stats = cache->get_statistics();
-        print_cache_stats(fileno(stdout), list_of_stats);
 
-        if (list_of_stats)
-            free(list_of_stats);
+// Helper function for reportCrash()
+// Writes value in decimal to stderr with write(), safe in a signal handler
+void writeNumber(size_t value) {
+    char digits[20];
+    size_t start = sizeof(digits);
 
-        printf("\n\n");
+    do {
+        digits[--start] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
 
-        cache->cache_cleanup();
-        free(cache);
+    write(STDERR_FILENO, digits + start, sizeof(digits) - start);
+}
+
+// Reports which run a crash happened in, then crashes as it would have
+void reportCrash(int signal_number) {
+    const char crashed[] = "\nStress test crashed with signal ";
+    const char running[] = " while running threads: ";
+
+    write(STDERR_FILENO, crashed, sizeof(crashed) - 1);
+    writeNumber(signal_number);
+    write(STDERR_FILENO, running, sizeof(running) - 1);
+    writeNumber(running_threads);
+    write(STDERR_FILENO, "\n", 1);
+
+    signal(signal_number, SIG_DFL);
+    raise(signal_number);
+}
+
+void *stressThread(void *arg) {
+    StressThread *self = arg;
+    Stress *stress     = self->stress;
+    Workload load      = new_workload(stress->type, stress->max_key,
+                                      stress->skew, stress->seed + self->index);
+
+    while (!atomic_load_explicit(&stress->stop, memory_order_relaxed)) {
+        size_t key       = workload_next(load);
+        ValueType result = stress->provider(stress->lengths, key);
+
+        if (result == NULL || strcmp(result, stress->answers[key]) != 0) {
+            size_t seen = 0;
+            while (seen < self->reported && self->mismatched_keys[seen] != key)
+                seen++;
+
+            if (seen == self->reported && seen < REPORTED_MISMATCHES)
+                self->mismatched_keys[self->reported++] = key;
+            self->mismatches++;
+        }
+        if (stress->owns_results)
+            free(result);
+        self->requests++;
     }
 
-    vec_free(lengths);
+    workload_free(load);
+    freeSolverWorkspace();
+    return NULL;
 }
 
-int rand_between(int min, int max) {
-    int range = max - min;
-    return min + arc4random_uniform(range);
+// Runs count threads for duration seconds and prints what they saw
+// Returns the number of mismatched values
+size_t stressRun(Stress *stress, Cache *cache, StressThread threads[],
+                 size_t count, size_t duration) {
+    if (cache != NULL)
+        cache->reset_statistics();
+
+    running_threads = count;
+    atomic_store(&stress->stop, false);
+
+    for (size_t ix = 0; ix < count; ix++) {
+        threads[ix] = (StressThread){.stress = stress, .index = ix};
+        pthread_create(&threads[ix].thread, NULL, stressThread, &threads[ix]);
+    }
+
+    sleep(duration);
+    atomic_store(&stress->stop, true);
+
+    size_t requests = 0, mismatches = 0;
+    for (size_t ix = 0; ix < count; ix++) {
+        pthread_join(threads[ix].thread, NULL);
+        requests += threads[ix].requests;
+        mismatches += threads[ix].mismatches;
+    }
+
+    printf("%4zu threads: %12.0f requests/s", count,
+           (double)requests / duration);
+
+    if (cache != NULL) {
+        CacheStat *stats = cache->get_statistics();
+        int total        = get_cache_stat(stats, Cache_requests);
+        int hits         = get_cache_stat(stats, Cache_hits);
+        free(stats);
+        printf("  %5.1f%% hits", total > 0 ? 100.0 * hits / total : 0);
+    }
+    printf("  %zu mismatches\n", mismatches);
+
+    for (size_t ix = 0; ix < count; ix++)
+        for (size_t m = 0; m < threads[ix].reported; m++)
+            printf("      thread %zu got a wrong value for %zu\n", ix,
+                   threads[ix].mismatched_keys[m]);
+
+    return mismatches;
+}
+
+bool runStress(Stress *stress, Cache *cache, size_t max_threads,
+               size_t duration) {
+    StressThread *threads   = calloc(max_threads, sizeof(StressThread));
+    size_t total_mismatches = 0;
+
+    signal(SIGSEGV, reportCrash);
+    signal(SIGBUS, reportCrash);
+    signal(SIGABRT, reportCrash);
+
+    printf("\nStress test: %zu keys (%s), %zu s for each thread count\n",
+           stress->max_key, stress->type == WORKLOAD_ZIPF ? "zipf" : "uniform",
+           duration);
+
+    // 1, 2, 4 ... threads, and max_threads last even if it is not a power
+    for (size_t count = 1;; count = 2 * count < max_threads ? 2 * count
+                                                            : max_threads) {
+        total_mismatches +=
+            stressRun(stress, cache, threads, count, duration);
+        if (count == max_threads)
+            break;
+    }
+
+    running_threads = 0;
+    free(threads);
+    return total_mismatches == 0;
+}
+
+bool runShadowCheck(const char *module, Vec lengths) {
+    const KeyType keys[] = SHADOW_KEYS;
+    const size_t count   = sizeof(keys) / sizeof(keys[0]);
+
+    if (!load_shadow_module(module)) {
+        fprintf(stderr, "Failed to load shadow module\n");
+        return false;
+    }
+
+    ProviderFunction provider = add_shadows(solveRodCutting);
+    for (size_t ix = 0; ix < count; ix++)
+        free(provider(lengths, keys[ix]));
+
+    fflush(stdout);
+    print_shadow_stats(fileno(stdout));
+
+    CacheStat *stats = get_shadow_stats(0);
+    int hits         = get_cache_stat(stats, Cache_hits);
+    free(stats);
+    cleanup_shadows();
+
+    printf("\nShadow check: %d hits of %zu requests, expected %d\n", hits,
+           count, SHADOW_HITS);
+    return hits == SHADOW_HITS;
+}
+
+
+// The solver, counting how often it is asked
+ValueType countingSolver(Vec lengths, KeyType key) {
+    solver_calls++;
+    return solveRodCutting(lengths, key);
+}
+
+// Requests keys 1 to CHECK_KEYS from provider
+// Returns false if any value differs from what the solver gives for lengths
+bool requestCheckKeys(ProviderFunction provider, Vec lengths) {
+    bool matched = true;
+
+    for (KeyType key = 1; key <= CHECK_KEYS; key++) {
+        ValueType expected = solveRodCutting(lengths, key);
+        ValueType result   = provider(lengths, key);
+
+        if (result == NULL || strcmp(result, expected) != 0) {
+            printf("      wrong value for %zu\n", (size_t)key);
+            matched = false;
+        }
+        free(expected);
+    }
+    return matched;
+}
+
+// Loads module again, after the first check loaded it once
+// Returns NULL, having said the check is skipped, if it cannot be
+Cache *loadAnother(const char *module, const char *check) {
+    Cache *cache = load_cache_module(module);
+    if (cache == NULL)
+        printf("%s check: skipped, the module cannot be loaded twice\n",
+               check);
+    return cache;
+}
+
+void freeCache(Cache *cache) {
+    cache->cache_cleanup();
+    free(cache);
+}
+
+// True if a second instance of module finds what the first one holds, as
+// one that shares its entries between processes does
+bool sharesEntries(const char *module, Vec lengths) {
+    Cache *first  = load_cache_module(module);
+    Cache *second = first ? load_cache_module(module) : NULL;
+    bool shared   = false;
+
+    if (second != NULL) {
+        first->set_provider_func(solveRodCutting)(lengths, 1);
+
+        solver_calls = 0;
+        second->set_provider_func(countingSolver)(lengths, 1);
+        shared = solver_calls == 0;
+        freeCache(second);
+    }
+    if (first != NULL)
+        freeCache(first);
+    return shared;
+}
+
+// Saves a snapshot of CHECK_KEYS entries, and restores it in another
+// instance, which must then answer every key without the solver
+bool runSnapshotCheck(const char *module, Vec lengths) {
+    char path[]          = "/tmp/testersnapXXXXXX";
+    int fd               = mkstemp(path);
+    uint64_t fingerprint = fingerprintPrices(lengths);
+
+    if (fd < 0) {
+        perror("Snapshot check");
+        return false;
+    }
+    close(fd);
+
+    Cache *saved = load_cache_module(module);
+    if (saved == NULL) {
+        unlink(path);
+        return false;
+    }
+    bool matched = requestCheckKeys(saved->set_provider_func(solveRodCutting),
+                                    lengths);
+    bool written = saved->save_snapshot(path, fingerprint);
+    freeCache(saved);
+
+    Cache *restored = written ? loadAnother(module, "Snapshot") : NULL;
+    if (restored == NULL) {
+        if (!written)
+            printf("Snapshot check: skipped, the module takes no snapshots\n");
+        unlink(path);
+        return matched;
+    }
+
+    ProviderFunction provider = restored->set_provider_func(countingSolver);
+    int mismatched = restored->load_snapshot(path, fingerprint + 1);
+    int count      = restored->load_snapshot(path, fingerprint);
+
+    solver_calls   = 0;
+    matched        = requestCheckKeys(provider, lengths) && matched;
+    freeCache(restored);
+    unlink(path);
+
+    printf("Snapshot check: %d of %d entries restored, %zu solved again, "
+           "%s\n", count, CHECK_KEYS, solver_calls,
+           mismatched < 0 ? "other prices refused" : "OTHER PRICES TAKEN");
+    return matched && mismatched < 0 && count == CHECK_KEYS &&
+           solver_calls == 0;
+}
+
+// Requests every key through a small cache with the module as a tier below
+// it, so most are demoted. Every key must then be found in one or the other
+bool runTierCheck(const char *module, Vec lengths) {
+    Cache *top = loadAnother(module, "Tier");
+    if (top == NULL)
+        return true;
+
+    if (!load_tier_module(module, CHECK_KEYS)) {
+        printf("Tier check: skipped, the module cannot be loaded twice\n");
+        freeCache(top);
+        return true;
+    }
+
+    ProviderFunction provider =
+        top->set_provider_func(add_tiers(top, countingSolver));
+    top->set_capacity(CHECK_TOP_CAPACITY, CHECK_TOP_CAPACITY, 0);
+
+    bool matched = requestCheckKeys(provider, lengths);
+    solver_calls = 0;
+    matched      = requestCheckKeys(provider, lengths) && matched;
+
+    fflush(stdout);
+    print_tier_stats(fileno(stdout));
+    freeCache(top);
+    cleanup_tiers();
+
+    printf("\nTier check: %zu of %d keys solved again\n", solver_calls,
+           CHECK_KEYS);
+    return matched && solver_calls == 0;
+}
+
+// Hot swaps a cache of CHECK_KEYS entries for another instance, which must
+// then answer every key without the solver
+bool runSwapCheck(const char *module, Vec lengths) {
+    Cache *from = loadAnother(module, "Swap");
+    if (from == NULL)
+        return true;
+
+    bool matched = requestCheckKeys(from->set_provider_func(solveRodCutting),
+                                    lengths);
+
+    Cache *to = loadAnother(module, "Swap");
+    if (to == NULL) {
+        freeCache(from);
+        return matched;
+    }
+
+    ProviderFunction provider = to->set_provider_func(countingSolver);
+    size_t moved = migrate_cache(from, to, fingerprintPrices(lengths));
+
+    solver_calls = 0;
+    matched      = requestCheckKeys(provider, lengths) && matched;
+    freeCache(to);
+
+    if (moved == 0) {
+        printf("Swap check: skipped, the module exports no entries\n");
+        return matched;
+    }
+    printf("Swap check: %zu entries moved, %zu solved again\n", moved,
+           solver_calls);
+    return matched && moved == CHECK_KEYS && solver_calls == 0;
+}
+
+bool isStale(KeyType key, const char *value) {
+    return isAnswerStale(check_changes, key, value);
+}
+
+// Raises the price of the longest length of the first CHECK_KEYS, and
+// invalidates a cache of all of them. Exactly the keys it dropped must be
+// solved again, and every answer must be the one for the new prices
+bool runReloadCheck(const char *module, Vec lengths) {
+    Cache *cache = loadAnother(module, "Reload");
+    if (cache == NULL)
+        return true;
+
+    ProviderFunction provider = cache->set_provider_func(countingSolver);
+    bool matched              = requestCheckKeys(provider, lengths);
+
+    Vec raised       = vec_copy(lengths);
+    KeyPair *longest = NULL;
+    for (size_t ix = 0; ix < vec_length(raised); ix++) {
+        KeyPair *pair = vec_get(raised, ix);
+        if (pair->key <= CHECK_KEYS && (!longest || pair->key > longest->key))
+            longest = pair;
+    }
+    if (longest != NULL)
+        longest->value += CHECK_PRICE_RAISE;
+
+    check_changes  = comparePrices(lengths, raised);
+    size_t removed = invalidate_caches(cache, isStale);
+
+    solver_calls   = 0;
+    if (removed != INVALIDATE_UNSUPPORTED)
+        matched = requestCheckKeys(provider, raised) && matched;
+
+    freePriceChanges(check_changes);
+    check_changes = NULL;
+    vec_free(raised);
+    freeCache(cache);
+
+    if (removed == INVALIDATE_UNSUPPORTED) {
+        printf("Reload check: skipped, the module cannot invalidate\n");
+        return matched;
+    }
+    printf("Reload check: %zu of %d entries dropped, %zu solved again\n",
+           removed, CHECK_KEYS, solver_calls);
+    return matched && longest != NULL && removed > 0 &&
+           solver_calls == removed;
+}
+
+// Writes lengths as a binary price table and maps it back, then checks a
+// truncated copy is refused
+bool runTableCheck(Vec lengths) {
+    char path[] = "/tmp/testerpricesXXXXXX";
+    int fd      = mkstemp(path);
+
+    if (fd < 0) {
+        perror("Table check");
+        return false;
+    }
+    close(fd);
+
+    bool written     = writePriceTable(path, lengths);
+    PriceTable table = written && isPriceTableFile(path) ? openPriceTable(path)
+                                                         : NULL;
+    size_t wrong     = 0;
+
+    if (table != NULL) {
+        for (size_t ix = 0; ix < vec_length(lengths); ix++) {
+            KeyPair *pair   = vec_get(lengths, ix);
+            KeyPair *mapped = vec_find_pair(table->prices, pair->key);
+
+            if (mapped == NULL ||
+                mapped->value != vec_find_pair(lengths, pair->key)->value)
+                wrong++;
+        }
+        if (table->fingerprint != fingerprintPrices(lengths))
+            wrong++;
+        closePriceTable(table);
+    }
+
+    // the last pair cut in half
+    bool truncated = written && truncate(path, sizeof(PriceTableHeader) +
+                                                   vec_length(lengths) *
+                                                       sizeof(KeyPair) -
+                                                   sizeof(KeyPair) / 2) == 0;
+    PriceTable broken = truncated ? openPriceTable(path) : NULL;
+    if (broken != NULL)
+        closePriceTable(broken);
+    unlink(path);
+
+    printf("Table check: %s, %zu of %zu prices wrong, truncated table %s\n",
+           table ? "mapped" : "NOT MAPPED", wrong, vec_length(lengths),
+           broken ? "TAKEN" : "refused");
+    return table != NULL && wrong == 0 && truncated && broken == NULL;
+}
+
+// Index of the first pair with key, found by a scan, or -1
+long scanForKey(Vec pairs, size_t key) {
+    for (size_t ix = 0; ix < vec_length(pairs); ix++)
+        if (((KeyPair *)vec_get(pairs, ix))->key == key)
+            return ix;
+    return -1;
+}
+
+// Counts the multiples of stride up to max_key, and the keys just after
+// them, that vec_find_pair() finds elsewhere than a scan does
+size_t countWrongLookups(Vec pairs, size_t max_key, size_t stride,
+                         size_t *lookups) {
+    size_t wrong = 0;
+
+    for (size_t base = 0; base <= max_key; base += stride) {
+        size_t last = stride > 1 ? base + 1 : base;
+
+        for (size_t key = base; key <= last; key++) {
+            KeyPair *found = vec_find_pair(pairs, key);
+            long index = found ? found - (KeyPair *)vec_items(pairs) : -1;
+
+            if (index != scanForKey(pairs, key))
+                wrong++;
+            (*lookups)++;
+        }
+    }
+    return wrong;
+}
+
+// Looks up every key of unsorted pairs with duplicates, directly indexed and
+// hashed, before and after indexing and after adding to an indexed vec
+bool runIndexCheck(void) {
+    const size_t strides[] = {1, INDEX_CHECK_SPARSE_STRIDE};
+    size_t wrong           = 0;
+    size_t lookups         = 0;
+
+    for (size_t layout = 0; layout < 2; layout++) {
+        size_t stride  = strides[layout];
+        size_t max_key = INDEX_CHECK_PAIRS * stride;
+        Vec pairs      = new_vec(sizeof(KeyPair));
+
+        for (size_t ix = 0; ix < INDEX_CHECK_PAIRS; ix++) {
+            KeyPair pair =
+                createKeyPair(arc4random_uniform(INDEX_CHECK_PAIRS) * stride,
+                              ix);
+            vec_add(pairs, &pair);
+        }
+        wrong += countWrongLookups(pairs, max_key, stride, &lookups);
+
+        vec_index_keys(pairs);
+        wrong += countWrongLookups(pairs, max_key, stride, &lookups);
+
+        for (size_t ix = 0; ix < INDEX_CHECK_PAIRS; ix++) {
+            KeyPair pair = createKeyPair(
+                (arc4random_uniform(INDEX_CHECK_PAIRS) + 1) * stride, ix);
+            vec_add(pairs, &pair);
+        }
+        wrong += countWrongLookups(pairs, max_key + stride, stride, &lookups);
+
+        vec_free(pairs);
+    }
+
+    printf("Index check: %zu lookups, %zu wrong\n", lookups, wrong);
+    return wrong == 0;
+}
+
+// Answers a length for the server check, straight from the solver
+CacheValue answerCheckLength(void *lengths, size_t length) {
+    return cache_value_adopt(solveRodCutting(lengths, length));
+}
+
+// Connects to the server at path, giving it time to start listening
+// Returns -1 if it never does
+int connectToServer(const char *path) {
+    for (int tries = 0; tries < SERVER_CHECK_TRIES; tries++) {
+        int fd = openSocket(path, false);
+        if (fd >= 0)
+            return fd;
+        usleep(10000);
+    }
+    return -1;
+}
+
+// Sends request while reading the answers to it, until expected bytes of
+// them have come
+// Returns the bytes received, fewer if the server stopped answering
+size_t exchangeWithServer(int fd, const char *request, size_t length,
+                          size_t expected) {
+    char *buffer    = malloc(SERVER_CHECK_CHUNK);
+    size_t sent     = 0;
+    size_t received = 0;
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    while (received < expected) {
+        struct pollfd poller = {fd, POLLIN | (sent < length ? POLLOUT : 0), 0};
+        if (poll(&poller, 1, SERVER_CHECK_WAIT) <= 0)
+            break;
+
+        if (poller.revents & POLLOUT) {
+            ssize_t written = write(fd, request + sent, length - sent);
+            if (written > 0)
+                sent += written;
+        }
+        if (poller.revents & (POLLIN | POLLHUP)) {
+            ssize_t got = read(fd, buffer, SERVER_CHECK_CHUNK);
+            if (got <= 0)
+                break;
+            received += got;
+        }
+    }
+
+    free(buffer);
+    return received;
+}
+
+// Pipelines keys 1 to CHECK_KEYS over and over to a server in a child
+// process, without ever closing the sending side, until their answers come
+// to more than the server queues. Every answer must still arrive
+bool runServerCheck(Vec lengths) {
+    char path[] = "/tmp/testersockXXXXXX";
+    int fd      = mkstemp(path);
+
+    if (fd < 0) {
+        perror("Server check");
+        return false;
+    }
+    close(fd);
+
+    // each line is answered with the solver's text and an empty line
+    size_t answer_bytes[CHECK_KEYS + 1];
+    size_t round_bytes = 0;
+    for (KeyType key = 1; key <= CHECK_KEYS; key++) {
+        ValueType answer  = solveRodCutting(lengths, key);
+        answer_bytes[key] = strlen(answer) + 1;
+        round_bytes += answer_bytes[key];
+        free(answer);
+    }
+
+    size_t rounds   = SERVER_CHECK_BYTES / round_bytes + 1;
+    char *request   = malloc(rounds * CHECK_KEYS * 4);
+    size_t length   = 0;
+    size_t expected = 0;
+    for (size_t round = 0; round < rounds; round++)
+        for (KeyType key = 1; key <= CHECK_KEYS; key++) {
+            length += sprintf(request + length, "%zu\n", (size_t)key);
+            expected += answer_bytes[key];
+        }
+
+    fflush(stdout);
+    pid_t server = fork();
+    if (server == 0) {
+        freopen("/dev/null", "w", stdout);
+        _exit(serveLengths(path, answerCheckLength, NULL, lengths) ? 0 : 1);
+    }
+
+    fd              = server > 0 ? connectToServer(path) : -1;
+    size_t received = fd >= 0 ? exchangeWithServer(fd, request, length,
+                                                   expected)
+                              : 0;
+    if (fd >= 0)
+        close(fd);
+    if (server > 0) {
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+    }
+    unlink(path);
+    free(request);
+
+    printf("Server check: %zu of %zu bytes answered to %zu lines sent at "
+           "once\n", received, expected, rounds * CHECK_KEYS);
+    return received == expected;
+}
+
+// The snapshot check loads the module first, so only it fails if the
+// module cannot be loaded at all
+bool runChecks(const char *module, Vec lengths) {
+    printf("\n");
+    bool passed = runTableCheck(lengths);
+    passed      = runIndexCheck() && passed;
+    passed      = runServerCheck(lengths) && passed;
+
+    if (module != NULL) {
+        passed = runSnapshotCheck(module, lengths) && passed;
+
+        // a tier would be the very same cache
+        if (sharesEntries(module, lengths))
+            printf("Tier check: skipped, instances of the module share "
+                   "their entries\n");
+        else
+            passed = runTierCheck(module, lengths) && passed;
+        passed = runSwapCheck(module, lengths) && passed;
+        passed = runReloadCheck(module, lengths) && passed;
+    }
+
+    printf("\nChecks %s\n", passed ? "passed" : "FAILED");
+    return passed;
 }
@@ -0,0 +1,170 @@
+#include "trace.h"
+
+#ifdef DEBUG
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_SIGNAL SIGUSR1
+#define TRACE_MASK (TRACE_RING_EVENTS - 1)
+#define TRACE_PATH_SIZE 128
+
+// One thread's last events. Only that thread writes them
+typedef struct tracering {
+    TraceEvent events[TRACE_RING_EVENTS];
+    uint64_t written;
+    uint32_t thread;
+    struct tracering* next;
+} TraceRing;
+
+pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+_Atomic(TraceRing*) all_rings = NULL;  // every thread's, kept past exit
+uint32_t ring_count           = 0;
+__thread TraceRing* thread_ring = NULL;
+
+// set up with the first ring, so the signal handler only writes
+char trace_path[TRACE_PATH_SIZE];
+TraceFileHeader trace_header;
+struct sigaction previous_action;
+bool handling_signal = false;
+
+
+void _dump_on_signal(int signal_number, siginfo_t* info, void* context);
+
+// Helper function for _register_thread()
+// Names the dump after the module's source file, without its directory
+// and extension
+void _name_dump(const char* module) {
+    const char* name = strrchr(module, '/');
+    name             = name != NULL ? name + 1 : module;
+    size_t length    = strcspn(name, ".");
+
+    trace_header.magic       = TRACE_MAGIC;
+    trace_header.ring_events = TRACE_RING_EVENTS;
+    snprintf(trace_header.module, TRACE_MODULE_SIZE, "%s", name);
+    snprintf(trace_path, TRACE_PATH_SIZE, "%.*s.%ld.trace", (int)length, name,
+             (long)getpid());
+
+    struct sigaction action = {0};
+    action.sa_sigaction     = _dump_on_signal;
+    action.sa_flags         = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    handling_signal = sigaction(TRACE_SIGNAL, &action, &previous_action) == 0;
+}
+
+// Helper function for trace_event()
+TraceRing* _register_thread(const char* module) {
+    TraceRing* ring = calloc(1, sizeof(TraceRing));
+
+    pthread_mutex_lock(&rings_lock);
+    if (ring_count == 0)
+        _name_dump(module);
+
+    ring->thread = ring_count++;
+    ring->next   = atomic_load(&all_rings);
+    atomic_store(&all_rings, ring);  // whole before the handler can see it
+    pthread_mutex_unlock(&rings_lock);
+
+    return ring;
+}
+
+void trace_event(const char* module, TraceEventType type, KeyType key,
+                 size_t slot) {
+    if (thread_ring == NULL)
+        thread_ring = _register_thread(module);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    TraceEvent* event = &thread_ring->events[thread_ring->written & TRACE_MASK];
+    event->time       = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    event->key        = key;
+    event->slot       = slot < TRACE_NO_SLOT ? slot : TRACE_NO_SLOT;
+    event->type       = type;
+    thread_ring->written++;
+}
+
+
+// Writes every ring to the dump file, with only open(), write() and close(),
+// so it is safe in a signal handler
+void _dump(void) {
+    int fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+
+    TraceRing* first = atomic_load(&all_rings);
+    TraceFileHeader header = trace_header;
+    header.ring_count      = 0;
+    for (TraceRing* ring = first; ring != NULL; ring = ring->next)
+        header.ring_count++;
+
+    bool ok = write(fd, &header, sizeof(header)) == sizeof(header);
+
+    for (TraceRing* ring = first; ok && ring != NULL; ring = ring->next) {
+        uint64_t written = ring->written;
+        uint64_t count   = written < TRACE_RING_EVENTS ? written
+                                                       : TRACE_RING_EVENTS;
+        TraceRingHeader ring_header = {ring->thread, count, written - count};
+        ok = write(fd, &ring_header, sizeof(ring_header)) ==
+             sizeof(ring_header);
+
+        // oldest first: from the write position to the end, then the start
+        size_t start = (written - count) & TRACE_MASK;
+        size_t tail  = count < TRACE_RING_EVENTS - start
+                           ? count
+                           : TRACE_RING_EVENTS - start;
+
+        if (ok)
+            ok = write(fd, &ring->events[start], tail * sizeof(TraceEvent)) ==
+                 (ssize_t)(tail * sizeof(TraceEvent));
+        if (ok && count > tail)
+            ok = write(fd, ring->events, (count - tail) * sizeof(TraceEvent)) ==
+                 (ssize_t)((count - tail) * sizeof(TraceEvent));
+    }
+    close(fd);
+}
+
+// Dumps, then passes the signal on to whatever handled it before
+void _dump_on_signal(int signal_number, siginfo_t* info, void* context) {
+    _dump();
+
+    if (previous_action.sa_flags & SA_SIGINFO)
+        previous_action.sa_sigaction(signal_number, info, context);
+    else if (previous_action.sa_handler != SIG_DFL &&
+             previous_action.sa_handler != SIG_IGN)
+        previous_action.sa_handler(signal_number);
+}
+
+
+// Dumps at dlclose() or exit, and frees the rings
+__attribute__((destructor)) void _dump_on_unload(void) {
+    if (ring_count == 0)
+        return;
+
+    // put the handler back while this code is still mapped, unless another
+    // module has since installed one of its own over it
+    struct sigaction current;
+    if (handling_signal && sigaction(TRACE_SIGNAL, NULL, &current) == 0 &&
+        current.sa_sigaction == _dump_on_signal)
+        sigaction(TRACE_SIGNAL, &previous_action, NULL);
+
+    _dump();
+
+    pthread_mutex_lock(&rings_lock);
+    TraceRing* ring = atomic_exchange(&all_rings, NULL);
+    while (ring != NULL) {
+        TraceRing* next = ring->next;
+        free(ring);
+        ring = next;
+    }
+    ring_count = 0;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+#endif
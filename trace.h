@@ -0,0 +1,76 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cache.h"
+
+/*
+** Binary event tracing, shared by the cache modules and compiled in only
+** for the debug libraries (libdebug-*.so).
+**
+** TRACE() records a fixed-size event in a ring of the calling thread's own,
+** so the hot path takes no lock and does no I/O. Each ring keeps the last
+** TRACE_RING_EVENTS events of its thread. Every ring is dumped to
+** <module>.<pid>.trace in the working directory when the module is
+** unloaded or the process exits, and on SIGUSR1 while the module is loaded.
+** A dump taken on the signal may catch an event half written. Decode a
+** dump with ./tracedump.
+**
+** Layout: a TraceFileHeader, then for each ring a TraceRingHeader and its
+** `count` events, oldest first.
+*/
+
+#define TRACE_MAGIC 0x3145434152544352ULL  // "RCTRACE1"
+#define TRACE_RING_EVENTS (1 << 16)        // a power of two
+#define TRACE_MODULE_SIZE 64
+#define TRACE_NO_SLOT UINT32_MAX
+
+typedef enum traceeventtype {
+    TRACE_PRESENT,  // lookup found the key
+    TRACE_ABSENT,   // lookup missed
+    TRACE_GET,      // a hit's value was taken
+    TRACE_INSERT,   // slot is where it went
+    TRACE_EVICT,    // slot is where it was
+    TRACE_TOUCH,    // recency updated, slot is the key's
+    TRACE_TYPE_COUNT
+} TraceEventType;
+
+typedef struct traceevent {
+    uint64_t time;  // CLOCK_MONOTONIC nanoseconds
+    uint64_t key;
+    uint32_t slot;  // module specific, or TRACE_NO_SLOT
+    uint32_t type;
+} TraceEvent;
+
+typedef struct tracefileheader {
+    uint64_t magic;
+    uint32_t ring_count;
+    uint32_t ring_events;
+    char module[TRACE_MODULE_SIZE];  // source file of the module
+} TraceFileHeader;
+
+typedef struct traceringheader {
+    uint32_t thread;   // in the order threads first traced
+    uint32_t count;
+    uint64_t dropped;  // older events overwritten
+} TraceRingHeader;
+
+
+#ifdef DEBUG
+
+// Records an event in the calling thread's ring. module is the caller's
+// __FILE__, kept for the dump
+void trace_event(const char* module, TraceEventType type, KeyType key,
+                 size_t slot);
+
+#define TRACE(type, key, slot) trace_event(__FILE__, type, key, slot)
+
+#else
+
+#define TRACE(type, key, slot)
+
+#endif
+
+#endif
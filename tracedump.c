@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inputreader.h"
+#include "trace.h"
+
+/*
+** Trace decoder.
+** Reads a dump written by a debug cache module (see trace.h) and prints its
+** events as the debug libraries used to, every thread's merged in the order
+** they happened. --verbose adds when each event happened, the thread that
+** recorded it and its slot.
+*/
+
+#define USAGE_FMT "Usage: %s module.pid.trace [--verbose]\n"
+
+// An event and the thread that recorded it
+typedef struct threadevent {
+    TraceEvent event;
+    uint32_t thread;
+    size_t order;  // in the dump, which has each thread's oldest first
+} ThreadEvent;
+
+
+// qsort() comparison, earliest first, each thread's in the order recorded
+int compareEvents(const void* first, const void* second) {
+    const ThreadEvent* a = first;
+    const ThreadEvent* b = second;
+
+    if (a->event.time != b->event.time)
+        return a->event.time < b->event.time ? -1 : 1;
+    if (a->thread != b->thread)
+        return a->thread < b->thread ? -1 : 1;
+    return a->order < b->order ? -1 : a->order > b->order;
+}
+
+// Reads every event in the dump into result, and their count into count
+// Returns false if the file is not a whole dump
+bool readEvents(FILE* file, TraceFileHeader* header, ThreadEvent** result,
+                size_t* count) {
+    if (fread(header, sizeof(*header), 1, file) != 1 ||
+        header->magic != TRACE_MAGIC)
+        return false;
+    header->module[TRACE_MODULE_SIZE - 1] = '\0';
+
+    ThreadEvent* events = NULL;
+    size_t capacity     = 0;
+    *count              = 0;
+
+    for (uint32_t ring = 0; ring < header->ring_count; ring++) {
+        TraceRingHeader ring_header;
+        if (fread(&ring_header, sizeof(ring_header), 1, file) != 1 ||
+            ring_header.count > header->ring_events) {
+            free(events);
+            return false;
+        }
+
+        if (*count + ring_header.count > capacity) {
+            capacity = 2 * (*count + ring_header.count);
+            events   = realloc(events, capacity * sizeof(ThreadEvent));
+        }
+
+        for (uint32_t ix = 0; ix < ring_header.count; ix++) {
+            ThreadEvent* next = &events[*count];
+            next->thread      = ring_header.thread;
+            next->order       = (*count)++;
+
+            if (fread(&next->event, sizeof(TraceEvent), 1, file) != 1) {
+                free(events);
+                return false;
+            }
+        }
+
+        if (ring_header.dropped > 0)
+            fprintf(stderr, "thread %u: %lu older events were overwritten\n",
+                    ring_header.thread, (unsigned long)ring_header.dropped);
+    }
+
+    *result = events;
+    return true;
+}
+
+void printEvent(const char* module, const ThreadEvent* next, uint64_t start,
+                bool verbose) {
+    const TraceEvent* event = &next->event;
+    unsigned long key       = event->key;
+
+    if (verbose)
+        printf("%12.6f  thread %-3u ", (event->time - start) / 1e9,
+               next->thread);
+
+    switch (event->type) {
+        case TRACE_PRESENT:
+            printf("%s is_present(%lu) = true", module, key);
+            break;
+        case TRACE_ABSENT:
+            printf("%s is_present(%lu) = false", module, key);
+            break;
+        case TRACE_GET:
+            printf("%s get(%lu)", module, key);
+            break;
+        case TRACE_INSERT:
+            printf("%s insert(%lu)", module, key);
+            break;
+        case TRACE_EVICT:
+            printf("%s evict key %lu", module, key);
+            break;
+        case TRACE_TOUCH:
+            printf("%s update_times(): >%lu", module, key);
+            break;
+        default:
+            printf("%s unknown event %u (%lu)", module, event->type, key);
+    }
+
+    if (verbose && event->slot != TRACE_NO_SLOT)
+        printf("  [slot %u]", event->slot);
+    printf("\n");
+}
+
+
+int main(int argc, char* argv[]) {
+    const char* filename = NULL;
+    bool verbose         = false;
+
+    for (int ix = 1; ix < argc; ix++) {
+        const char* value = NULL;
+
+        if (matchFlag(argv[ix], "verbose", &value) && value == NULL) {
+            verbose = true;
+        } else if (strncmp(argv[ix], "--", 2) != 0 && filename == NULL) {
+            filename = argv[ix];
+        } else {
+            fprintf(stderr, USAGE_FMT, argv[0]);
+            return 1;
+        }
+    }
+
+    if (filename == NULL) {
+        fprintf(stderr, USAGE_FMT, argv[0]);
+        return 1;
+    }
+
+    FILE* file = fopen(filename, "rb");
+    TraceFileHeader header;
+    ThreadEvent* events = NULL;
+    size_t count        = 0;
+
+    bool valid = file != NULL && readEvents(file, &header, &events, &count);
+    if (file != NULL)
+        fclose(file);
+
+    if (!valid) {
+        printErr(FILE_INVALID, filename, COMMAND_LINE_ARG_SIZE);
+        return 1;
+    }
+
+    qsort(events, count, sizeof(ThreadEvent), compareEvents);
+
+    uint64_t start = count > 0 ? events[0].event.time : 0;
+    for (size_t ix = 0; ix < count; ix++)
+        printEvent(header.module, &events[ix], start, verbose);
+
+    free(events);
+    return 0;
+}
@@ -3,13 +3,22 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define SIZE_INCREMENT 20
+#include "hash.h"
+
+#define SIZE_INCREMENT 20  // room made by the first add, doubled after that
+
+// keys below DIRECT_MIN plus DIRECT_SLACK per pair are indexed directly,
+// larger ones are hashed
+#define DIRECT_MIN 1024
+#define DIRECT_SLACK 4
 
 // typedef struct vec {
 //     void* base;
 //     size_t element_size;
 //     size_t allocated;
 //     size_t length;
+//     bool borrowed;
+//     KeyIndex index;
 // } *Vec;
 
 
@@ -19,23 +28,46 @@ Vec new_vec(size_t element_size) {
     v->base         = NULL;
     v->allocated    = 0;
     v->length       = 0;
+    v->borrowed     = false;
+    v->index        = NULL;
+    return v;
+}
+
+Vec vec_wrap(void* base, size_t element_size, size_t length) {
+    Vec v           = malloc(sizeof(struct vec));
+    v->element_size = element_size;
+    v->base         = base;
+    v->allocated    = length;
+    v->length       = length;
+    v->borrowed     = true;
+    v->index        = NULL;
     return v;
 }
 
 Vec vec_copy(Vec v) {
-    Vec nv            = malloc(sizeof(struct vec));
-    nv->element_size  = v->element_size;
-    nv->allocated     = v->allocated;
-    nv->length        = v->length;
-    size_t region_len = nv->element_size * nv->allocated;
-    nv->base          = malloc(region_len);
-    memcpy(nv->base, v->base, region_len);
+    Vec nv            = new_vec(v->element_size);
+    size_t region_len = v->element_size * v->length;
+
+    if (v->length > 0) {
+        nv->allocated = v->length;
+        nv->length    = v->length;
+        nv->base      = malloc(region_len);
+        memcpy(nv->base, v->base, region_len);
+    }
     return nv;
 }
 
+void _index_free(KeyIndex index) {
+    if (index != NULL) {
+        free(index->slots);
+        free(index);
+    }
+}
+
 void vec_free(Vec v) {
-    if (v->base)
+    if (v->base && !v->borrowed)
         free(v->base);
+    _index_free(v->index);
     free(v);
 }
 
@@ -43,26 +75,110 @@ size_t vec_length(Vec v) {
     return v->length;
 }
 
-void vec_add(Vec v, void* item) {
-    if (v->base == NULL) {
-        v->allocated = SIZE_INCREMENT;
-        v->base      = malloc(v->element_size * v->allocated);
-        v->length    = 0;
-    } else if (v->length == v->allocated) {
-        v->allocated += SIZE_INCREMENT;
-        v->base = realloc(v->base, v->element_size * v->allocated);
+void vec_reserve(Vec v, size_t count) {
+    if (count <= v->allocated && v->base != NULL && !v->borrowed)
+        return;
+
+    size_t allocated = count > v->length ? count : v->length;
+    if (allocated < SIZE_INCREMENT)
+        allocated = SIZE_INCREMENT;
+
+    // borrowed items are copied into memory of our own
+    if (v->borrowed) {
+        void* owned = malloc(v->element_size * allocated);
+        memcpy(owned, v->base, v->element_size * v->length);
+        v->base     = owned;
+        v->borrowed = false;
+    } else {
+        v->base = realloc(v->base, v->element_size * allocated);
+    }
+    v->allocated = allocated;
+}
+
+
+// Records the pair at ix, unless a pair before it has its key
+// Returns false if the index has no room for it
+bool _index_insert(KeyIndex index, const KeyPair pairs[], size_t ix) {
+    size_t key = pairs[ix].key;
+
+    index->sorted = index->sorted && (ix == 0 || pairs[ix - 1].key < key);
+
+    if (index->direct) {
+        if (key >= index->size)
+            return false;
+        if (index->slots[key] == 0)
+            index->slots[key] = ix + 1;
+        return true;
+    }
+
+    if (2 * (index->used + 1) > index->size)
+        return false;
+
+    size_t mask = index->size - 1;
+    size_t slot = fibonacci_hash(key, index->size);
+
+    for (;; slot = (slot + 1) & mask) {
+        if (index->slots[slot] == 0) {
+            index->slots[slot] = ix + 1;
+            index->used++;
+            return true;
+        }
+        if (pairs[index->slots[slot] - 1].key == key)
+            return true;
+    }
+}
+
+// Indexes every pair, with room to add as many again
+void _index_build(Vec v) {
+    const KeyPair* pairs = vec_items(v);
+    KeyIndex index       = malloc(sizeof(struct keyindex));
+    size_t max_key       = 0;
+
+    for (size_t ix = 0; ix < v->length; ix++)
+        if (pairs[ix].key > max_key)
+            max_key = pairs[ix].key;
+
+    index->used   = 0;
+    index->sorted = true;
+    index->direct = max_key < DIRECT_SLACK * v->length + DIRECT_MIN;
+
+    if (index->direct) {
+        index->size = DIRECT_SLACK * v->length + DIRECT_MIN;
+    } else {
+        index->size = 16;
+        while (index->size < 4 * v->length)
+            index->size <<= 1;
     }
+    index->slots = calloc(index->size, sizeof(uint32_t));
+
+    for (size_t ix = 0; ix < v->length; ix++)
+        _index_insert(index, pairs, ix);
+
+    _index_free(v->index);
+    v->index = index;
+}
+
+void vec_index_keys(Vec v) {
+    _index_build(v);
+}
+
+
+void vec_add(Vec v, void* item) {
+    if (v->base == NULL || v->borrowed || v->length == v->allocated)
+        vec_reserve(v, 2 * v->allocated);
+
     memcpy(v->base + v->length * v->element_size, item, v->element_size);
     v->length++;
+
+    // an index out of room is rebuilt larger
+    if (v->index != NULL && !_index_insert(v->index, v->base, v->length - 1))
+        _index_build(v);
 }
 
 void* vec_items(Vec v) {
     // this keeps clients from having to worry about getting a NULL
-    if (v->base == NULL) {
-        v->allocated = SIZE_INCREMENT;
-        v->base      = malloc(v->element_size * v->allocated);
-        v->length    = 0;
-    }
+    if (v->base == NULL)
+        vec_reserve(v, SIZE_INCREMENT);
     return v->base;
 }
 
@@ -73,7 +189,40 @@ void* vec_get(Vec v, size_t index) {
     return (char*)vec_items(v) + (index * v->element_size);
 }
 
+bool vec_keys_sorted(Vec v) {
+    if (v->index != NULL)
+        return v->index->sorted;
+
+    const KeyPair* pairs = vec_items(v);
+
+    for (size_t ix = 1; ix < v->length; ix++)
+        if (pairs[ix - 1].key >= pairs[ix].key)
+            return false;
+    return true;
+}
+
 KeyPair* vec_find_pair(const Vec vector, size_t key) {
+    KeyIndex index = vector->index;
+    KeyPair* pairs = vector->base;
+
+    if (index != NULL && index->direct)
+        return key < index->size && index->slots[key] != 0
+                   ? &pairs[index->slots[key] - 1]
+                   : NULL;
+
+    if (index != NULL) {
+        size_t mask = index->size - 1;
+        size_t slot = fibonacci_hash(key, index->size);
+
+        while (index->slots[slot] != 0) {
+            KeyPair* pair = &pairs[index->slots[slot] - 1];
+            if (pair->key == key)
+                return pair;
+            slot = (slot + 1) & mask;
+        }
+        return NULL;
+    }
+
     for (size_t ix = 0; ix < vec_length(vector); ix++) {
         KeyPair* pair = vec_get(vector, ix);
         if (pair->key == key)
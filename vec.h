@@ -1,35 +1,69 @@
 #ifndef VEC_H
 #define VEC_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "keypair.h"
 
+// Where each key of a vec of KeyPairs is, see vec_index_keys()
+typedef struct keyindex {
+    uint32_t* slots;  // 1 + index of the first pair with a key, 0 for none
+    size_t size;      // slots
+    size_t used;      // slots taken, when hashed
+    bool direct;      // slots[key] for small dense keys, hashed otherwise
+    bool sorted;      // every key is larger than the one before it
+} *KeyIndex;
+
 typedef struct vec {
     void* base;
     size_t element_size;
     size_t allocated;
     size_t length;
+    bool borrowed;   // base belongs to someone else, see vec_wrap()
+    KeyIndex index;  // NULL unless vec_index_keys() was called
 } *Vec;
 
 
 Vec new_vec(size_t element_size);
 
+// Returns a vec over length items already in memory, such as a mapped file,
+// without copying them. vec_free() leaves them alone, and the first
+// vec_add() copies them into memory of the vec's own
+Vec vec_wrap(void* base, size_t element_size, size_t length);
+
+// Copies the items, but not the spare room or the key index
 Vec vec_copy(Vec v);
 
 void vec_free(Vec v);
 
 size_t vec_length(Vec v);
 
+// Room doubles whenever it runs out
 void vec_add(Vec v, void* item);
 
+// Makes room for count items, so adding up to count takes no reallocation
+void vec_reserve(Vec v, size_t count);
+
 // do not retain this across vec_add calls!
 // Never returns NULL, even for empty lists
 void* vec_items(Vec v);
 
 void* vec_get(Vec v, size_t index);
 
-// Return Keypair in vec with corresponding key
+// Indexes a vec of KeyPairs by key, so vec_find_pair() is one lookup
+// instead of a scan. vec_add() keeps the index up to date, but keys must
+// not be changed in place. Built here rather than on a first lookup, so an
+// indexed vec can be searched from many threads at once
+void vec_index_keys(Vec v);
+
+// Returns true if every key in a vec of KeyPairs is larger than the one
+// before it. One scan, or none if the vec is indexed
+bool vec_keys_sorted(Vec v);
+
+// Return Keypair in vec with corresponding key, the first one if there are
+// several
 // Returns NULL if not found
 KeyPair* vec_find_pair(const Vec vector, size_t key);
 
@@ -0,0 +1,76 @@
+#include "workload.h"
+
+#include <math.h>
+#include <string.h>
+
+
+Workload new_workload(WorkloadType type, size_t max_key, double skew,
+                      uint64_t seed) {
+    if (max_key == 0)
+        return NULL;
+
+    Workload w  = malloc(sizeof(struct workload));
+    w->type     = type;
+    w->max_key  = max_key;
+    w->state    = seed;
+    w->zipf_cdf = NULL;
+
+    if (type == WORKLOAD_ZIPF) {
+        w->zipf_cdf = malloc(max_key * sizeof(double));
+        double sum  = 0;
+
+        for (size_t ix = 0; ix < max_key; ix++) {
+            sum += 1.0 / pow((double)(ix + 1), skew);
+            w->zipf_cdf[ix] = sum;
+        }
+        for (size_t ix = 0; ix < max_key; ix++)
+            w->zipf_cdf[ix] /= sum;
+    }
+    return w;
+}
+
+void workload_free(Workload w) {
+    if (w->zipf_cdf)
+        free(w->zipf_cdf);
+    free(w);
+}
+
+uint64_t random_next(uint64_t* state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z          = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z          = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+size_t workload_next(Workload w) {
+    uint64_t rand = random_next(&w->state);
+
+    if (w->type == WORKLOAD_UNIFORM)
+        return 1 + rand % w->max_key;
+
+    // Binary search the cdf for the first rank at or above the sample
+    double sample = (double)(rand >> 11) / (double)(1ULL << 53);
+    size_t low    = 0;
+    size_t high   = w->max_key - 1;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (w->zipf_cdf[mid] < sample)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low + 1;
+}
+
+bool parseWorkloadType(const char* name, WorkloadType* type) {
+    if (strcmp(name, "uniform") == 0) {
+        *type = WORKLOAD_UNIFORM;
+        return true;
+    }
+    if (strcmp(name, "zipf") == 0) {
+        *type = WORKLOAD_ZIPF;
+        return true;
+    }
+    return false;
+}
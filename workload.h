@@ -0,0 +1,42 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Synthetic key streams for the offline tools.
+// Keys are drawn from 1..max_key and the stream is fully determined by the
+// seed, so two runs with the same settings see the same keys.
+
+typedef enum workload_type {
+    WORKLOAD_UNIFORM,
+    WORKLOAD_ZIPF
+} WorkloadType;
+
+typedef struct workload {
+    WorkloadType type;
+    size_t max_key;
+    uint64_t state;
+    double* zipf_cdf;  // cumulative probabilities, only used for WORKLOAD_ZIPF
+} *Workload;
+
+
+// Returns NULL if max_key is 0
+// skew is the zipf exponent, ignored for uniform workloads
+Workload new_workload(WorkloadType type, size_t max_key, double skew,
+                      uint64_t seed);
+
+void workload_free(Workload w);
+
+// Returns the next key in the stream, between 1 and max_key
+size_t workload_next(Workload w);
+
+// splitmix64 step. Also usable as a general seeded generator
+uint64_t random_next(uint64_t* state);
+
+// Writes the type named by name ("uniform" or "zipf") into type
+// Returns false if the name is unknown
+bool parseWorkloadType(const char* name, WorkloadType* type);
+
+#endif